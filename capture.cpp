@@ -0,0 +1,188 @@
+#include "config.h"
+#include "capture.h"
+
+#if CAPTURE_ENABLED
+
+#include "timer.h"
+#include "gps.h"
+#include "prof.h"
+
+/* Record and replay. While capturing, everything the loop's decisions
+ * depend on goes into a RAM ring: the GPS bytes, as the decoders were handed
+ * them, the PPS captures, and the commands sent to the Rb, each stamped with
+ * timer time. It's pulled off over UDP (host/capture_pull) and fed back
+ * through the same decoders and pll_run() on the host (host/capture_replay).
+ *
+ * Offsets into the log count bytes since boot and only go up; the ring
+ * keeps the last CAPTURE_BUFFER_SIZE of them, so a puller that keeps up can
+ * take as long a capture as it likes.
+ *
+ * Every record is a type byte, then the timer ticks since the previous
+ * record as a zigzag varint (stamps needn't be in order: a PPS is logged
+ * when the loop notices it), then:
+ *   CAPTURE_START  8-byte timer time, LE; protocol name, length-prefixed.
+ *                  The tick delta is 0. Starts every capture.
+ *   CAPTURE_GPS    length, bytes. Stamped with when the span was polled.
+ *   CAPTURE_PPS    edges since the last one, TC_RA. Stamped with the edge.
+ *   CAPTURE_RB     length, bytes.
+ * Lengths and counts are unsigned varints: 7 bits a byte, low first.
+ */
+
+static unsigned char capture_buf[CAPTURE_BUFFER_SIZE];
+static uint32_t capture_head;     /* Bytes ever written */
+static uint32_t capture_first;    /* Offset of this capture's START */
+static char capture_on;
+static uint64_t capture_tick;     /* Of the last record */
+static uint32_t capture_count;    /* pps_count of the last PPS */
+
+static void capture_put(unsigned char ch) {
+  capture_buf[capture_head++ % CAPTURE_BUFFER_SIZE] = ch;
+}
+
+static void capture_put_varint(uint64_t val) {
+  while (val >= 0x80) {
+    capture_put(val | 0x80);
+    val >>= 7;
+  }
+  capture_put(val);
+}
+
+static void capture_put_bytes(const void *buf, unsigned int len) {
+  const unsigned char *p = (const unsigned char *)buf;
+  capture_put_varint(len);
+  while (len--)
+    capture_put(*p++);
+}
+
+static void capture_record(enum capture_type_t type, uint64_t tick) {
+  int64_t delta = tick - capture_tick;
+  capture_tick = tick;
+  capture_put(type);
+  capture_put_varint((uint64_t)delta << 1 ^ (uint64_t)(delta >> 63));
+}
+
+void capture_start() {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  uint32_t masked = prof_cycles();
+  capture_first = capture_head;
+  capture_tick = timer_now();
+  capture_count = pps_count;
+  capture_put(CAPTURE_START);
+  capture_put(0);
+  for (int i = 0 ; i < 8 ; i++)
+    capture_put(capture_tick >> (8 * i));
+  const char *name = gps_get_status();
+  capture_put_bytes(name, strcspn(name, " "));
+  capture_on = 1;
+  if (!primask)
+    prof_end(PROF_IRQ_MASKED, masked);
+  __set_PRIMASK(primask);
+}
+
+void capture_stop() {
+  capture_on = 0;
+}
+
+const char *capture_get_status() {
+  static char status[48];
+
+  snprintf(status, sizeof(status), "%s from %lu, at %lu",
+      capture_on ? "capturing" : "stopped",
+      (unsigned long)capture_first, (unsigned long)capture_head);
+  return status;
+}
+
+void capture_gps(const unsigned char *buf, unsigned int len, uint64_t tick) {
+  if (!capture_on)
+    return;
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  uint32_t masked = prof_cycles();
+  capture_record(CAPTURE_GPS, tick);
+  capture_put_bytes(buf, len);
+  if (!primask)
+    prof_end(PROF_IRQ_MASKED, masked);
+  __set_PRIMASK(primask);
+}
+
+void capture_pps(uint32_t count, uint32_t tm, uint64_t tick) {
+  if (!capture_on)
+    return;
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  uint32_t masked = prof_cycles();
+  capture_record(CAPTURE_PPS, tick);
+  capture_put_varint(count - capture_count);
+  capture_put_varint(tm);
+  capture_count = count;
+  if (!primask)
+    prof_end(PROF_IRQ_MASKED, masked);
+  __set_PRIMASK(primask);
+}
+
+void capture_rb(const char *buf, unsigned int len) {
+  if (!capture_on)
+    return;
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  uint32_t masked = prof_cycles();
+  capture_record(CAPTURE_RB, timer_now());
+  capture_put_bytes(buf, len);
+  if (!primask)
+    prof_end(PROF_IRQ_MASKED, masked);
+  __set_PRIMASK(primask);
+}
+
+/* Up to len bytes of the log from *offset on. If that's already been
+ * overwritten, *offset moves up to the oldest byte we still have.
+ */
+unsigned int capture_read(uint32_t *offset, unsigned char *buf, unsigned int len) {
+  if (capture_head - *offset > CAPTURE_BUFFER_SIZE)
+    *offset = capture_head - CAPTURE_BUFFER_SIZE;
+  if (len > capture_head - *offset)
+    len = capture_head - *offset;
+  for (unsigned int i = 0 ; i < len ; i++)
+    buf[i] = capture_buf[(*offset + i) % CAPTURE_BUFFER_SIZE];
+  return len;
+}
+
+uint32_t capture_get_head() {
+  return capture_head;
+}
+
+#else
+
+void capture_start() {
+  /* empty */
+}
+
+void capture_stop() {
+  /* empty */
+}
+
+const char *capture_get_status() {
+  return "disabled";
+}
+
+void capture_gps(const unsigned char *buf, unsigned int len, uint64_t tick) {
+  /* empty */
+}
+
+void capture_pps(uint32_t count, uint32_t tm, uint64_t tick) {
+  /* empty */
+}
+
+void capture_rb(const char *buf, unsigned int len) {
+  /* empty */
+}
+
+unsigned int capture_read(uint32_t *offset, unsigned char *buf, unsigned int len) {
+  return 0;
+}
+
+uint32_t capture_get_head() {
+  return 0;
+}
+
+#endif
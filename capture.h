@@ -0,0 +1,23 @@
+#ifndef __CAPTURE_H
+#define __CAPTURE_H
+
+/* Record types in the capture log; the layout is described in capture.cpp */
+enum capture_type_t {
+  CAPTURE_START = 1,
+  CAPTURE_GPS,
+  CAPTURE_PPS,
+  CAPTURE_RB,
+};
+
+extern void capture_start();
+extern void capture_stop();
+extern const char *capture_get_status();
+
+extern void capture_gps(const unsigned char *buf, unsigned int len, uint64_t tick);
+extern void capture_pps(uint32_t count, uint32_t tm, uint64_t tick);
+extern void capture_rb(const char *buf, unsigned int len);
+
+extern unsigned int capture_read(uint32_t *offset, unsigned char *buf, unsigned int len);
+extern uint32_t capture_get_head();
+
+#endif
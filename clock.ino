@@ -7,36 +7,59 @@
 #include "rb.h"
 #include "health.h"
 #include "monitor.h"
+#include "hist.h"
+#include "history.h"
+#include "log.h"
+#include "prof.h"
 
 void setup() {
   console_init();
+  log_init();
+  prof_init();
   timer_init();
   gps_init();
   rb_init();
+  pll_load_state();
   ether_init();
 }
 
 static char pll_was_running = 0;
 
 void loop() {
-  if (pps_int) {
-    pps_int = 0;
+  if (gps_time_ready()) {
+    gps_time_edge();
     health_print_status();
     char run_pll = health_should_run_pll();
     if (run_pll) {
       if (!pll_was_running) {
         pll_reset_state();
       }
+      uint32_t start = prof_cycles();
       pll_run();
+      prof_end(PROF_PLL_RUN, start);
     }
     pll_was_running = run_pll;
     ethernet_send_ntp_stats();
+    hist_report();
+    prof_report();
     monitor_flush();
   }
-  console_write_buffered();
+  if (second_tick) {
+    second_tick = 0;
+    if (health_get_status() == HEALTH_HOLDOVER)
+      pll_holdover_run();
+    history_record();
+  }
+  uint32_t start = prof_cycles();
   gps_poll();
+  prof_end(PROF_GPS_POLL, start);
+  rb_poll();
   if (ether_int) {
     ether_recv();
   }
+  monitor_poll();
   console_handle_input();
+  if (!ether_int)
+    log_drain();
+  console_poll();
 }
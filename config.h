@@ -1,13 +1,27 @@
 #include <Arduino.h>
 
-#define Console Serial
+#define Console console_out /* Output, queued (see console.cpp) */
+#define CONSOLE_PORT Serial /* Input, and where the output goes */
+#define CONSOLE_UART UART   /* CONSOLE_PORT's UART, for PDC transmit */
 #define GPS Serial1
+#define GPS_USART USART0 /* Serial1's USART, for PDC receive */
 #define Rb Serial2
+#define RB_USART USART1 /* Serial2's USART, for PDC transmit */
 
-#define GPS_SIRFIII 0
-#define GPS_TSIP 0
-#define GPS_UBLOX 1
+/* Until set with "gps protocol": GPS_PROTOCOL_UBLOX, _TSIP, _SIRF or _NMEA */
+#define GPS_DEFAULT_PROTOCOL GPS_PROTOCOL_UBLOX
 #define GPS_UBLOX_TIMESTAMP 1
+#define GPS_PROBE_WINDOW_MS 3000 /* Time to listen at each baud rate */
+#define GPS_PROBE_MIN_FRAMES 4
+#define UBX_CFG_TIMEOUT_MS 1000 /* For each ACK or poll reply */
+#define UBX_CFG_RETRIES 3
+#define GPS_SURVEY_MIN_SEC 3600 /* Survey-in: at least this long */
+#define GPS_SURVEY_ACC_MM 5000  /* and at least this good */
+#define GPS_MAX_SATS 48
+#define GPS_SAT_TIMEOUT_MS 30000 /* Forget satellites not mentioned for this long */
+#define GPS_SAT_REPORT_MS 10000  /* Satellite summary to the monitor this often */
+#define GPS_TIME_RECORDS 8 /* Seconds of receiver time messages kept; TIM-TM2 needs three */
+#define GPS_TIME_WAIT_MS 1800 /* Longest an edge waits for its record; TIM-TM2 can be a second late */
 
 #define DEBUG 1
 
@@ -44,20 +58,93 @@
 #define PLL_STARTUP_THRESHOLD 80000
 #define PLL_MIN_FACTOR 600
 #define PLL_MAX_FACTOR 10800
+#define PLL_GEAR_FALLBACK_SEC 3 /* Shift down after this many bad seconds in a row */
 
 #define PPS_FILTER_MIN 8
 #define PPS_FILTER_MAX 24
 #define PPS_FILTER_DIV 300
 
 #define PLL_HEALTHY_THRESHOLD_NS 1000 /* PLL is synced if within this range */
+#define PLL_SLEW_THRESHOLD_NS 100000 /* Slew the timer phase if further out than this... */
+#define PLL_SLEW_STEP_NS 10000 /* ... or if the phase jumps by this much */
+#define PLL_SLEW_LIMIT_NS 4000000 /* Jam sync instead of slewing past this */
+#define PLL_SLEW_MAX_NS 20000 /* Default max slew per second (20ppm) */
 #define HOLDOVER_LIMIT_SEC 86400 /* Can holdover for this many seconds after having a valid frequency */
+#define PLL_DRIFT_HOURS 48 /* Hourly frequency averages to fit the aging rate over */
+#define PLL_DRIFT_MIN_HOURS 6 /* Don't predict aging until we have this many */
+#define PLL_DRIFT_MIN_SAMPLES 3000 /* Seconds locked needed for an hour to count */
+#define PLL_HOLDOVER_FLOOR_PPT 100 /* Minimum frequency error assumed in holdover */
+
+#define PLL_STATE_SAVE_SEC 3600 /* Save loop state to flash this often while locked */
+#define PLL_STATE_MAX_AGE_SEC 604800 /* Discard saved loop state older than this at boot */
+#define STORAGE_PAGES_PER_SLOT 16 /* Flash pages to wear-level each saved record across */
+
+/* Rb telemetry queries. Each should get a one-line reply whose last
+ * number is the value, in the units noted; values are kept in tenths.
+ */
+#define RB_CMD_STATUS "s?\r\n"
+#define RB_CMD_TEMP "t?\r\n"   /* degrees C */
+#define RB_CMD_LAMP "l?\r\n"   /* lamp voltage */
+#define RB_CMD_HEATER "h?\r\n" /* heater voltage */
+#define RB_CMD_FREQ "f?\r\n"   /* frequency offset, same units as f command */
+#define RB_QUERY_INTERVAL_MS 10000
+#define RB_REPLY_TIMEOUT_MS 500
+#define RB_MAX_MISSED 3 /* Minor alarm after this many queries in a row go unanswered */
+#define RB_LAMP_MIN 40 /* Minor alarm if lamp drops below this (tenths) */
+#define RB_HEATER_MAX 100 /* Minor alarm if heater rises above this (tenths) */
+#define RB_TEMP_MAX 650 /* Minor alarm if internal temp rises above this (tenths) */
 
 #define MONITOR_ENABLED 1
 #define MONITOR_IP_ADDRESS 192,168,1,3
 #define MONITOR_MAC_ADDRESS 0x78,0x8a,0x20,0xba,0x29,0xc9
 #define MONITOR_PORT 2003
 #define MONITOR_PREFIX "duet."
-
-#define CONSOLE_OUTBUF_SIZE 512
+#define MONITOR_WINDOW_SEC 10 /* Aggregation window at boot; 1 sends every sample */
+#define MONITOR_WINDOW_MAX 3600
+#define MONITOR_BINARY 0 /* Binary packets at boot, for host/telemetry_relay */
+#define MONITOR_BUFFERS 4 /* Packets: one filling, the rest waiting for the link */
+
+#define HIST_ENABLED 1
+#define HIST_SUB_BITS 3 /* 8 buckets to each power of 2: within 12.5% */
+#define HIST_MAX_BITS 24 /* Values from 2^24 up share the top bucket */
+#define HIST_REPORT_SEC 60 /* Percentiles to the monitor this often */
+
+#define PROF_ENABLED 1 /* Cycle counts of the hot paths; reported with the histograms */
+
+#define CAPTURE_ENABLED 1
+#define CAPTURE_BUFFER_SIZE 32768 /* Power of 2 */
+#define CAPTURE_PORT 2004 /* UDP, for pulling the log */
+
+/* A record every HISTORY_STEP_SEC, about 1.8 bytes with the phase +/-30ns
+ * noisy, so 16k is a day and a bit.
+ */
+#define HISTORY_ENABLED 1
+#define HISTORY_BUFFER_SIZE 16384 /* Power of 2; a day is about 15KB */
+#define HISTORY_STEP_SEC 10 /* Seconds summed up in a record */
+#define HISTORY_PHASE_QUANTUM_NS 4 /* Resolution of the phases kept */
+#define HISTORY_BLOCK 64 /* Records staged and encoded together, max 255 */
+#define HISTORY_PORT 2005 /* UDP, for pulling the history */
+
+#define LOG_RECORDS 128 /* Console output waiting for loop(); a second of PLL debug fits */
+#define LOG_IRQ_RECORDS 32 /* The same from interrupts, kept apart from loop lines */
+#define LOG_DRAIN_MAX 16 /* Printed a pass of loop() at most */
+#define LOG_LEVEL_DEFAULT LOG_DEBUG /* Each subsystem's, till "log" says otherwise */
+#define LOG_LINE_MAX 160 /* Longer lines are split */
+#define CONSOLE_TX_SIZE 2048 /* Power of 2; about 180ms at 115200 */
+#define CONSOLE_LINE_ROOM 128 /* Free in the ring before a long reply's next line */
+#define CONSOLE_LINE_MAX 160 /* Reply lines longer than this are split */
 #define CONSOLE_CMDLINE_SIZE 512
 
+/* Static RAM, of the Due's 96KB, in the big buffers above:
+ *   capture ring                 32KB
+ *   history ring + staging       17.5KB
+ *   histograms (4 x 176 x 2)     6.2KB
+ *   monitor packets (4 x 1KB)    4KB
+ *   console ring + command line  2.5KB
+ *   log records + line           1.7KB
+ *   ethernet frame + reply       1.8KB
+ *   GPS receive (2 x 256)        0.5KB
+ * That's about 66KB, leaving 30KB for the core's EMAC rings, everything
+ * else and the stack. Growing one of these means shrinking another.
+ */
+
@@ -1,8 +1,15 @@
 #include "config.h"
+#include "console.h"
 #include "system.h"
 #include "timing.h"
 #include "gps.h"
 #include "rb.h"
+#include "capture.h"
+#include "monitor.h"
+#include "hist.h"
+#include "history.h"
+#include "log.h"
+#include "prof.h"
 
 #define WORDS 10
 
@@ -13,17 +20,134 @@ static char *cmd_word[WORDS];
 static char *bufpos;
 static int cmd_words = 0;
 
-char console_outbuf[CONSOLE_OUTBUF_SIZE];
-
 static void console_reset_input();
 void console_handle_input();
 static void console_handle_command();
 
+/* Output goes into a ring and out through the UART's PDC, a contiguous
+ * run at a time, so printing never waits on the port, and it doesn't
+ * matter to the loop whether anyone's listening. As with the Rb, the core
+ * owns the UART interrupt, so a finished run is noticed by console_poll(),
+ * from loop() and on every write.
+ *
+ * Nothing waits for room. Log lines go in whole or not at all, and so do
+ * the lines of command replies, which are kept here till they're done (or
+ * till console_poll(), for a prompt). A line that doesn't fit is dropped
+ * and counted, and the count goes out ahead of the next that fits.
+ * Replies longer than a line or two (console_print_lines()) are printed a
+ * line at a time from console_poll() as the ring empties, so they're never
+ * dropped.
+ */
+static char console_tx[CONSOLE_TX_SIZE];
+static uint32_t console_tx_head, console_tx_tail; /* Bytes ever queued, sent */
+static unsigned int console_tx_sending;           /* With the PDC */
+static uint32_t console_dropped;                  /* Lines, since last said */
+static char console_reply[CONSOLE_LINE_MAX];      /* Reply line so far */
+static unsigned int console_reply_len;
+
+static console_lines_t console_lines;             /* Reply being printed */
+static unsigned int console_lines_pos;
+
+ConsoleOutput console_out;
+
 void console_init() {
   while (!Serial);
 
   console_reset_input();
-  Console.begin(115200);
+  CONSOLE_PORT.begin(115200);
+}
+
+static void console_tx_poll() {
+  if (console_tx_sending) {
+    if (CONSOLE_UART->UART_TCR)
+      return;
+    console_tx_tail += console_tx_sending;
+    console_tx_sending = 0;
+  }
+  if (console_tx_head == console_tx_tail)
+    return;
+
+  unsigned int start = console_tx_tail % CONSOLE_TX_SIZE;
+  unsigned int len = console_tx_head - console_tx_tail;
+  if (len > CONSOLE_TX_SIZE - start)
+    len = CONSOLE_TX_SIZE - start;
+  CONSOLE_UART->UART_TPR = (uintptr_t)(console_tx + start);
+  CONSOLE_UART->UART_TCR = len;
+  CONSOLE_UART->UART_PTCR = UART_PTCR_TXTEN;
+  console_tx_sending = len;
+}
+
+static unsigned int console_room() {
+  return CONSOLE_TX_SIZE - (console_tx_head - console_tx_tail);
+}
+
+static void console_put(const char *buf, unsigned int len) {
+  while (len--)
+    console_tx[console_tx_head++ % CONSOLE_TX_SIZE] = *buf++;
+}
+
+/* The drop count, if it fits with len more after it. False if not. */
+static bool console_put_dropped(unsigned int len) {
+  char note[40];
+  unsigned int note_len;
+
+  if (!console_dropped)
+    return true;
+  note_len = snprintf(note, sizeof(note), "[%lu lines dropped]\r\n", (unsigned long)console_dropped);
+  if (console_room() < note_len + len)
+    return false;
+  console_put(note, note_len);
+  console_dropped = 0;
+  return true;
+}
+
+static void console_flush_reply() {
+  if (console_reply_len) {
+    console_write_line(console_reply, console_reply_len);
+    console_reply_len = 0;
+  }
+}
+
+/* From loop(): keeps the PDC going, and a long reply coming */
+void console_poll() {
+  console_flush_reply();
+  console_tx_poll();
+  while (console_lines && console_room() >= CONSOLE_LINE_ROOM) {
+    if (!console_lines(&console_lines_pos))
+      console_lines = NULL;
+    console_flush_reply();
+    console_tx_poll();
+  }
+}
+
+/* lines(&pos) prints a line and moves pos on, from 0, returning false
+ * once there's nothing left to print. Replaces any reply still going.
+ */
+void console_print_lines(console_lines_t lines) {
+  console_lines = lines;
+  console_lines_pos = 0;
+  console_poll();
+}
+
+/* False if it was dropped */
+bool console_write_line(const char *buf, unsigned int len) {
+  console_tx_poll();
+  if (!console_put_dropped(len) || console_room() < len) {
+    console_dropped++;
+    return false;
+  }
+  console_put(buf, len);
+  console_tx_poll();
+  return true;
+}
+
+/* Replies, a line at a time; longer lines are split */
+void console_write(const char *buf, unsigned int len) {
+  while (len--) {
+    console_reply[console_reply_len++] = *buf;
+    if (*buf++ == '\n' || console_reply_len == CONSOLE_LINE_MAX)
+      console_flush_reply();
+  }
 }
 
 static void console_reset_input() {
@@ -34,17 +158,10 @@ static void console_reset_input() {
   cmd_words = 0;
 }
 
-void console_write_buffered() {
-  if (console_outbuf[0] != '\0') {
-    Console.print(console_outbuf);
-    console_outbuf[0] = '\0';
-  }
-}
-
 void console_handle_input() {
-  if (!Console.available())
+  if (!CONSOLE_PORT.available())
     return;
-  char ch = Console.read();
+  char ch = CONSOLE_PORT.read();
 
   if (!console_input) {
     console_input = 1;
@@ -67,6 +184,7 @@ void console_handle_input() {
       cmd_words--;
     }
   } else if (ch == 3 || ch == '\e') { // ^C or escape
+    console_lines = NULL;
     Console.print("^C\r\n");
     console_reset_input();
     return;
@@ -96,10 +214,21 @@ void console_handle_input() {
     goto invalid;\
 } while (0)
 
+#define get_set_str(pos, getter, setter) do {\
+  if (cmd_words == (pos + 1)) {\
+    if (!setter(cmd_word[pos]))\
+      goto invalid;\
+  } else if (cmd_words == (pos))\
+    Console.println(getter());\
+  else\
+    goto invalid;\
+} while (0)
+
 #define getset(pos, type, prefix, suffix) \
   get_set_##type(pos, prefix##_get_##suffix, prefix##_set_##suffix)
 
 static void console_handle_command() {
+  console_lines = NULL;
   if (commandmatch(0, "reboot")) {
     system_reboot();
   }  else if (commandmatch(0, "pll")) {
@@ -109,6 +238,12 @@ static void console_handle_command() {
       getset(2, int, pll, max);
     else if (commandmatch(1, "factor"))
       getset(2, int, pll, factor);
+    else if (commandmatch(1, "gear"))
+      getset(2, int, pll, gear);
+    else if (commandmatch(1, "slew"))
+      getset(2, int, pll, slew);
+    else if (commandmatch(1, "save"))
+      pll_save_state();
     else if (commandmatch(1, "disable"))
       pll_set_enabled(false);
     else if (commandmatch(1, "enable"))
@@ -127,6 +262,14 @@ static void console_handle_command() {
   } else if (commandmatch(0, "gps")) {
     if (commandmatch(1, "init"))
       gps_init();
+    else if (commandmatch(1, "protocol"))
+      getset(2, str, gps, protocol);
+    else if (commandmatch(1, "status"))
+      Console.println(gps_get_status());
+    else if (commandmatch(1, "survey"))
+      gps_survey_restart();
+    else if (commandmatch(1, "sats"))
+      gps_sat_print();
     else goto invalid;
   } else if (commandmatch(0, "rb")) {
     if (commandmatch(1, "init"))
@@ -136,6 +279,60 @@ static void console_handle_command() {
     else if (commandmatch(1, "off"))
       rb_disable();
     else goto invalid;
+  } else if (commandmatch(0, "capture")) {
+    if (commandmatch(1, "start"))
+      capture_start();
+    else if (commandmatch(1, "stop"))
+      capture_stop();
+    else if (cmd_words == 1 || commandmatch(1, "status"))
+      Console.println(capture_get_status());
+    else goto invalid;
+  } else if (commandmatch(0, "history")) {
+    /* history [offset]: one block a time, then the offset of the next */
+    if (cmd_words == 1)
+      Console.println(history_get_status());
+    else if (cmd_words == 2)
+      history_print_block(strtoul(cmd_word[1], NULL, 0));
+    else goto invalid;
+  } else if (commandmatch(0, "hist")) {
+    /* hist [name | reset [name]] */
+    if (cmd_words == 1)
+      hist_print_summary();
+    else if (commandmatch(1, "reset")) {
+      if (!hist_reset(cmd_words > 2 ? cmd_word[2] : NULL))
+        goto invalid;
+    } else if (cmd_words == 2) {
+      if (!hist_print_buckets(cmd_word[1]))
+        goto invalid;
+    } else goto invalid;
+  } else if (commandmatch(0, "prof")) {
+    /* prof [reset] */
+    if (cmd_words == 1)
+      prof_print_summary();
+    else if (commandmatch(1, "reset") && cmd_words == 2)
+      prof_reset();
+    else goto invalid;
+  } else if (commandmatch(0, "log")) {
+    /* log [subsystem|all level] */
+    if (cmd_words == 1)
+      log_print_levels();
+    else if (cmd_words == 3) {
+      if (!log_set_level(cmd_word[1], cmd_word[2]))
+        goto invalid;
+    } else goto invalid;
+  } else if (commandmatch(0, "monitor")) {
+    /* monitor window [[metric] seconds] */
+    if (commandmatch(1, "window") && cmd_words == 2)
+      monitor_print_windows();
+    else if (commandmatch(1, "window") && cmd_words == 3) {
+      if (!monitor_set_window(NULL, atoi(cmd_word[2])))
+        goto invalid;
+    } else if (commandmatch(1, "window") && cmd_words == 4) {
+      if (!monitor_set_window(cmd_word[2], atoi(cmd_word[3])))
+        goto invalid;
+    } else if (commandmatch(1, "format"))
+      getset(2, str, monitor, format);
+    else goto invalid;
   } else {
     invalid:
     Console.print("Unknown command ");
@@ -3,20 +3,32 @@
 
 extern void console_init();
 extern void console_handle_input();
-extern void console_write_buffered();
+extern void console_poll();
+extern bool console_write_line(const char *buf, unsigned int len);
+extern void console_write(const char *buf, unsigned int len);
+
+/* A reply too long to print at once, a line a call (console.cpp) */
+typedef bool (*console_lines_t)(unsigned int *pos);
+extern void console_print_lines(console_lines_t lines);
 
 extern char console_input;
-extern char *console_outbuf;
 
 #define in_interrupt() (__get_IPSR() & 0x1f)
 
-#define console_print(...) do{\
-  if (in_interrupt()) {\
-    String _tmpstr(__VA_ARGS__);\
-    strncat(console_outbuf, _tmpstr.c_str(), CONSOLE_OUTBUF_SIZE - (strlen(console_outbuf) + 1));\
-  } else {\
-    Console.print(__VA_ARGS__);\
-  }\
-} while(0)
+/* Console: command replies, into the same ring as the log (console.cpp) */
+class ConsoleOutput : public Print {
+  public:
+    size_t write(uint8_t ch) {
+      console_write((const char *)&ch, 1);
+      return 1;
+    }
+    size_t write(const uint8_t *buf, size_t len) {
+      console_write((const char *)buf, len);
+      return len;
+    }
+    using Print::write;
+};
+
+extern ConsoleOutput console_out;
 
 #endif
@@ -4,14 +4,22 @@
 #if DEBUG
 
 #include "console.h"
+#include "log.h"
 
-#define _cprint(...) do { if(!console_input) console_print(__VA_ARGS__); } while(0)
+/* Off, each of these is a load and a branch: the level test comes first */
+#define _cprint(...) do { if(log_enabled(LOG_SUBSYSTEM, LOG_DEBUG) && !console_input) log_piece(__VA_ARGS__); } while(0)
 
 #define debug(x) _cprint(x)
 #define debug_int(x) _cprint(x)
 #define debug_long(x) _cprint(x)
 #define debug_float(x) _cprint(x, 2)
 #define debug_hex(x) _cprint(x, HEX)
+/* A whole line in one record: fmt as log.h describes, one argument */
+#define debugf(fmt, x) do { if(log_enabled(LOG_SUBSYSTEM, LOG_DEBUG) && !console_input) log_put(fmt, (uintptr_t)(x)); } while(0)
+/* The same, for things gone wrong: on at LOG_ERROR */
+#define errorf(fmt, x) do { if(log_enabled(LOG_SUBSYSTEM, LOG_ERROR) && !console_input) log_put(fmt, (uintptr_t)(x)); } while(0)
+/* And a line of them with nothing to fill in */
+#define error(s) do { if(log_enabled(LOG_SUBSYSTEM, LOG_ERROR) && !console_input) log_text(s); } while(0)
 
 #else
 
@@ -20,6 +28,9 @@
 #define debug_long(x)
 #define debug_float(x)
 #define debug_hex(x)
+#define debugf(fmt, x)
+#define errorf(fmt, x)
+#define error(s)
 
 #endif /* DEBUG */
 
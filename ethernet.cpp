@@ -1,8 +1,14 @@
+#define LOG_SUBSYSTEM LOG_ETHERNET /* For debug.h */
 #include "config.h"
 #include "debug.h"
 #include "timing.h"
+#include "timer.h"
 #include "health.h"
 #include "monitor.h"
+#include "capture.h"
+#include "hist.h"
+#include "history.h"
+#include "prof.h"
 #include "ethernet_phy.h"
 #include "mini_ip.h"
 
@@ -19,6 +25,7 @@ const int32_t NTP_FUDGE_TX = (NTP_FUDGE_TX_US * 429497) / 100;
 volatile char ether_int = 0;
 uint32_t eh_ts_upper, eh_ts_lower;
 uint32_t recv_ts_upper, recv_ts_lower;
+uint32_t eh_tm, recv_tm; /* TIMER_CLOCK at the receive interrupt */
 
 int ntp_invalid = 0, ntp_wrongversion = 0, ntp_wrongmode = 0, ntp_error = 0, ntp_ok = 0;
 
@@ -36,14 +43,15 @@ static const char ntp_packet_template[48] = {
   0, 0, 0, 0, 0, 0, 0, 0 /* Transmit Timestamp */
 };
 
-void ethernet_send_udp_packet(const char dst_ip[4], const char dst_mac[6],
+/* False if it couldn't be queued */
+bool ethernet_send_udp_packet(const char dst_ip[4], const char dst_mac[6],
     uint16_t dst_port, uint16_t src_port, const char *payload, unsigned int len) {
   unsigned char sndbuf[ETH_HEADER_SIZE + ETH_IP_HEADER_SIZE + ETH_UDP_HEADER_SIZE + 1024];
   uint32_t ip_checksum = 0;
 
   if (len > 1024) {
     debug("Tried to send a too-long packet");
-    return;
+    return false;
   }
 
   p_ethernet_header_t p_eth_header = (p_ethernet_header_t)sndbuf;
@@ -85,8 +93,15 @@ void ethernet_send_udp_packet(const char dst_ip[4], const char dst_mac[6],
   uint8_t ul_rc = emac_dev_write(&gs_emac_dev, sndbuf,
       ETH_HEADER_SIZE + ETH_IP_HEADER_SIZE + ETH_UDP_HEADER_SIZE + len, NULL);
   if (ul_rc != EMAC_OK) {
-    debug("UDP send error: 0x"); debug_hex(ul_rc); debug("\r\n");
+    errorf("UDP send error: 0x%lx\r\n", ul_rc);
+    return false;
   }
+  return true;
+}
+
+/* Nothing waiting in the EMAC's transmit ring */
+bool ethernet_tx_idle() {
+  return emac_dev_get_tx_load(&gs_emac_dev) == 0;
 }
 
 
@@ -147,17 +162,21 @@ void do_ntp_request(unsigned char *pkt, unsigned int len) {
     }
     /* XXX set Leap Indicator */
 
-    /* Assuming we had a good lock, the Rb should be stable to within
-     * a few e-10 over the time we're in holdover. And a little experimentation
-     * shows it to be better than 1e-10 under good conditions. Be conservative and
-     * accumulate rootdisp at a rate of 1e-9 (3.6us/hour). That's still better than
-     * all but a good local clock after 24h.
+    /* Root dispersion grows with time since we last had a good lock, at
+     * the rate the holdover predictor thinks it's earned: the fit
+     * residuals of the Rb's frequency and aging, plus a 1e-10 floor. Until
+     * there's enough history to fit, accumulate at a conservative 1e-9
+     * (3.6us/hour). That's still better than all but a good local clock
+     * after 24h. A phase slew still to go is error we know we have, and
+     * can take minutes to work off, so it's added on.
      */
     if (version == 1) {
       // 4 / 2^32 ~~ 1e-9
       buf[11] = 4;
     } else {
-      rootdisp = (health_get_ref_age() + 7629) / 15259;
+      int32_t slew = timers_get_slew_remaining();
+      uint32_t slew_ns = (uint32_t)(slew < 0 ? -slew : slew) * NSPT;
+      rootdisp = (pll_holdover_error(health_get_ref_age()) + slew_ns + 7629) / 15259;
       buf[8] = (rootdisp >> 24) & 0xff;
       buf[9] = (rootdisp >> 16) & 0xff;
       buf[10] = (rootdisp >> 8) & 0xff;
@@ -205,9 +224,13 @@ void do_ntp_request(unsigned char *pkt, unsigned int len) {
     uint8_t ul_rc = emac_dev_write(&gs_emac_dev, pkt,
         48 + ETH_HEADER_SIZE + ETH_IP_HEADER_SIZE + ETH_UDP_HEADER_SIZE, NULL);
     if (ul_rc != EMAC_OK) {
-      debug("NTP send error: 0x"); debug_hex(ul_rc); debug("\r\n");
+      errorf("NTP send error: 0x%lx\r\n", ul_rc);
       ntp_error++;
     } else {
+      int32_t ticks = *TIMER_CLOCK - recv_tm;
+      if (ticks < 0)
+        ticks += HZ;
+      hist_record(HIST_NTP, ticks);
       ntp_ok++;
     }
   } else {
@@ -216,11 +239,11 @@ void do_ntp_request(unsigned char *pkt, unsigned int len) {
 }
 
 void ethernet_send_ntp_stats() {
-  monitor_send("ntp.invalid", ntp_invalid);
-  monitor_send("ntp.wrongversion", ntp_wrongversion);
-  monitor_send("ntp.wrongmode", ntp_wrongmode);
-  monitor_send("ntp.error", ntp_error);
-  monitor_send("ntp.ok", ntp_ok);
+  monitor_send(MONITOR_NTP_INVALID, ntp_invalid);
+  monitor_send(MONITOR_NTP_WRONGVERSION, ntp_wrongversion);
+  monitor_send(MONITOR_NTP_WRONGMODE, ntp_wrongmode);
+  monitor_send(MONITOR_NTP_ERROR, ntp_error);
+  monitor_send(MONITOR_NTP_OK, ntp_ok);
 
   ntp_invalid = 0;
   ntp_wrongversion = 0;
@@ -229,6 +252,37 @@ void ethernet_send_ntp_stats() {
   ntp_ok = 0;
 }
 
+/* Capture log and history, both read by offset: the request is a 4-byte
+ * offset, and the reply is the offset it starts from, the end of the log
+ * so far, and as much as fits. All big-endian. read_log and get_head are
+ * capture_read() and capture_get_head(), or history's, and the reply comes
+ * from port.
+ */
+typedef unsigned int (*ether_read_t)(uint32_t *offset, unsigned char *buf, unsigned int len);
+typedef uint32_t (*ether_head_t)();
+
+static void do_log_request(unsigned char *pkt, unsigned int len, ether_read_t read_log, ether_head_t get_head, uint16_t port) {
+  p_ethernet_header_t p_eth_header = (p_ethernet_header_t)pkt;
+  p_ip_header_t p_ip_header = (p_ip_header_t)(pkt + ETH_HEADER_SIZE);
+  p_udp_header_t p_udp_header = (p_udp_header_t)(pkt + ETH_HEADER_SIZE + ETH_IP_HEADER_SIZE);
+  unsigned char *buf = pkt + ETH_HEADER_SIZE + ETH_IP_HEADER_SIZE + ETH_UDP_HEADER_SIZE;
+  unsigned char reply[1024];
+
+  if (len < 4)
+    return;
+
+  uint32_t offset = (uint32_t)buf[0] << 24 | buf[1] << 16 | buf[2] << 8 | buf[3];
+  unsigned int n = read_log(&offset, reply + 8, sizeof(reply) - 8);
+  uint32_t head = get_head();
+  for (int i = 0 ; i < 4 ; i++) {
+    reply[i] = offset >> (24 - 8 * i);
+    reply[4 + i] = head >> (24 - 8 * i);
+  }
+
+  ethernet_send_udp_packet((const char *)p_ip_header->ip_src, (const char *)p_eth_header->et_src,
+      SWAP16(p_udp_header->port_src), port, (const char *)reply, n + 8);
+}
+
 unsigned char packet_buffer[256];
 
 void ethernet_pio_setup() {
@@ -316,7 +370,7 @@ static void emac_process_arp_packet(uint8_t *p_uc_data, uint32_t ul_size)
     }
     ul_rc = emac_dev_write(&gs_emac_dev, p_uc_data, ul_size, NULL);
     if (ul_rc != EMAC_OK) {
-      debug("ARP send error: 0x"); debug_hex(ul_rc); debug("\r\n");
+      errorf("ARP send error: 0x%lx\r\n", ul_rc);
     }
   } else if (SWAP16(p_arp->ar_op) == ARP_REPLY && arp_callback) {
     arp_callback(p_arp->ar_spa, p_arp->ar_sha);
@@ -373,17 +427,31 @@ static void emac_process_ip_packet(uint8_t *p_uc_data, uint32_t ul_size)
         ul_rc = emac_dev_write(&gs_emac_dev, p_uc_data,
             SWAP16(p_ip_header->ip_len) + 14, NULL);
         if (ul_rc != EMAC_OK) {
-          debug("ICMP send error: 0x"); debug_hex(ul_rc); debug("\r\n");
+          errorf("ICMP send error: 0x%lx\r\n", ul_rc);
         }
       }
       break;
     case IP_PROT_UDP:
       dst_port = SWAP16(p_udp_header->port_dst);
       if (dst_port == 123) {
+        uint32_t start = prof_cycles();
         do_ntp_request(
             p_uc_data,
             ul_size - (ETH_HEADER_SIZE + ETH_IP_HEADER_SIZE + ETH_UDP_HEADER_SIZE)
             );
+        prof_end(PROF_NTP_REQUEST, start);
+      } else if (dst_port == CAPTURE_PORT) {
+        do_log_request(
+            p_uc_data,
+            ul_size - (ETH_HEADER_SIZE + ETH_IP_HEADER_SIZE + ETH_UDP_HEADER_SIZE),
+            capture_read, capture_get_head, CAPTURE_PORT
+            );
+      } else if (dst_port == HISTORY_PORT) {
+        do_log_request(
+            p_uc_data,
+            ul_size - (ETH_HEADER_SIZE + ETH_IP_HEADER_SIZE + ETH_UDP_HEADER_SIZE),
+            history_read, history_get_head, HISTORY_PORT
+            );
       } else {
         //			debug("UDP port "); debug(dst_port); debug("\r\n");
       }
@@ -426,13 +494,15 @@ static void emac_process_eth_packet(uint8_t *p_uc_data, uint32_t ul_size)
 
 void EMAC_Handler(void)
 {
-  time_get_ntp(*TIMER_CLOCK, &eh_ts_upper, &eh_ts_lower, NTP_FUDGE_RX);
+  eh_tm = *TIMER_CLOCK;
+  time_get_ntp(eh_tm, &eh_ts_upper, &eh_ts_lower, NTP_FUDGE_RX);
   emac_handler(&gs_emac_dev);
 }
 
 void ether_rx_handler(uint32_t rx_status) {
   recv_ts_upper = eh_ts_upper;
   recv_ts_lower = eh_ts_lower;
+  recv_tm = eh_tm;
   ether_int = 1;
 }
 
@@ -491,14 +561,14 @@ void ether_init() {
   // Init MAC PHY driver
   if (ethernet_phy_init(EMAC, BOARD_EMAC_PHY_ADDR, SystemCoreClock)
       != EMAC_OK) {
-    debug("PHY Initialize ERROR!\r\n");
+    error("PHY Initialize ERROR!\r\n");
     //return -1;
   }
 
   // Auto Negotiate, work in RMII mode
   if (ethernet_phy_auto_negotiate(EMAC, BOARD_EMAC_PHY_ADDR) != EMAC_OK) {
 
-    debug("Auto Negotiate ERROR!\r\n");
+    error("Auto Negotiate ERROR!\r\n");
     //return -1;
   }
 
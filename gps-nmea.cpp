@@ -0,0 +1,279 @@
+#define LOG_SUBSYSTEM LOG_GPS /* For debug.h */
+#include "config.h"
+
+#include <Arduino.h>
+#include "gps.h"
+#include "gps-protocol.h"
+#include "debug.h"
+#include "health.h"
+#include "monitor.h"
+
+/* Plain NMEA 0183, for receivers that don't talk anything better: ZDA and
+ * RMC for the date and time, RMC and GGA for whether there's a fix, GSA for
+ * the satellites in it. Nothing is sent to the receiver; it's taken as it
+ * comes out of the box.
+ *
+ * Sentences are cut up where they sit in the framer's buffer and the
+ * numbers read digit by digit; the times we need are whole seconds, so
+ * there's no need for sscanf or floats.
+ *
+ * NMEA says nothing about which pulse a sentence is for. Receivers send
+ * a second's sentences some time after its pulse, so the first sentence
+ * about a new second is paired with the edge before it, and the rest of
+ * that second's sentences go with it. At 4800 or 9600 baud a long burst
+ * can run on past the next edge, though, and a receiver that's slow to
+ * start one can begin it just after. So we keep an eye on how long after
+ * its edge a burst usually starts (gps.nmea_latency), and a burst that
+ * starts well inside that, and one edge further on than the second in it
+ * says it should be, is taken to be late and given the edge before.
+ */
+
+#define NMEA_BUFFER_SIZE 96 /* The spec says 82, including $ and CR LF */
+#define NMEA_MAX_FIELDS 20
+#define NMEA_MAX_STEP 4     /* Seconds between bursts we'll follow on from */
+#define NMEA_NO_TOD 0xffffffffUL
+#define NMEA_DAY0 719468   /* 1970-01-01, as counted by nmea_days() */
+#define NMEA_GPS_EPOCH 3657 /* 1980-01-06, in days since then */
+
+static uint32_t nmea_tod = NMEA_NO_TOD; /* Second of the day the burst is about */
+static uint32_t nmea_edge;               /* The edge it's paired with, or 0 */
+static uint32_t nmea_latency;            /* Ticks from an edge to its burst, filtered */
+static char nmea_valid;                  /* Fix status, from the last RMC or GGA */
+static char nmea_clear_used;             /* First GSA of the burst yet to come */
+
+/* n digits at p, moving p past them. False if there aren't n. */
+static bool nmea_digits(const char *&p, unsigned int n, uint32_t *val) {
+  *val = 0;
+  while (n--) {
+    if (*p < '0' || *p > '9')
+      return false;
+    *val = *val * 10 + (*p++ - '0');
+  }
+  return true;
+}
+
+/* A whole field of digits */
+static bool nmea_uint(const char *p, uint32_t *val) {
+  if (!*p)
+    return false;
+  for (*val = 0 ; *p ; p++) {
+    if (*p < '0' || *p > '9')
+      return false;
+    *val = *val * 10 + (*p - '0');
+  }
+  return true;
+}
+
+/* hhmmss[.sss] as seconds of the day. False if it's empty, or not on a
+ * whole second (a receiver set to output faster than 1 Hz).
+ */
+static bool nmea_get_tod(const char *p, uint32_t *tod) {
+  uint32_t h, m, s;
+
+  if (!nmea_digits(p, 2, &h) || !nmea_digits(p, 2, &m) || !nmea_digits(p, 2, &s))
+    return false;
+  if (h > 23 || m > 59 || s > 60)
+    return false;
+  if (*p == '.') {
+    while (*++p == '0')
+      ;
+  }
+  if (*p)
+    return false;
+  *tod = h * 3600 + m * 60 + s;
+  return true;
+}
+
+/* Days since the GPS epoch, or 0 if the date's no good */
+static uint32_t nmea_days(uint32_t year, uint32_t month, uint32_t day) {
+  if (year < 1980 || month < 1 || month > 12 || day < 1 || day > 31)
+    return 0;
+  /* Count from March, so the leap day comes last */
+  uint32_t y = year - (month <= 2);
+  uint32_t doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+  uint32_t days = y * 365 + y / 4 - y / 100 + y / 400 + doy - NMEA_DAY0;
+  return days > NMEA_GPS_EPOCH ? days - NMEA_GPS_EPOCH : 0;
+}
+
+/* A sentence about second tod of the day has come in; pair it with an
+ * edge if it's the first about that second.
+ */
+static void nmea_second(uint32_t tod) {
+  if (tod == nmea_tod)
+    return;
+
+  uint64_t edge_tick;
+  uint32_t edge = gps_time_last_edge(gps_frame_tick, &edge_tick);
+  uint32_t age = gps_frame_tick - edge_tick;
+  int32_t step = tod - nmea_tod;
+  if (step < -43200L)
+    step += 86400L;
+
+  if (edge && nmea_edge && nmea_tod != NMEA_NO_TOD && step > 0 && step <= NMEA_MAX_STEP &&
+      edge == nmea_edge + step + 1 && age < nmea_latency / 2) {
+    debug("NMEA: sentence for "); debug_long(tod); debug(" is late\r\n");
+    edge--;
+  } else if (edge && age < HZ) {
+    if (nmea_latency)
+      nmea_latency += ((int32_t)age - (int32_t)nmea_latency) / 8;
+    else
+      nmea_latency = age;
+    monitor_send(MONITOR_GPS_NMEA_LATENCY, nmea_latency / (HZ / 1000000));
+  }
+
+  nmea_tod = tod;
+  nmea_edge = edge;
+  nmea_clear_used = 1;
+}
+
+/* A date for the current burst's second, from ZDA or RMC */
+static void nmea_set_date(uint32_t days, uint32_t tod) {
+  if (!days || !nmea_valid || tod != nmea_tod)
+    return;
+
+  /* NMEA times are UTC, so this is a UTC week and time of week with no
+   * offset to add; time_set_date() only wants their sum.
+   */
+  struct gps_time_t *rec = gps_time_record(days % 7 * 86400L + tod, GPS_TIME_ANY);
+  rec->week = days / 7;
+  rec->utc_offset = 0;
+  rec->flags |= GPS_TIME_DATE;
+  if (nmea_edge) {
+    rec->edge = nmea_edge;
+    rec->flags |= GPS_TIME_EDGE;
+  }
+}
+
+static void nmea_set_valid(bool valid) {
+  nmea_valid = valid;
+  health_set_gps_status(valid ? GPS_OK : GPS_UNLOCK);
+  health_reset_gps_watchdog();
+}
+
+static void nmea_zda(char *const *field, unsigned int fields) {
+  uint32_t tod, day, month, year;
+
+  if (!nmea_get_tod(field[1], &tod))
+    return;
+  nmea_second(tod);
+  if (nmea_uint(field[2], &day) && nmea_uint(field[3], &month) && nmea_uint(field[4], &year))
+    nmea_set_date(nmea_days(year, month, day), tod);
+}
+
+static void nmea_rmc(char *const *field, unsigned int fields) {
+  uint32_t tod, day, month, year;
+  const char *date = field[9];
+
+  if (!nmea_get_tod(field[1], &tod))
+    return;
+  nmea_second(tod);
+  nmea_set_valid(field[2][0] == 'A');
+  /* ddmmyy; the receiver's week rollover is its own problem */
+  if (nmea_digits(date, 2, &day) && nmea_digits(date, 2, &month) && nmea_digits(date, 2, &year) && !*date)
+    nmea_set_date(nmea_days(year + (year < 80 ? 2000 : 1900), month, day), tod);
+}
+
+static void nmea_gga(char *const *field, unsigned int fields) {
+  uint32_t tod, quality;
+
+  if (!nmea_get_tod(field[1], &tod))
+    return;
+  nmea_second(tod);
+  nmea_set_valid(nmea_uint(field[6], &quality) && quality > 0);
+}
+
+static void nmea_gsa(char *const *field, unsigned int fields) {
+  /* A multi-GNSS receiver sends one per system; they all go together */
+  if (nmea_clear_used) {
+    gps_sat_clear_used();
+    nmea_clear_used = 0;
+  }
+
+  for (unsigned int i = 3 ; i < 15 ; i++) {
+    uint32_t prn;
+    if (!nmea_uint(field[i], &prn))
+      continue;
+    if (prn >= 1 && prn <= 32)
+      gps_sat_update(GPS_GNSS_GPS, prn, GPS_SAT_UNKNOWN, GPS_SAT_UNKNOWN, 1);
+    else if (prn >= 33 && prn <= 64)
+      gps_sat_update(GPS_GNSS_SBAS, prn + 87, GPS_SAT_UNKNOWN, GPS_SAT_UNKNOWN, 1);
+    else if (prn >= 65 && prn <= 96)
+      gps_sat_update(GPS_GNSS_GLONASS, prn - 64, GPS_SAT_UNKNOWN, GPS_SAT_UNKNOWN, 1);
+  }
+}
+
+struct nmea_sentence_t {
+  char type[4];
+  unsigned char min_fields; /* Counting the address */
+  void (*handler)(char *const *field, unsigned int fields);
+};
+
+static const struct nmea_sentence_t nmea_sentences[] = {
+  { "ZDA", 5, nmea_zda },
+  { "RMC", 10, nmea_rmc },
+  { "GGA", 8, nmea_gga },
+  { "GSA", 15, nmea_gsa },
+};
+
+static void nmea_handle(char *text, unsigned int len) {
+  char *field[NMEA_MAX_FIELDS];
+  unsigned int fields = 1;
+
+  field[0] = text;
+  for (char *p = text ; *p && fields < NMEA_MAX_FIELDS ; p++) {
+    if (*p == ',') {
+      *p = 0;
+      field[fields++] = p + 1;
+    }
+  }
+
+  /* Two letters of talker (GP, GN, GL...), then the type. Proprietary
+   * sentences (P...) aren't ours to read.
+   */
+  if (text[0] == 'P' || strlen(field[0]) != 5)
+    return;
+  for (unsigned int i = 0 ; i < sizeof(nmea_sentences) / sizeof(*nmea_sentences) ; i++) {
+    const struct nmea_sentence_t *s = &nmea_sentences[i];
+    if (strcmp(field[0] + 2, s->type))
+      continue;
+    if (fields < s->min_fields) {
+      debug("Short NMEA "); debug(s->type); debug(": ");
+      debug_int(fields); debug(" < "); debug_int(s->min_fields); debug(" fields\r\n");
+      return;
+    }
+    s->handler(field, fields);
+    return;
+  }
+}
+
+struct nmea_framing {
+  static const char *name() { return "NMEA"; }
+  static const unsigned int BUFFER_SIZE = NMEA_BUFFER_SIZE;
+
+  static void handle(char *text, unsigned int len) {
+    nmea_handle(text, len);
+  }
+};
+
+typedef gps_nmea_framer<nmea_framing> nmea_framer;
+
+static void gps_nmea_init(const struct gps_serial_t *serial) {
+  nmea_framer::reset();
+  nmea_tod = NMEA_NO_TOD;
+  nmea_edge = 0;
+  nmea_latency = 0;
+  nmea_valid = 0;
+  if (!serial)
+    gps_set_serial(9600, GPS_8N1); /* The usual factory setting */
+}
+
+const struct gps_protocol_t gps_protocol_nmea = {
+  "nmea",
+  gps_nmea_init,
+  nmea_framer::decode,
+  nmea_framer::probe,
+  &nmea_framer::frames,
+  &nmea_framer::errors,
+  0,
+  GPS_TIME_DATE,
+};
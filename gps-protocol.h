@@ -0,0 +1,557 @@
+#ifndef __GPS_PROTOCOL_H
+#define __GPS_PROTOCOL_H
+
+#include "gps.h"
+#include "gps-scan.h"
+#include "debug.h"
+
+/* Common framing and dispatch for the GPS protocol drivers.
+ *
+ * A driver describes its messages in a const table of gps_message_t. The
+ * framer finds whole, checksummed frames in the receive stream and hands
+ * them to gps_dispatch(), which pulls the listed fields out of the payload
+ * (in the given byte order, sign-extended where asked) and calls the handler
+ * with them, so handlers don't have to do their own byte shuffling.
+ *
+ * Framing and checksums differ per protocol, so they're template parameters
+ * rather than runtime branches: gps_length_framer covers the length-prefixed
+ * protocols (UBX, SiRF binary), gps_dle_framer the DLE-stuffed one (TSIP),
+ * and gps_nmea_framer NMEA 0183 sentences.
+ *
+ * Both keep running counts of good frames and framing errors, and have a
+ * probe() that only counts, for baud rate and protocol detection. While
+ * a handler runs, gps_frame_tick says when its frame started arriving.
+ */
+
+enum gps_field_type_t {
+  GPS_U1 = 1,
+  GPS_U2 = 2,
+  GPS_U4 = 4,
+  GPS_SIGNED = 0x10,
+  GPS_BE = 0x20, /* Or in for big-endian fields */
+  GPS_I1 = GPS_U1 | GPS_SIGNED,
+  GPS_I2 = GPS_U2 | GPS_SIGNED,
+  GPS_I4 = GPS_U4 | GPS_SIGNED,
+};
+
+#define GPS_FIELD_SIZE(type) ((type) & 0x0f)
+#define GPS_MAX_FIELDS 10
+
+struct gps_field_t {
+  unsigned char offset;
+  unsigned char type; /* 0 ends the list */
+};
+
+typedef void (*gps_handler_t)(const int32_t *field, const unsigned char *payload, unsigned int len);
+
+struct gps_message_t {
+  unsigned short id;
+  unsigned short min_len; /* Shorter messages are dropped */
+  gps_handler_t handler;
+  struct gps_field_t field[GPS_MAX_FIELDS];
+};
+
+static inline int32_t gps_get_field(const unsigned char *p, unsigned char type) {
+  unsigned int size = GPS_FIELD_SIZE(type);
+  uint32_t val = 0;
+
+  if (type & GPS_BE) {
+    for (unsigned int i = 0 ; i < size ; i++)
+      val = val << 8 | p[i];
+  } else {
+    for (unsigned int i = size ; i-- ; )
+      val = val << 8 | p[i];
+  }
+
+  if ((type & GPS_SIGNED) && size < 4) {
+    uint32_t sign = 1UL << (size * 8 - 1);
+    val = (val ^ sign) - sign;
+  }
+  return val;
+}
+
+/* For the odd double-precision field (TSIP positions) */
+static inline double gps_get_double(const unsigned char *p, bool big_endian) {
+  uint64_t bits = 0;
+  double val;
+
+  for (unsigned int i = 0 ; i < 8 ; i++)
+    bits = bits << 8 | p[big_endian ? i : 7 - i];
+  memcpy(&val, &bits, sizeof(val));
+  return val;
+}
+
+/* Returns false if the table has no entry for id, so the caller can log it */
+static inline bool gps_dispatch(const struct gps_message_t *table, unsigned int entries, unsigned short id, const unsigned char *payload, unsigned int len) {
+  for (unsigned int i = 0 ; i < entries ; i++) {
+    const struct gps_message_t *msg = &table[i];
+    if (msg->id != id)
+      continue;
+
+    if (len < msg->min_len) {
+      debug("Short message type "); debug_hex(id); debug(": ");
+      debug_int(len); debug(" < "); debug_int(msg->min_len); debug("\r\n");
+      return true;
+    }
+
+    int32_t field[GPS_MAX_FIELDS];
+    for (unsigned int f = 0 ; f < GPS_MAX_FIELDS && msg->field[f].type ; f++)
+      field[f] = gps_get_field(payload + msg->field[f].offset, msg->field[f].type);
+
+    if (msg->handler)
+      msg->handler(field, payload, len);
+    return true;
+  }
+  return false;
+}
+
+/* Checksum policies */
+
+/* 8-bit Fletcher over header and payload, as used by UBX */
+class gps_fletcher8 {
+  public:
+    void reset() { a = b = 0; }
+    void update(const unsigned char *p, unsigned int n) {
+      unsigned char ta = a, tb = b;
+      for (unsigned int i = 0 ; i < n ; i++) {
+        ta += p[i];
+        tb += ta;
+      }
+      a = ta;
+      b = tb;
+    }
+    bool check(const unsigned char *ck) const { return ck[0] == a && ck[1] == b; }
+  private:
+    unsigned char a, b;
+};
+
+/* 15-bit sum of the payload, sent big-endian, as used by SiRF binary */
+class gps_sum15 {
+  public:
+    void reset() { sum = 0; }
+    void update(const unsigned char *p, unsigned int n) {
+      unsigned int s = sum;
+      for (unsigned int i = 0 ; i < n ; i++)
+        s += p[i];
+      sum = s;
+    }
+    bool check(const unsigned char *ck) const { return (unsigned int)(ck[0] << 8 | ck[1]) == (sum & 0x7fff); }
+  private:
+    unsigned int sum;
+};
+
+/* Length-prefixed framing: SYNC1 SYNC2 header payload checksum [trailer].
+ * Policy provides:
+ *   name()                     for debug output
+ *   SYNC1, SYNC2               sync bytes
+ *   HEADER_LEN                 bytes between the sync and the payload
+ *   CHECKSUM_HEADER            whether the checksum covers the header
+ *   HAS_TRAILER, TRAILER1, TRAILER2
+ *   BUFFER_SIZE                largest payload we keep
+ *   checksum                   a checksum policy class, as above
+ *   payload_len(header)
+ *   message_id(header, payload)
+ *   handle(id, payload, len)   called for each good frame
+ */
+template <class Policy>
+class gps_length_framer {
+  public:
+    static uint32_t frames, errors;
+
+    static void reset() { state = SYNC1; }
+
+    static void probe(const unsigned char *buf, unsigned int len) {
+      dispatch = false;
+      decode(buf, len);
+      dispatch = true;
+    }
+
+    static void decode(const unsigned char *buf, unsigned int len) {
+      const unsigned char *p = buf, *end = buf + len;
+
+      while (p < end) {
+        switch (state) {
+          case SYNC1:
+            p = gps_scan_byte(p, end, Policy::SYNC1);
+            if (p < end) {
+              if (dispatch)
+                tick = gps_rx_tick(p);
+              p++;
+              state = SYNC2;
+            }
+            break;
+          case SYNC2:
+            /* Don't eat a mismatch; it may be the first sync byte again */
+            if (*p == Policy::SYNC2) {
+              p++;
+              pos = 0;
+              state = HEADER;
+            } else {
+              state = SYNC1;
+            }
+            break;
+          case HEADER:
+            header[pos++] = *p++;
+            if (pos == Policy::HEADER_LEN) {
+              payload_len = Policy::payload_len(header);
+              if (payload_len > Policy::BUFFER_SIZE) {
+                /* Too big to keep, or we synced on noise. Either way,
+                 * look for the next frame rather than skip a length that
+                 * could be most of 64K.
+                 */
+                if (dispatch) {
+                  debug_int(payload_len); debug(" byte payload too big from "); debug(Policy::name()); debug("\r\n");
+                }
+                errors++;
+                state = SYNC1;
+                break;
+              }
+              valid = true;
+              ck.reset();
+              if (Policy::CHECKSUM_HEADER)
+                ck.update(header, Policy::HEADER_LEN);
+              pos = 0;
+              state = payload_len ? PAYLOAD : CHECKSUM;
+            }
+            break;
+          case PAYLOAD: {
+            unsigned int n = payload_len - pos;
+            if (n > (unsigned int)(end - p))
+              n = end - p;
+            memcpy(payload + pos, p, n);
+            ck.update(p, n);
+            p += n;
+            pos += n;
+            if (pos == payload_len) {
+              pos = 0;
+              state = CHECKSUM;
+            }
+            break;
+          }
+          case CHECKSUM:
+            ck_bytes[pos++] = *p++;
+            if (pos == 2) {
+              if (!ck.check(ck_bytes)) {
+                if (dispatch) {
+                  debug("Bad checksum from "); debug(Policy::name()); debug("\r\n");
+                }
+                valid = false;
+              }
+              pos = 0;
+              if (Policy::HAS_TRAILER)
+                state = TRAILER;
+              else
+                finish();
+            }
+            break;
+          case TRAILER:
+            if (*p++ != (pos ? Policy::TRAILER2 : Policy::TRAILER1)) {
+              if (dispatch) {
+                debug("Bad trailer from "); debug(Policy::name()); debug("\r\n");
+              }
+              valid = false;
+              finish();
+            } else if (++pos == 2) {
+              finish();
+            }
+            break;
+        }
+      }
+    }
+
+  private:
+    enum state_t { SYNC1, SYNC2, HEADER, PAYLOAD, CHECKSUM, TRAILER };
+
+    static void finish() {
+      if (valid && payload_len) {
+        frames++;
+        if (dispatch) {
+          gps_frame_tick = tick;
+          Policy::handle(Policy::message_id(header, payload), payload, payload_len);
+        }
+      } else {
+        errors++;
+      }
+      state = SYNC1;
+    }
+
+    static enum state_t state;
+    static bool valid, dispatch;
+    static unsigned int pos, payload_len;
+    static unsigned char header[Policy::HEADER_LEN];
+    static unsigned char ck_bytes[2];
+    static typename Policy::checksum ck;
+    static unsigned char payload[Policy::BUFFER_SIZE];
+    static uint64_t tick;
+};
+
+template <class P> typename gps_length_framer<P>::state_t gps_length_framer<P>::state = gps_length_framer<P>::SYNC1;
+template <class P> bool gps_length_framer<P>::valid;
+template <class P> bool gps_length_framer<P>::dispatch = true;
+template <class P> uint32_t gps_length_framer<P>::frames;
+template <class P> uint32_t gps_length_framer<P>::errors;
+template <class P> unsigned int gps_length_framer<P>::pos;
+template <class P> unsigned int gps_length_framer<P>::payload_len;
+template <class P> unsigned char gps_length_framer<P>::header[P::HEADER_LEN];
+template <class P> unsigned char gps_length_framer<P>::ck_bytes[2];
+template <class P> typename P::checksum gps_length_framer<P>::ck;
+template <class P> unsigned char gps_length_framer<P>::payload[P::BUFFER_SIZE];
+template <class P> uint64_t gps_length_framer<P>::tick;
+
+/* DLE-stuffed framing: DLE id [id2] data... DLE ETX, with any DLE in the
+ * data doubled, and no checksum. Policy provides:
+ *   name(), BUFFER_SIZE        as above
+ *   two_byte_id(id)            whether id starts a 2-byte ID
+ *   handle(id, payload, len)   called for each complete frame
+ */
+#define GPS_DLE 0x10
+#define GPS_ETX 0x03
+
+template <class Policy>
+class gps_dle_framer {
+  public:
+    static uint32_t frames, errors;
+
+    static void reset() { state = LEADER; }
+
+    static void probe(const unsigned char *buf, unsigned int len) {
+      dispatch = false;
+      decode(buf, len);
+      dispatch = true;
+    }
+
+    static void decode(const unsigned char *buf, unsigned int len) {
+      const unsigned char *p = buf, *end = buf + len;
+
+      while (p < end) {
+        switch (state) {
+          case LEADER:
+            p = gps_scan_byte(p, end, GPS_DLE);
+            if (p < end) {
+              if (dispatch)
+                tick = gps_rx_tick(p);
+              p++;
+              state = ID;
+            }
+            break;
+          case ID:
+            start(*p++);
+            break;
+          case ID2:
+            id = id << 8 | *p++;
+            state = DATA;
+            break;
+          case DATA: {
+            /* Copy everything up to the next DLE in one go */
+            const unsigned char *dle = gps_scan_byte(p, end, GPS_DLE);
+            append(p, dle - p);
+            p = dle;
+            if (p < end) {
+              p++;
+              state = ESCAPE;
+            }
+            break;
+          }
+          case ESCAPE: {
+            unsigned char ch = *p++;
+            if (ch == GPS_DLE) { // DLE DLE = escaped DLE
+              append(&ch, 1);
+              state = DATA;
+            } else if (ch == GPS_ETX) { // DLE ETX = end of packet
+              if (valid) {
+                frames++;
+                if (dispatch) {
+                  gps_frame_tick = tick;
+                  Policy::handle(id, payload, payload_len);
+                }
+              } else {
+                errors++;
+                if (dispatch) {
+                  debug_int(payload_len); debug(" byte payload too big from "); debug(Policy::name()); debug("\r\n");
+                }
+              }
+              state = LEADER;
+            } else {
+              errors++;
+              if (dispatch) {
+                debug("Unknown sequence DLE + "); debug_int(ch); debug(" from "); debug(Policy::name()); debug("\r\n");
+                tick = gps_rx_tick(p - 1);
+              }
+              start(ch);
+            }
+            break;
+          }
+        }
+      }
+    }
+
+  private:
+    enum state_t { LEADER, ID, ID2, DATA, ESCAPE };
+
+    static void start(unsigned char ch) {
+      if (ch == GPS_ETX) { // DLE ETX: this was actually an end-of-packet. Wait for the next.
+        state = LEADER;
+        return;
+      }
+      if (ch == GPS_DLE) {
+        state = ID;
+        return;
+      }
+      id = ch;
+      payload_len = 0;
+      valid = true;
+      state = Policy::two_byte_id(ch) ? ID2 : DATA;
+    }
+
+    static void append(const unsigned char *p, unsigned int n) {
+      if (payload_len + n > Policy::BUFFER_SIZE)
+        valid = false;
+      else if (n)
+        memcpy(payload + payload_len, p, n);
+      payload_len += n;
+    }
+
+    static enum state_t state;
+    static bool valid, dispatch;
+    static unsigned short id;
+    static unsigned int payload_len;
+    static unsigned char payload[Policy::BUFFER_SIZE];
+    static uint64_t tick;
+};
+
+template <class P> typename gps_dle_framer<P>::state_t gps_dle_framer<P>::state = gps_dle_framer<P>::LEADER;
+template <class P> bool gps_dle_framer<P>::valid;
+template <class P> bool gps_dle_framer<P>::dispatch = true;
+template <class P> uint32_t gps_dle_framer<P>::frames;
+template <class P> uint32_t gps_dle_framer<P>::errors;
+template <class P> unsigned short gps_dle_framer<P>::id;
+template <class P> unsigned int gps_dle_framer<P>::payload_len;
+template <class P> unsigned char gps_dle_framer<P>::payload[P::BUFFER_SIZE];
+template <class P> uint64_t gps_dle_framer<P>::tick;
+
+/* NMEA 0183: $ text * two hex digits of the XOR of the text, CR LF. The
+ * checksum is kept as the text is copied, so a sentence is checked as soon
+ * as its last digit arrives. Anything unprintable, or a $ before the *, drops
+ * what we have. Policy provides:
+ *   name(), BUFFER_SIZE        as above; the spec's limit is 80 characters
+ *   handle(text, len)          called for each good sentence, with the text
+ *                              between the $ and the *, NUL-terminated and
+ *                              the handler's to cut up
+ */
+template <class Policy>
+class gps_nmea_framer {
+  public:
+    static uint32_t frames, errors;
+
+    static void reset() { state = START; }
+
+    static void probe(const unsigned char *buf, unsigned int len) {
+      dispatch = false;
+      decode(buf, len);
+      dispatch = true;
+    }
+
+    static void decode(const unsigned char *buf, unsigned int len) {
+      const unsigned char *p = buf, *end = buf + len;
+
+      while (p < end) {
+        switch (state) {
+          case START:
+            p = gps_scan_byte(p, end, '$');
+            if (p < end) {
+              if (dispatch)
+                tick = gps_rx_tick(p);
+              p++;
+              text_len = 0;
+              ck = 0;
+              state = TEXT;
+            }
+            break;
+          case TEXT: {
+            unsigned char c = ck;
+            while (p < end) {
+              unsigned char ch = *p;
+              if (ch == '*' || ch == '$' || ch < 0x20 || ch > 0x7e || text_len == Policy::BUFFER_SIZE)
+                break;
+              text[text_len++] = ch;
+              c ^= ch;
+              p++;
+            }
+            ck = c;
+            if (p == end)
+              break;
+            if (*p == '*') {
+              p++;
+              state = CK1;
+            } else {
+              /* Don't eat a $; it starts the next sentence */
+              errors++;
+              state = START;
+            }
+            break;
+          }
+          case CK1:
+          case CK2: {
+            int digit = hex(*p);
+            if (digit < 0) {
+              errors++;
+              state = START;
+              break;
+            }
+            p++;
+            if (state == CK1) {
+              ck ^= digit << 4;
+              state = CK2;
+              break;
+            }
+            if ((ck ^ digit) == 0) {
+              frames++;
+              if (dispatch) {
+                text[text_len] = 0;
+                gps_frame_tick = tick;
+                Policy::handle(text, text_len);
+              }
+            } else {
+              errors++;
+              if (dispatch) {
+                debug("Bad checksum from "); debug(Policy::name()); debug("\r\n");
+              }
+            }
+            state = START;
+            break;
+          }
+        }
+      }
+    }
+
+  private:
+    enum state_t { START, TEXT, CK1, CK2 };
+
+    static int hex(unsigned char ch) {
+      if (ch >= '0' && ch <= '9')
+        return ch - '0';
+      if (ch >= 'A' && ch <= 'F')
+        return ch - 'A' + 10;
+      if (ch >= 'a' && ch <= 'f')
+        return ch - 'a' + 10;
+      return -1;
+    }
+
+    static enum state_t state;
+    static bool dispatch;
+    static unsigned char ck;
+    static unsigned int text_len;
+    static char text[Policy::BUFFER_SIZE + 1];
+    static uint64_t tick;
+};
+
+template <class P> typename gps_nmea_framer<P>::state_t gps_nmea_framer<P>::state = gps_nmea_framer<P>::START;
+template <class P> bool gps_nmea_framer<P>::dispatch = true;
+template <class P> uint32_t gps_nmea_framer<P>::frames;
+template <class P> uint32_t gps_nmea_framer<P>::errors;
+template <class P> unsigned char gps_nmea_framer<P>::ck;
+template <class P> unsigned int gps_nmea_framer<P>::text_len;
+template <class P> char gps_nmea_framer<P>::text[P::BUFFER_SIZE + 1];
+template <class P> uint64_t gps_nmea_framer<P>::tick;
+
+#endif
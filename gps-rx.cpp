@@ -0,0 +1,166 @@
+#define LOG_SUBSYSTEM LOG_GPS /* For debug.h */
+#include "config.h"
+#include "debug.h"
+#include "gps.h"
+#include "timer.h"
+#include "capture.h"
+
+/* GPS bytes come in through the USART's PDC, into a pair of buffers, instead
+ * of one interrupt per byte into the Arduino ring buffer. gps_rx_poll() hands
+ * the decoder whatever has arrived since last time as one span, and gives
+ * each buffer back to the PDC once it's been read.
+ *
+ * The PDC doesn't say when each byte came in, so gps_rx_tick() works it out
+ * backwards from when the poll found the end of the span, at the line rate.
+ * That's late by however long the loop took to get round to polling, which
+ * is fine for telling which side of a PPS edge a message started on.
+ *
+ * The core's interrupt handler for the port reads RHR whenever it runs, on
+ * any interrupt, and would take bytes from under the PDC. So every USART
+ * interrupt stays off, and the drivers' commands go out through the PDC
+ * too (gps_tx_write()), never GPS.write(), which turns TXRDY back on. Line
+ * errors latch in the status register until reset, so the poll resets them.
+ */
+
+#define GPS_RX_BUFFER_SIZE 256
+#define GPS_TX_BUFFER_SIZE 512 /* Power of 2 */
+
+static unsigned char gps_rx_buf[2][GPS_RX_BUFFER_SIZE];
+static unsigned char gps_rx_cur;   /* Buffer we're reading from */
+static unsigned int gps_rx_pos;    /* Bytes of it already decoded */
+static const unsigned char *gps_rx_end; /* End of the span being decoded */
+static uint64_t gps_rx_end_tick;        /* Timer time it got that far */
+static uint32_t gps_rx_byte_ticks = HZ / 960; /* 9600 8N1 */
+
+static unsigned char gps_tx_buf[GPS_TX_BUFFER_SIZE];
+static uint32_t gps_tx_head, gps_tx_tail; /* Bytes ever queued, sent */
+static unsigned int gps_tx_sending;       /* With the PDC */
+
+void gps_rx_set_rate(uint32_t baud, unsigned int bits) {
+  gps_rx_byte_ticks = (uint64_t)HZ * bits / baud;
+}
+
+/* Timer time byte p of the span being decoded arrived */
+uint64_t gps_rx_tick(const unsigned char *p) {
+  return gps_rx_end_tick - (uint64_t)(gps_rx_end - p) * gps_rx_byte_ticks;
+}
+
+/* Both receive buffers, empty */
+static void gps_rx_restart() {
+  GPS_USART->US_PTCR = US_PTCR_RXTDIS;
+  gps_rx_cur = 0;
+  gps_rx_pos = 0;
+  GPS_USART->US_RPR = (uintptr_t)gps_rx_buf[0];
+  GPS_USART->US_RCR = GPS_RX_BUFFER_SIZE;
+  GPS_USART->US_RNPR = (uintptr_t)gps_rx_buf[1];
+  GPS_USART->US_RNCR = GPS_RX_BUFFER_SIZE;
+  GPS_USART->US_PTCR = US_PTCR_RXTEN;
+}
+
+/* Call after every GPS.begin(), which resets the USART */
+void gps_rx_init() {
+  GPS_USART->US_PTCR = US_PTCR_RXTDIS | US_PTCR_TXTDIS;
+  /* Keep the core's interrupt handler from taking our bytes */
+  GPS_USART->US_IDR = 0xffffffff;
+  GPS_USART->US_CR = US_CR_RSTSTA;
+
+  /* begin() dropped whatever was going out */
+  GPS_USART->US_TCR = 0;
+  gps_tx_tail = gps_tx_head;
+  gps_tx_sending = 0;
+
+  gps_rx_restart();
+}
+
+static void gps_tx_poll() {
+  if (gps_tx_sending) {
+    if (GPS_USART->US_TCR)
+      return;
+    gps_tx_tail += gps_tx_sending;
+    gps_tx_sending = 0;
+  }
+  if (gps_tx_head == gps_tx_tail)
+    return;
+
+  unsigned int start = gps_tx_tail % GPS_TX_BUFFER_SIZE;
+  unsigned int len = gps_tx_head - gps_tx_tail;
+  if (len > GPS_TX_BUFFER_SIZE - start)
+    len = GPS_TX_BUFFER_SIZE - start;
+  GPS_USART->US_TPR = (uintptr_t)(gps_tx_buf + start);
+  GPS_USART->US_TCR = len;
+  GPS_USART->US_PTCR = US_PTCR_TXTEN;
+  gps_tx_sending = len;
+}
+
+/* Queues len bytes for the receiver. Commands are small next to the
+ * buffer, so this only waits if a burst of them outruns the line.
+ */
+void gps_tx_write(const void *buf, unsigned int len) {
+  const unsigned char *p = (const unsigned char *)buf;
+
+  while (len) {
+    gps_tx_poll();
+    if (gps_tx_head - gps_tx_tail == GPS_TX_BUFFER_SIZE)
+      continue;
+    gps_tx_buf[gps_tx_head++ % GPS_TX_BUFFER_SIZE] = *p++;
+    len--;
+  }
+  gps_tx_poll();
+}
+
+/* Everything queued is on the wire, as it has to be before a rate change */
+bool gps_tx_done() {
+  gps_tx_poll();
+  return gps_tx_head == gps_tx_tail && (GPS_USART->US_CSR & US_CSR_TXEMPTY);
+}
+
+void gps_tx_flush() {
+  while (!gps_tx_done());
+}
+
+void gps_rx_poll(void (*decode)(const unsigned char *, unsigned int)) {
+  gps_tx_poll();
+  if (GPS_USART->US_CSR & (US_CSR_OVRE | US_CSR_FRAME | US_CSR_PARE)) {
+    debug("GPS RX line error\r\n");
+    GPS_USART->US_CR = US_CR_RSTSTA;
+  }
+
+  for (;;) {
+    const unsigned char *buf = gps_rx_buf[gps_rx_cur];
+    gps_rx_end_tick = timer_now();
+    uintptr_t rpr = GPS_USART->US_RPR;
+
+    if (rpr >= (uintptr_t)buf && rpr <= (uintptr_t)buf + GPS_RX_BUFFER_SIZE) {
+      unsigned int end = rpr - (uintptr_t)buf;
+      if (end > gps_rx_pos) {
+        gps_rx_end = buf + end;
+        decode(buf + gps_rx_pos, end - gps_rx_pos);
+        capture_gps(buf + gps_rx_pos, end - gps_rx_pos, gps_rx_end_tick);
+        gps_rx_pos = end;
+      }
+      if (end == GPS_RX_BUFFER_SIZE && GPS_USART->US_RCR == 0) {
+        /* Both buffers filled before we got here, so the PDC stopped */
+        debug("GPS RX overrun\r\n");
+        gps_rx_restart();
+      }
+      return;
+    }
+
+    /* The PDC has moved on to the other buffer. Finish this one and give
+     * it back as the next one to fill.
+     */
+    if (gps_rx_pos < GPS_RX_BUFFER_SIZE) {
+      /* The rest of this buffer came in before whatever's in the next one */
+      gps_rx_end = buf + GPS_RX_BUFFER_SIZE;
+      uintptr_t next = (uintptr_t)gps_rx_buf[gps_rx_cur ^ 1];
+      if (rpr >= next && rpr <= next + GPS_RX_BUFFER_SIZE)
+        gps_rx_end_tick -= (uint64_t)(rpr - next) * gps_rx_byte_ticks;
+      decode(buf + gps_rx_pos, GPS_RX_BUFFER_SIZE - gps_rx_pos);
+      capture_gps(buf + gps_rx_pos, GPS_RX_BUFFER_SIZE - gps_rx_pos, gps_rx_end_tick);
+    }
+    GPS_USART->US_RNPR = (uintptr_t)buf;
+    GPS_USART->US_RNCR = GPS_RX_BUFFER_SIZE;
+    gps_rx_cur ^= 1;
+    gps_rx_pos = 0;
+  }
+}
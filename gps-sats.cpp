@@ -0,0 +1,137 @@
+#include "config.h"
+#include "console.h"
+#include <Arduino.h>
+#include "gps.h"
+#include "monitor.h"
+
+/* What the receiver can see, for when the PPS gets noisy and we want to
+ * know whether it's the sky. Drivers fill in whatever their receiver tells
+ * them, possibly from several messages that each carry part of it; entries
+ * nobody has mentioned for GPS_SAT_TIMEOUT_MS are dropped. The summary goes
+ * to the monitor every GPS_SAT_REPORT_MS, not every message.
+ */
+
+struct gps_sat_t {
+  unsigned char gnss;
+  unsigned char svid;
+  unsigned char cno;  /* dB-Hz, or whatever the receiver's signal unit is */
+  signed char elev;   /* Degrees */
+  unsigned char used;
+  uint32_t seen;
+};
+
+static struct gps_sat_t gps_sats[GPS_MAX_SATS];
+static unsigned int gps_nsats;
+
+static int32_t clock_bias, clock_drift;
+static char have_clock;
+static uint32_t last_report;
+
+static struct gps_sat_t *gps_sat_find(unsigned char gnss, unsigned char svid) {
+  for (unsigned int i = 0 ; i < gps_nsats ; i++) {
+    if (gps_sats[i].gnss == gnss && gps_sats[i].svid == svid)
+      return &gps_sats[i];
+  }
+  if (gps_nsats == GPS_MAX_SATS)
+    return NULL;
+
+  struct gps_sat_t *sat = &gps_sats[gps_nsats++];
+  memset(sat, 0, sizeof(*sat));
+  sat->gnss = gnss;
+  sat->svid = svid;
+  sat->elev = GPS_SAT_UNKNOWN;
+  return sat;
+}
+
+/* Any of cno, elev, used may be GPS_SAT_UNKNOWN to leave it as it was */
+void gps_sat_update(unsigned char gnss, unsigned char svid, int cno, int elev, int used) {
+  struct gps_sat_t *sat = gps_sat_find(gnss, svid);
+  if (!sat)
+    return;
+
+  if (cno != GPS_SAT_UNKNOWN)
+    sat->cno = constrain(cno, 0, 255);
+  if (elev != GPS_SAT_UNKNOWN)
+    sat->elev = constrain(elev, -90, 90);
+  if (used != GPS_SAT_UNKNOWN)
+    sat->used = used;
+  sat->seen = millis();
+}
+
+/* For receivers that send the used list separately: clear, then update */
+void gps_sat_clear_used() {
+  for (unsigned int i = 0 ; i < gps_nsats ; i++)
+    gps_sats[i].used = 0;
+}
+
+void gps_clock_update(int32_t bias_ns, int32_t drift_ppb) {
+  clock_bias = bias_ns;
+  clock_drift = drift_ppb;
+  have_clock = 1;
+}
+
+static void gps_sat_expire() {
+  uint32_t now = millis();
+  unsigned int keep = 0;
+
+  for (unsigned int i = 0 ; i < gps_nsats ; i++) {
+    if (now - gps_sats[i].seen < GPS_SAT_TIMEOUT_MS)
+      gps_sats[keep++] = gps_sats[i];
+  }
+  gps_nsats = keep;
+}
+
+void gps_sat_report() {
+  if (millis() - last_report < GPS_SAT_REPORT_MS)
+    return;
+  last_report = millis();
+
+  gps_sat_expire();
+
+  unsigned int used = 0, cno_sum = 0, cno_min = 255;
+  for (unsigned int i = 0 ; i < gps_nsats ; i++) {
+    if (!gps_sats[i].used)
+      continue;
+    used++;
+    cno_sum += gps_sats[i].cno;
+    if (gps_sats[i].cno < cno_min)
+      cno_min = gps_sats[i].cno;
+  }
+
+  monitor_send(MONITOR_GPS_SATS_TRACKED, gps_nsats);
+  monitor_send(MONITOR_GPS_SATS_USED, used);
+  if (used) {
+    monitor_send(MONITOR_GPS_CNO_MEAN, cno_sum / used);
+    monitor_send(MONITOR_GPS_CNO_MIN, cno_min);
+  }
+  if (have_clock) {
+    monitor_send(MONITOR_GPS_CLOCK_BIAS, clock_bias);
+    monitor_send(MONITOR_GPS_CLOCK_DRIFT, clock_drift);
+    have_clock = 0;
+  }
+}
+
+static bool gps_sat_line(unsigned int *pos) {
+  static const char gnss_name[] = "GSEBIQR"; /* u-blox gnssId order */
+
+  if (*pos >= gps_nsats)
+    return false;
+
+  const struct gps_sat_t *sat = &gps_sats[(*pos)++];
+  Console.print(sat->gnss < sizeof(gnss_name) - 1 ? gnss_name[sat->gnss] : '?');
+  Console.print(sat->svid);
+  Console.print(" cno ");
+  Console.print(sat->cno);
+  Console.print(" el ");
+  if (sat->elev == GPS_SAT_UNKNOWN)
+    Console.print("?");
+  else
+    Console.print(sat->elev);
+  Console.println(sat->used ? " used" : "");
+  return true;
+}
+
+void gps_sat_print() {
+  gps_sat_expire();
+  console_print_lines(gps_sat_line);
+}
@@ -0,0 +1,30 @@
+#ifndef __GPS_SCAN_H
+#define __GPS_SCAN_H
+
+/* Find the first ch in [p, end), a word at a time once we're aligned.
+ * Returns end if there isn't one.
+ */
+static inline const unsigned char *gps_scan_byte(const unsigned char *p, const unsigned char *end, unsigned char ch) {
+  while (p < end && ((uintptr_t)p & 3)) {
+    if (*p == ch)
+      return p;
+    p++;
+  }
+
+  const uint32_t pattern = 0x01010101UL * ch;
+  while (end - p >= 4) {
+    uint32_t word;
+    memcpy(&word, p, 4);
+    word ^= pattern;
+    /* Nonzero iff some byte of word is zero, i.e. matched ch */
+    if ((word - 0x01010101UL) & ~word & 0x80808080UL)
+      break;
+    p += 4;
+  }
+
+  while (p < end && *p != ch)
+    p++;
+  return p;
+}
+
+#endif
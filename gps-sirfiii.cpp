@@ -1,59 +1,25 @@
+#define LOG_SUBSYSTEM LOG_GPS /* For debug.h */
 #include "config.h"
-#if GPS_SIRFIII
 
 #include <Arduino.h>
 #include "gps.h"
+#include "gps-protocol.h"
 #include "timing.h"
 #include "debug.h"
 #include "health.h"
 
-#define GPS_BUFFER_SIZE 256
-
-enum gps_state_t {
-  GPS_HEADER1,    // 0
-  GPS_HEADER2,    // 1
-  GPS_LENGTH1,    // 2
-  GPS_LENGTH2,    // 3
-  GPS_PAYLOAD,    // 4
-  GPS_CHECKSUM1,  // 5
-  GPS_CHECKSUM2,  // 6
-  GPS_TRAILER1,   // 7
-  GPS_TRAILER2,   // 8
-};
-
 static void gps_set_sirf();
 static void gps_enable_dgps();
 
-static inline int gps_can_read() {
-  return GPS.available();
-}
-
-static inline int gps_read() {
-  return GPS.read();
-}
-
 static inline void gps_write(const char *data) {
-  GPS.print(data);
+  gps_tx_write(data, strlen(data));
 }
 
 static inline void gps_writebyte(const char ch) {
-  GPS.write(ch);
-}
-
-static inline void gps_set_baud(long baud) {
-  GPS.flush();
-  delay(500);
-  GPS.begin(baud);
-  GPS.flush();
-}
-
-void gps_init() {
-  GPS.begin(4800);;
-  gps_set_sirf();
-  gps_enable_dgps();
+  gps_tx_write(&ch, 1);
 }
 
-inline char to_hex(unsigned char val) {
+static inline char to_hex(unsigned char val) {
   if (val > 10) {
     return 'A' + (val - 10);
   } else {
@@ -61,7 +27,7 @@ inline char to_hex(unsigned char val) {
   }
 }
 
-void gps_write_nmea(const char *sentence) {
+static void gps_write_nmea(const char *sentence) {
   unsigned char cksum = 0;
   for (const char *i = sentence; *i; i++) {
     cksum ^= *i;
@@ -75,7 +41,7 @@ void gps_write_nmea(const char *sentence) {
   gps_writebyte('\x0a');
 }
 
-void gps_write_sirf(const char *sentence, int len) {
+static void gps_write_sirf(const char *sentence, int len) {
   unsigned short cksum = 0;
   gps_write("\xa0\xa2");
   gps_writebyte(len >> 8);
@@ -89,7 +55,7 @@ void gps_write_sirf(const char *sentence, int len) {
   gps_write("\xb0\xb3");
 }
 
-void gps_enable_dgps() {
+static void gps_enable_dgps() {
   gps_write_sirf("\x84\x00", 2);
   /* Cmd: 128, 22 bytes unused, 20 channels, enable navlib */
   // gps_write_sirf("\x80\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x14\x10", 25);
@@ -114,35 +80,12 @@ void gps_enable_dgps() {
 
 }
 
-void gps_set_nmea_reporting() {
-  gps_write_nmea("PSRF103,00,00,01,01"); // GPGGA 1sec
-  gps_write_nmea("PSRF103,01,00,01,01"); // GPGLL off
-  gps_write_nmea("PSRF103,02,00,01,01"); // GPGSA 1sec
-  gps_write_nmea("PSRF103,03,00,10,01"); // GPGSV 10sec
-  gps_write_nmea("PSRF103,04,00,01,01"); // GPRMC 1sec
-  gps_write_nmea("PSRF103,05,00,00,01"); // GPVTG off
-  gps_write_nmea("PSRF103,07,00,01,01"); // GPZDA 1sec
-  gps_write_nmea("PSRF151,01"); // Enable WAAS */
-}
-
-void gps_set_sirf() {
+static void gps_set_sirf() {
 //  gps_write_nmea("PSRF101,0,0,0,000,0,0,12,8");
-  delay(1000);
   gps_write_nmea("PSRF100,0,38400,8,1,0");
-  gps_set_baud(38400);
 }
 
-static enum gps_state_t decoder_state;
-static char gps_ignore_payload;
-static char gps_message_valid;
-static unsigned int gps_payload_len;
-static unsigned int gps_payload_remain;
-static unsigned char gps_payload[GPS_BUFFER_SIZE];
-static unsigned int gps_payload_checksum;
-static unsigned int msg_checksum;
-static unsigned char *gps_payload_ptr;
-
-int gps_utc_offset(unsigned int hour, unsigned int minute, unsigned int second, unsigned int tow_second) {
+static int gps_utc_offset(unsigned int hour, unsigned int minute, unsigned int second, unsigned int tow_second) {
   unsigned int utc_tod = hour * 3600L + minute * 60L + second;
   unsigned int gps_tod = tow_second % 86400L;
   int utc_offset = utc_tod - gps_tod;
@@ -155,220 +98,77 @@ int gps_utc_offset(unsigned int hour, unsigned int minute, unsigned int second,
   return utc_offset;
 }
 
-void gps_handle_message();
-
-void gps_poll() {
-  while (gps_can_read()) {
-    int ch = gps_read();
-    switch (decoder_state) {
-      case GPS_HEADER1:
-        if (ch == 0xa0)
-          decoder_state = GPS_HEADER2;
-        else {
-          debug("Got garbage char "); debug_int(ch); debug(" from GPS\r\n");
-        }
-        break;
-      case GPS_HEADER2:
-        if (ch == 0xa2)
-          decoder_state = GPS_LENGTH1;
-        else {
-          debug("Got garbage char "); debug_int(ch); debug(" from GPS (expecting 2nd header byte)\r\n");
-          decoder_state = GPS_HEADER1;
-        }
-        break;
-      case GPS_LENGTH1:
-        gps_payload_len = (ch & 0x7f) << 8;
-        decoder_state = GPS_LENGTH2;
-        break;
-      case GPS_LENGTH2:
-        gps_payload_len += ch;
-        gps_payload_remain = gps_payload_len;
-        if (gps_payload_len > GPS_BUFFER_SIZE - 1) {
-          debug_int(gps_payload_len); debug(" byte payload too big\r\n");
-          gps_ignore_payload = 1;
-        } else {
-          gps_message_valid = 1;
-          gps_ignore_payload = 0;
-          gps_payload_checksum = 0;
-          gps_payload_ptr = gps_payload;
-        }
-        decoder_state = GPS_PAYLOAD;
-        break;
-      case GPS_PAYLOAD:
-        if (!gps_ignore_payload) {
-          *(gps_payload_ptr++) = ch;
-          gps_payload_checksum += ch;
-        }
-        if (--gps_payload_remain == 0)
-          decoder_state = GPS_CHECKSUM1;
-        break;
-      case GPS_CHECKSUM1:
-        msg_checksum = ch << 8;
-        decoder_state = GPS_CHECKSUM2;
-        break;
-      case GPS_CHECKSUM2:
-        msg_checksum += ch;
-        if (!gps_ignore_payload) {
-          gps_payload_checksum &= 0x7FFF;
-          if (gps_payload_checksum != msg_checksum) {
-            debug("Received checksum "); debug_int(msg_checksum);
-            debug(" != calculated "); debug_int(gps_payload_checksum);
-            debug(", discarding message\r\n");
-            gps_message_valid = 0;
-          }
-        }
-        decoder_state = GPS_TRAILER1;
-        break;
-      case GPS_TRAILER1:
-        if (ch == 0xb0)
-          decoder_state = GPS_TRAILER2;
-        else {
-          debug("GPS got garbage "); debug_int(ch); debug(" (expecting 1st trailer)\r\n");
-          decoder_state = GPS_HEADER1;
-        }
-        break;
-      case GPS_TRAILER2:
-        if (ch == 0xb3) {
-          if (gps_message_valid)
-            gps_handle_message();
-        } else {
-          debug("GPS Got garbage "); debug_int(ch); debug(" (expecting 2nd trailer\r\n");
-        }
-        decoder_state = GPS_HEADER1;
-        break;
-      default:
-        debug("GPS decoder in unknown state?\r\n");
-        decoder_state = GPS_HEADER1;
-    }
-  }
-}
+static void gps_navdata_message(const int32_t *field, const unsigned char *payload, unsigned int len) {
+  /* Channel PRNs used in the fix */
+  unsigned int svs = field[0];
 
-void gps_navdata_message() {
-#if 0
-  unsigned int mode1 = gps_payload[19];
-  unsigned int mode2 = gps_payload[21];
-  unsigned int svs = gps_payload[28];
-  unsigned int pmode = mode1 & 0x7;
-  debug("DGPS: ");
-  if (mode1 & 1<<7)
-    debug("OK");
-  else
-    debug("NO");
-
-  debug(" DOP: ");
-  if (mode1 & 1<<6)
-    debug("NO");
-  else
-    debug("OK");
-
-  debug(" VAL: ");
-  if (mode2 & 1<<1)
-    debug("OK");
-  else
-    debug("NO");
-  debug(" PMODE: ");
-  debug_int(pmode);
-  debug("\n");
-#endif
+  gps_sat_clear_used();
+  for (unsigned int i = 0 ; i < svs && i < 12 ; i++) {
+    if (payload[29 + i])
+      gps_sat_update(GPS_GNSS_GPS, payload[29 + i], GPS_SAT_UNKNOWN, GPS_SAT_UNKNOWN, 1);
+  }
 }
 
-void gps_tracking_data_message() {
-#if 0
-  unsigned char chans = gps_payload[7];
-  unsigned char ch;
-  unsigned char first = 1;
-
-  debug("SVs in view: ");
-
-  for (ch = 0 ; ch < chans ; ch++) {
-    unsigned char svid = gps_payload[8 + ch * 15];
-    if (svid != 0) {
-      unsigned char raw_az = gps_payload[9 + ch * 15];
-      unsigned char raw_el = gps_payload[10 + ch * 15];
-      unsigned int state = (unsigned int) gps_payload[11 + ch * 15] << 8
-                        | (unsigned int) gps_payload[12 + ch * 15];
-      float az = raw_az * 3.0 / 2.0;
-      float el = raw_el / 2.0;
-      float snr_avg = 0;
-      unsigned char meas;
-      for (meas = 0 ; meas < 2 ; meas++) {
-        snr_avg += gps_payload[15 + ch * 15 + meas];
-      }
-      snr_avg /= 2.0;
-
-      if (first)
-        first = 0;
-      else
-        debug(" ");
-      debug_int((unsigned int)svid);
-      debug(" ["); debug_float(az);
-      debug(" "); debug_float(el);
-      debug(" "); debug_float(snr_avg);
-      debug("]");
-    }
+static void gps_tracking_data_message(const int32_t *field, const unsigned char *payload, unsigned int len) {
+  unsigned int chans = field[0];
+
+  for (unsigned int ch = 0 ; ch < chans && 8 + 15 * (ch + 1) <= len ; ch++) {
+    const unsigned char *sv = payload + 8 + 15 * ch;
+    if (sv[0] == 0)
+      continue;
+    /* C/N0 for each of the last ten 100ms intervals */
+    unsigned int cno = 0;
+    for (int meas = 0 ; meas < 10 ; meas++)
+      cno += sv[5 + meas];
+    gps_sat_update(GPS_GNSS_GPS, sv[0], cno / 10, sv[2] / 2, GPS_SAT_UNKNOWN);
   }
-  debug("\n");
-#endif
 }
 
-void gps_clockstatus_message() {
-#if 0
-  unsigned int clock_bias = (unsigned int)gps_payload[12] << 24
-                 | (unsigned int)gps_payload[13] << 16
-                 | (unsigned int)gps_payload[14] << 8
-                 | (unsigned int)gps_payload[15];
-  unsigned int gps_ms = (unsigned int)gps_payload[16] << 24
-                 | (unsigned int)gps_payload[17] << 16
-                 | (unsigned int)gps_payload[18] << 8
-                 | (unsigned int)gps_payload[19];
-  debug("Clock bias: "); debug_long(clock_bias); debug("\n");
-  debug("GPS Time ms: "); debug_long(gps_ms); debug("\n");
-#endif
+static void gps_clockstatus_message(const int32_t *field, const unsigned char *payload, unsigned int len) {
+  /* Drift is in Hz at L1 */
+  gps_clock_update(field[1], (int32_t)((int64_t)field[0] * 100000 / 157542));
 }
 
-void gps_satvisible_message() {
+static void gps_satvisible_message(const int32_t *field, const unsigned char *payload, unsigned int len) {
 #if 0
-  unsigned short num_visible = gps_payload[1];
+  unsigned short num_visible = payload[1];
   debug("Visible SVs:");
   for (int i = 0 ; i < num_visible; i++) {
     debug(" ");
-    debug_int((int)(gps_payload[2 + 5 * i]));
+    debug_int((int)(payload[2 + 5 * i]));
   }
   debug("\n");
 #endif
 }
 
-void gps_dgps_message() {
+static void gps_dgps_message(const int32_t *field, const unsigned char *payload, unsigned int len) {
 #if 0
-  unsigned int dgps_source = gps_payload[1];
+  unsigned int dgps_source = payload[1];
 
   debug("DGPS source: "); debug_int(dgps_source); debug(", PRN:");
   for (int i = 16; i < 52 ; i += 3) {
     debug(" ");
-    debug_int((int)(gps_payload[i]));
+    debug_int((int)(payload[i]));
   }
   debug("\n");
 #endif
 }
 
-void gps_geodetic_message() {
-  unsigned int year = gps_payload[11] << 8 | gps_payload[12];
-  unsigned int month = gps_payload[13];
-  unsigned int day = gps_payload[14];
-  unsigned int hour = gps_payload[15];
-  unsigned int minute = gps_payload[16];
-  unsigned int rawsecond = (gps_payload[17] << 8 | gps_payload[18]);
+static void gps_geodetic_message(const int32_t *field, const unsigned char *payload, unsigned int len) {
+  unsigned int year = field[0];
+  unsigned int month = field[1];
+  unsigned int day = field[2];
+  unsigned int hour = field[3];
+  unsigned int minute = field[4];
+  unsigned int rawsecond = field[5];
   unsigned int second = rawsecond / 1000;
   unsigned int millis = rawsecond % 1000;
 
-  unsigned int gps_week = gps_payload[5] << 8 | gps_payload[6];
-  unsigned int gps_tow = (unsigned int)gps_payload[7] << 24
-                 | (unsigned int)gps_payload[8] << 16
-                 | (unsigned int)gps_payload[9] << 8
-                 | (unsigned int)gps_payload[10];
+  unsigned int gps_week = field[6];
+  unsigned int gps_tow = field[7];
   unsigned int gps_tow_sec = gps_tow / 1000L;
 
-  unsigned int numsvs = gps_payload[88];
+  unsigned int numsvs = field[8];
 
   debug_int(year); debug("-"); debug_int(month); debug("-"); debug_int(day);
   debug(" ");
@@ -380,60 +180,141 @@ void gps_geodetic_message() {
 
   int utc_offset = gps_utc_offset(hour, minute, second, gps_tow_sec);
 
-  time_set_date(gps_week, gps_tow_sec, utc_offset);
+  /* Sent after the solution, i.e. after the PPS it's for */
+  struct gps_time_t *rec = gps_time_record(gps_tow_sec, GPS_TIME_LAST);
+  rec->week = gps_week;
+  rec->utc_offset = utc_offset;
+  rec->flags |= GPS_TIME_DATE;
   health_set_gps_status(GPS_OK);
   health_reset_gps_watchdog();
 }
 
-void gps_ack_message() {
+static void gps_ack_message(const int32_t *field, const unsigned char *payload, unsigned int len) {
   debug("Got ACK for message ");
-  debug_int((int)gps_payload[1]);
+  debug_int((int)field[0]);
   debug("\r\n");
 }
 
-void gps_nak_message() {
+static void gps_nak_message(const int32_t *field, const unsigned char *payload, unsigned int len) {
   debug("Got NAK for message ");
-  debug_int((int)gps_payload[1]);
+  debug_int((int)field[0]);
   debug("\r\n");
 }
-void gps_handle_message() {
-  unsigned char message_type = gps_payload[0];
-  switch(message_type) {
-    case 2:
-      gps_navdata_message();
-      break;
-    case 4:
-      gps_tracking_data_message();
-      break;
-    case 7:
-      gps_clockstatus_message();
-      break;
-    case 11:
-      gps_ack_message();
-      break;
-    case 12:
-      gps_nak_message();
-      break;
-    case 13:
-      gps_satvisible_message();
-      break;
-    case 27:
-      gps_dgps_message();
+
+static const struct gps_message_t sirf_messages[] = {
+  { 2, 41, gps_navdata_message, { {28, GPS_U1} } },
+  { 4, 8, gps_tracking_data_message, { {7, GPS_U1} } },
+  { 7, 20, gps_clockstatus_message, { {8, GPS_U4 | GPS_BE}, {12, GPS_U4 | GPS_BE} } },
+  { 9, 1, 0 }, // CPU throughput
+  { 11, 2, gps_ack_message, { {1, GPS_U1} } },
+  { 12, 2, gps_nak_message, { {1, GPS_U1} } },
+  { 13, 2, gps_satvisible_message },
+  { 27, 52, gps_dgps_message },
+  { 41, 91, gps_geodetic_message, {
+    {11, GPS_U2 | GPS_BE}, {13, GPS_U1}, {14, GPS_U1}, {15, GPS_U1}, {16, GPS_U1},
+    {17, GPS_U2 | GPS_BE}, {5, GPS_U2 | GPS_BE}, {7, GPS_U4 | GPS_BE}, {88, GPS_U1}
+  } },
+};
+
+static void gps_handle_message(unsigned short id, const unsigned char *payload, unsigned int len) {
+  if (!gps_dispatch(sirf_messages, sizeof(sirf_messages) / sizeof(*sirf_messages), id, payload, len)) {
+    debug("Got "); debug_int(len);
+    debug(" byte message, type "); debug_int(id);
+    debug("\r\n");
+  }
+}
+
+struct sirf_framing {
+  static const char *name() { return "SiRF"; }
+  static const unsigned char SYNC1 = 0xa0, SYNC2 = 0xa2;
+  static const unsigned int HEADER_LEN = 2; // 15-bit length
+  static const bool CHECKSUM_HEADER = false;
+  static const bool HAS_TRAILER = true;
+  static const unsigned char TRAILER1 = 0xb0, TRAILER2 = 0xb3;
+  static const unsigned int BUFFER_SIZE = 255;
+  typedef gps_sum15 checksum;
+
+  static unsigned int payload_len(const unsigned char *header) {
+    return (header[0] & 0x7f) << 8 | header[1];
+  }
+  /* The message ID is the first byte of the payload, and the handlers'
+   * offsets count it.
+   */
+  static unsigned short message_id(const unsigned char *header, const unsigned char *payload) {
+    return payload[0];
+  }
+  static void handle(unsigned short id, const unsigned char *payload, unsigned int len) {
+    gps_handle_message(id, payload, len);
+  }
+};
+
+typedef gps_length_framer<sirf_framing> sirf_framer;
+
+/* Bring-up from factory defaults, NMEA at 4800, a step per loop pass with
+ * the probe held off: give the receiver a second, switch it to binary at
+ * 38400, and once that's out and it's had time to change over, follow it
+ * and turn on the messages we want.
+ */
+enum sirf_cfg_state_t {
+  SIRF_CFG_IDLE,
+  SIRF_CFG_FACTORY, // At 4800, waiting before we send PSRF100
+  SIRF_CFG_PORT,    // Sent PSRF100, waiting for it to go out
+  SIRF_CFG_MSGS,    // At 38400, waiting for the message setup to go out
+};
+
+static enum sirf_cfg_state_t sirf_cfg_state = SIRF_CFG_IDLE;
+static uint32_t sirf_cfg_sent;
+
+static void gps_sirf_poll() {
+  switch (sirf_cfg_state) {
+    case SIRF_CFG_IDLE:
       break;
-    case 41:
-      gps_geodetic_message();
+    case SIRF_CFG_FACTORY:
+      if (millis() - sirf_cfg_sent > 1000) {
+        gps_set_sirf();
+        sirf_cfg_sent = millis();
+        sirf_cfg_state = SIRF_CFG_PORT;
+      }
       break;
-    case 9:
+    case SIRF_CFG_PORT:
+      if (!gps_tx_done())
+        sirf_cfg_sent = millis();
+      else if (millis() - sirf_cfg_sent > 500) {
+        gps_set_serial(38400, GPS_8N1);
+        gps_enable_dgps();
+        sirf_cfg_state = SIRF_CFG_MSGS;
+      }
       break;
-    default:
-      debug("Got "); debug_int(gps_payload_len);
-      debug(" byte message, type "); debug_int((int)message_type);
-      debug("\r\n");
+    case SIRF_CFG_MSGS:
+      /* The probe changes the rate as soon as it has the port back */
+      if (gps_tx_done()) {
+        sirf_cfg_state = SIRF_CFG_IDLE;
+        gps_probe_release();
+      }
       break;
   }
 }
 
-void gps_get_timestamp(uint32_t *dest) {
-  return false;
+static void gps_sirf_init(const struct gps_serial_t *serial) {
+  sirf_framer::reset();
+  if (!serial) {
+    gps_set_serial(4800, GPS_8N1); // Factory default
+    sirf_cfg_sent = millis();
+    sirf_cfg_state = SIRF_CFG_FACTORY;
+    gps_probe_hold();
+    return;
+  }
+  sirf_cfg_state = SIRF_CFG_IDLE;
+  gps_enable_dgps();
 }
-#endif
+
+const struct gps_protocol_t gps_protocol_sirf = {
+  "sirf",
+  gps_sirf_init,
+  sirf_framer::decode,
+  sirf_framer::probe,
+  &sirf_framer::frames,
+  &sirf_framer::errors,
+  gps_sirf_poll,
+  GPS_TIME_DATE,
+};
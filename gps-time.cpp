@@ -0,0 +1,247 @@
+#define LOG_SUBSYSTEM LOG_GPS /* For debug.h */
+#include "config.h"
+#include <Arduino.h>
+#include "gps.h"
+#include "timer.h"
+#include "timing.h"
+#include "debug.h"
+#include "capture.h"
+#include "prof.h"
+
+/* Which second is this? A receiver describes each PPS edge in several
+ * messages, some sent before the edge (u-blox TIM-TP is about the next
+ * pulse) and some after (TIM-TM2, TSIP 8F-AB), so using whatever arrived
+ * last pairs the loop's edge with the wrong second about half the time.
+ *
+ * Instead each message goes into the record for the TOW it's about, and
+ * the record is tied to one of our captured edges by when the first byte of
+ * the message came in: a message about the next pulse belongs to the first
+ * edge after that, one about the last pulse to the last edge before.
+ *
+ * The loop runs on the newest edge whose record has everything the driver
+ * promised, which needn't be the newest edge: u-blox TIM-TM2 can come at
+ * the next navigation epoch, after the next edge. An edge that's waited
+ * GPS_TIME_WAIT_MS goes to the loop incomplete, and any older ones are
+ * skipped. The loop uses the edge's record and no other.
+ */
+
+#define GPS_TIME_KEPT 0x40 /* Slot in use */
+
+struct gps_edge_t {
+  uint32_t count;
+  uint64_t tick;
+  uint32_t tm;     /* TC_RA */
+  uint32_t second; /* Timer second nearest it */
+};
+
+uint64_t gps_frame_tick;
+
+static struct gps_time_t gps_times[GPS_TIME_RECORDS];
+static unsigned int gps_time_next;
+static struct gps_edge_t gps_edges[GPS_TIME_RECORDS];
+static unsigned int gps_edge_next;
+static uint32_t gps_edge_count; /* Newest edge we know about */
+static uint32_t gps_edge_done;  /* Newest the loop has had, or skipped */
+static const struct gps_edge_t *gps_edge_ready; /* Next for the loop */
+static unsigned char gps_time_expect;
+static struct gps_time_t gps_time_cur; /* For the edge the loop is on */
+static uint32_t gps_time_cur_tm;
+
+/* Catch up with the edges the timer interrupt has captured. One it didn't
+ * hand on to the loop (pps_int), as on a jam sync, the loop doesn't get.
+ */
+static void gps_time_edges() {
+  if (pps_count == gps_edge_count)
+    return;
+
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  uint32_t masked = prof_cycles();
+  uint32_t count = pps_count;
+  uint32_t tm = pps_capture;
+  uint64_t tick = pps_capture_tick;
+  uint32_t second = pps_capture_second;
+  char for_loop = pps_int;
+  pps_int = 0;
+  if (!primask)
+    prof_end(PROF_IRQ_MASKED, masked);
+  __set_PRIMASK(primask);
+
+  capture_pps(count, tm, tick);
+  gps_edge_count = count;
+  if (!for_loop)
+    gps_edge_done = count;
+  struct gps_edge_t *e = &gps_edges[gps_edge_next];
+  e->count = count;
+  e->tick = tick;
+  e->tm = tm;
+  e->second = second;
+  gps_edge_next = (gps_edge_next + 1) % GPS_TIME_RECORDS;
+}
+
+/* The last edge before tick, or 0 if it's older than we remember */
+static uint32_t gps_time_edge_before(uint64_t tick, uint64_t *edge_tick) {
+  uint32_t edge = 0;
+
+  *edge_tick = 0;
+  for (unsigned int i = 0 ; i < GPS_TIME_RECORDS ; i++) {
+    if (gps_edges[i].count && gps_edges[i].tick <= tick && (!edge || gps_edges[i].tick > *edge_tick)) {
+      edge = gps_edges[i].count;
+      *edge_tick = gps_edges[i].tick;
+    }
+  }
+  return edge;
+}
+
+/* For drivers that work out the edge themselves: the last edge before
+ * tick, and when it was.
+ */
+uint32_t gps_time_last_edge(uint64_t tick, uint64_t *edge_tick) {
+  gps_time_edges();
+  return gps_time_edge_before(tick, edge_tick);
+}
+
+static struct gps_time_t *gps_time_find_edge(uint32_t edge) {
+  struct gps_time_t *rec = NULL;
+
+  for (unsigned int i = 0 ; i < GPS_TIME_RECORDS ; i++) {
+    struct gps_time_t *t = &gps_times[i];
+    if ((t->flags & GPS_TIME_EDGE) && t->edge == edge && (!rec || t->rx_tick > rec->rx_tick))
+      rec = t;
+  }
+  return rec;
+}
+
+/* For drivers: the record for tow, to fill in. Call from a handler, so
+ * gps_frame_tick is the message's.
+ */
+struct gps_time_t *gps_time_record(uint32_t tow, enum gps_time_when_t when) {
+  struct gps_time_t *rec = NULL;
+
+  gps_time_edges();
+  for (unsigned int i = 0 ; i < GPS_TIME_RECORDS ; i++) {
+    if ((gps_times[i].flags & GPS_TIME_KEPT) && gps_times[i].tow == tow)
+      rec = &gps_times[i];
+  }
+
+  if (!rec) {
+    rec = &gps_times[gps_time_next];
+    gps_time_next = (gps_time_next + 1) % GPS_TIME_RECORDS;
+    memset(rec, 0, sizeof(*rec));
+    rec->tow = tow;
+    rec->rx_tick = gps_frame_tick;
+    rec->flags = GPS_TIME_KEPT;
+  }
+
+  if (when != GPS_TIME_ANY) {
+    uint64_t edge_tick;
+    uint32_t edge = gps_time_edge_before(gps_frame_tick, &edge_tick);
+    if (edge) {
+      if (when == GPS_TIME_NEXT)
+        edge++;
+      if ((rec->flags & GPS_TIME_EDGE) && rec->edge != edge) {
+        debug("GPS: messages for TOW "); debug_long(tow); debug(" disagree on the edge\r\n");
+      }
+      rec->edge = edge;
+      rec->flags |= GPS_TIME_EDGE;
+    }
+  }
+  return rec;
+}
+
+/* Forget everything, e.g. on changing receivers. expect is what the new
+ * driver fills in each second, or 0 for nothing to wait for.
+ */
+void gps_time_reset(unsigned char expect) {
+  memset(gps_times, 0, sizeof(gps_times));
+  gps_time_cur.flags = 0;
+  gps_time_expect = expect;
+}
+
+/* Whether there's an edge for the loop: the newest with its record
+ * complete, or that's waited long enough
+ */
+bool gps_time_ready() {
+  uint64_t now = timer_now();
+
+  gps_time_edges();
+  gps_edge_ready = NULL;
+  if (gps_edge_count == gps_edge_done)
+    return false;
+
+  for (unsigned int i = 0 ; i < GPS_TIME_RECORDS ; i++) {
+    const struct gps_edge_t *e = &gps_edges[i];
+    if ((int32_t)(e->count - gps_edge_done) <= 0)
+      continue;
+    if (gps_edge_ready && (int32_t)(e->count - gps_edge_ready->count) < 0)
+      continue;
+
+    const struct gps_time_t *rec = gps_time_find_edge(e->count);
+    if ((rec && (rec->flags & gps_time_expect) == gps_time_expect) || !gps_time_expect ||
+        now - e->tick > (uint64_t)GPS_TIME_WAIT_MS * (HZ / 1000))
+      gps_edge_ready = e;
+  }
+  return gps_edge_ready != NULL;
+}
+
+/* The loop is taking the edge gps_time_ready() found: set the date from its
+ * record, and keep the rest for gps_get_phase().
+ */
+void gps_time_edge() {
+  const struct gps_edge_t *e = gps_edge_ready;
+  const struct gps_time_t *rec = gps_time_find_edge(e->count);
+
+  if (e->count - gps_edge_done > 1) {
+    debug("GPS: skipped "); debug_long(e->count - gps_edge_done - 1); debug(" edges\r\n");
+  }
+  gps_edge_done = e->count;
+  gps_edge_ready = NULL;
+  gps_time_cur_tm = e->tm;
+
+  if (!rec) {
+    gps_time_cur.flags = 0;
+    if (gps_time_expect)
+      debug("GPS: no time messages for this edge\r\n");
+    return;
+  }
+
+  gps_time_cur = *rec;
+  if (rec->flags & GPS_TIME_DATE) {
+    /* The date is for the timer second nearest the edge, and we may be
+     * a second or two past it by now.
+     */
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    uint32_t masked = prof_cycles();
+    int late = timer_get_seconds() - e->second;
+    time_set_date(rec->week, rec->tow, rec->utc_offset + late);
+    if (!primask)
+      prof_end(PROF_IRQ_MASKED, masked);
+    __set_PRIMASK(primask);
+  }
+}
+
+/* Our second against the receiver's, for the edge the loop is on, once:
+ * from TIM-TM2 if the driver has it, otherwise from our capture of the
+ * receiver's PPS. Those are against different references, so a driver
+ * that promised TM2 and didn't send it gets the second skipped instead.
+ * Either way the receiver's word on how far its pulse was off (the
+ * sawtooth) comes out of it.
+ */
+enum gps_phase_t gps_get_phase(int32_t *dest) {
+  enum gps_phase_t phase;
+
+  if (gps_time_cur.flags & GPS_TIME_TM2) {
+    *dest = gps_time_cur.tm2_ns;
+    phase = GPS_PHASE_TM2;
+  } else if (gps_time_expect & GPS_TIME_TM2) {
+    return GPS_PHASE_NONE;
+  } else {
+    *dest = time_get_ns(gps_time_cur_tm, NULL) + PPS_FUDGE_NS;
+    phase = GPS_PHASE_CAPTURE;
+  }
+  if (gps_time_cur.flags & GPS_TIME_QUANT)
+    *dest -= gps_time_cur.quant_ns;
+  gps_time_cur.flags &= ~GPS_TIME_TM2;
+  return phase;
+}
@@ -1,39 +1,22 @@
+#define LOG_SUBSYSTEM LOG_GPS /* For debug.h */
 #include "config.h"
-#if GPS_TSIP
 
 #include <Arduino.h>
 #include "gps.h"
+#include "gps-protocol.h"
 #include "timing.h"
 #include "debug.h"
 #include "health.h"
 
-#define GPS_BUFFER_SIZE 256
-
-enum gps_state_t {
-  GPS_LEADER,    // 0
-  GPS_PACKETID,  // 1
-  GPS_PACKETID2, // 2
-  GPS_DATA,      // 2
-  GPS_DLE,       // 3
-};
-
-static inline int gps_can_read() {
-  return GPS.available();
-}
-
-static inline int gps_read() {
-  return GPS.read();
-}
-
 static inline void gps_write(const char *data) {
-  GPS.print(data);
+  gps_tx_write(data, strlen(data));
 }
 
 static inline void gps_writebyte(const char ch) {
-  GPS.write(ch);
+  gps_tx_write(&ch, 1);
 }
 
-void gps_write_tsip(const unsigned short packetid, const char *packet, int len) {
+static void gps_write_tsip(const unsigned short packetid, const char *packet, int len) {
   gps_writebyte(0x10); // DLE
   if (packetid > 0xFF)
     gps_writebyte(packetid >> 8);
@@ -61,10 +44,6 @@ static void gps_set_serial_options() {
     "\x00" // Reserved
     , 10
   );
-  GPS.flush();
-  delay(500);
-  GPS.begin(57600, SERIAL_8N1);
-  GPS.flush();
 }
 
 static void gps_set_utc_mode() {
@@ -74,26 +53,6 @@ static void gps_set_utc_mode() {
   );
 }
 
-static void gps_set_primary_config() {
-  gps_write_tsip(0xBB,
-    "\x00" // Set config
-    "\x07" // Overdetermined clock
-    "\xff" // Reserved
-    "\x04" // Stationary
-    "\xff" // Reserved
-//    "\x00\x00\x00\x3e" // Elevation mask: 10 degrees
-    "\x00\x00\x80\x3d" // Elevation mask: 5 degrees
-    "\x00\x00\x80\x40" // Signal mask: 4 AMU
-//    "\x00\x00\x40\x41" // PDOP mask: 12
-    "\x00\x00\x80\x41" // PDOP mask: 16
-    "\x00\x00\xc0\x40" // 2D/3D switch: 6
-    "\xff" // Reserved
-    "\x02" // Foliage: always
-    "\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff" // Reserved
-    , 40
-  );
-}
-
 static void gps_set_pps_config() {
   gps_write_tsip(0x8e4a,
     "\x01" // PPS on
@@ -106,103 +65,23 @@ static void gps_set_pps_config() {
 }
 
 
-static enum gps_state_t decoder_state = GPS_LEADER;
-static char gps_message_valid;
-static unsigned short gps_packetid;
-static unsigned int gps_payload_len;
-static unsigned char gps_payload[GPS_BUFFER_SIZE];
-static unsigned char *gps_payload_ptr;
 static char have_utcoffset = 0;
+static char tsip_surveying = 0;
+static uint32_t tsip_tow; /* Of the last 8F-AB */
 
-static void gps_handle_message();
-
-void gps_poll() {
-  while (gps_can_read()) {
-    int ch = gps_read();
-    switch (decoder_state) {
-      case GPS_LEADER:
-        if (ch == 0x10)
-          decoder_state = GPS_PACKETID;
-        else {
-          debug("Got garbage char "); debug_int(ch); debug(" from TSIP\r\n");
-        }
-        break;
-      case GPS_PACKETID:
-handle_packetid:
-        if (ch == 0x03) { // DLE ETX: this was actually an end-of-packet. Wait for the next.
-          decoder_state = GPS_LEADER;
-          break;
-        }
-
-        if (ch == 0x10) {
-          decoder_state = GPS_PACKETID;
-          break;
-        }
-        gps_packetid = ch;
-        gps_payload_len = 0;
-        gps_payload_ptr = gps_payload;
-        gps_message_valid = 1;
-        if (ch == 0x8F) // "Superpacket" has 2-byte ID
-          decoder_state = GPS_PACKETID2;
-        else
-          decoder_state = GPS_DATA;
-        break;
-      case GPS_PACKETID2:
-        gps_packetid = (gps_packetid << 8) | ch;
-        decoder_state = GPS_DATA;
-        break;
-      case GPS_DATA:
-        if (ch == 0x10) 
-          // Either the first part of an escaped DLE (DLE DLE), or end of packet (DLE ETX)
-          decoder_state = GPS_DLE;
-        else {
-handle_data:
-          gps_payload_len++;
-          if (gps_payload_len > GPS_BUFFER_SIZE - 1)
-            gps_message_valid = 0;
-          else
-            *(gps_payload_ptr++) = ch;
-        }
-        break;
-      case GPS_DLE:
-        if (ch == 0x10) { // DLE DLE = escaped DLE
-          decoder_state = GPS_DATA;
-          goto handle_data;
-        } else if (ch == 0x03) { // DLE ETX = end of packet
-          if (gps_message_valid)
-            gps_handle_message();
-          else {
-            debug_int(gps_payload_len); debug(" byte payload too big\r\n");
-          }
-          decoder_state = GPS_LEADER;
-        } else {
-          debug("Unknown sequence DLE + "); debug_int(ch); debug(" from GPS\r\n");
-          goto handle_packetid;
-          decoder_state = GPS_LEADER;
-        }
-    }
-  }
-}
-
-static void gps_timing_packet() {
-  unsigned int gps_tow = (unsigned int)gps_payload[0] << 24
-                | (unsigned int)gps_payload[1] << 16
-                | (unsigned int)gps_payload[2] << 8
-                | (unsigned int)gps_payload[3];
-  unsigned short gps_week = (unsigned short)gps_payload[4] << 8
-                | (unsigned short)gps_payload[5];
-  signed short utc_offset = (signed short)gps_payload[6] << 8
-                | (signed short)gps_payload[7];
+static void gps_timing_packet(const int32_t *field, const unsigned char *payload, unsigned int len) {
+  uint32_t gps_tow = field[0];
+  unsigned short gps_week = field[1];
+  signed short utc_offset = field[2];
 
-  unsigned char timing_flag = gps_payload[8];
+  unsigned char timing_flag = field[3];
 
-  unsigned char second = gps_payload[9];
-  unsigned char minute = gps_payload[10];
-  unsigned char hour = gps_payload[11];
-  unsigned char day = gps_payload[12];
-  unsigned char month = gps_payload[13];
-  unsigned short year = (unsigned short)gps_payload[14] << 8
-                | (unsigned short)gps_payload[15];
+  unsigned char second = field[4];
+  unsigned char minute = field[5];
+  unsigned char hour = field[6];
+  unsigned char day = field[7];
+  unsigned char month = field[8];
+  unsigned short year = field[9];
 
 
   debug_int(year); debug("-"); debug_int(month); debug("-"); debug_int(day);
@@ -217,7 +96,7 @@ static void gps_timing_packet() {
     {0, "TEST"}
   };
 
-  for (int i = 0 ; i < sizeof(timing_flag_msg) / sizeof(*timing_flag_msg); i++) {
+  for (unsigned int i = 0 ; i < sizeof(timing_flag_msg) / sizeof(*timing_flag_msg); i++) {
     const char *msg = timing_flag_msg[i][(timing_flag >> i) & 1];
     if (msg) {
       debug(" ");
@@ -227,11 +106,52 @@ static void gps_timing_packet() {
 
   debug("\r\n");
 
-  time_set_date(gps_week, gps_tow, -utc_offset);
+  /* 8F-AB follows the PPS it's about, and 8F-AC follows it */
+  struct gps_time_t *rec = gps_time_record(gps_tow, GPS_TIME_LAST);
+  rec->week = gps_week;
+  rec->utc_offset = -utc_offset;
+  rec->flags |= GPS_TIME_DATE;
+  tsip_tow = gps_tow;
   have_utcoffset = (timing_flag & 8) ? 0 : 1;
 }
 
-static void gps_supplemental_timing_packet() {
+/* Single-precision float, already put in our byte order by gps_dispatch */
+static float tsip_float(int32_t bits) {
+  float val;
+  memcpy(&val, &bits, sizeof(val));
+  return val;
+}
+
+/* Satellite telemetry. The Thunderbolt spreads it over three packets:
+ * signal levels (0x47), tracking status with elevation (0x5C), and the
+ * satellites in the fix (0x6D). Signal levels are in AMU or dB-Hz,
+ * depending on the receiver's I/O options.
+ */
+static void gps_signal_levels_packet(const int32_t *field, const unsigned char *payload, unsigned int len) {
+  unsigned int count = field[0];
+
+  for (unsigned int i = 0 ; i < count && 1 + 5 * (i + 1) <= len ; i++) {
+    const unsigned char *sv = payload + 1 + 5 * i;
+    float level = tsip_float(gps_get_field(sv + 1, GPS_U4 | GPS_BE));
+    gps_sat_update(GPS_GNSS_GPS, sv[0], nearbyint(level), GPS_SAT_UNKNOWN, GPS_SAT_UNKNOWN);
+  }
+}
+
+static void gps_sat_tracking_packet(const int32_t *field, const unsigned char *payload, unsigned int len) {
+  float level = tsip_float(field[1]);
+  float elev = tsip_float(field[2]) * (180 / M_PI);
+  gps_sat_update(GPS_GNSS_GPS, field[0], nearbyint(level), nearbyint(elev), GPS_SAT_UNKNOWN);
+}
+
+static void gps_all_in_view_packet(const int32_t *field, const unsigned char *payload, unsigned int len) {
+  unsigned int count = field[0] >> 4;
+
+  gps_sat_clear_used();
+  for (unsigned int i = 0 ; i < count && 17 + i < len ; i++)
+    gps_sat_update(GPS_GNSS_GPS, payload[17 + i], GPS_SAT_UNKNOWN, GPS_SAT_UNKNOWN, 1);
+}
+
+static void gps_supplemental_timing_packet(const int32_t *field, const unsigned char *payload, unsigned int len) {
   static const char *rcv_mode_msg[] = {
     "AUTO", "1SAT", "MODE2", "2D", "3D", "DGPR", "CLOCK2D", "CLOCKOD"
   };
@@ -250,20 +170,17 @@ static void gps_supplemental_timing_packet() {
     "TRAIM_ERROR"
   };
 
-  unsigned char rcv_mode = gps_payload[0];
-  unsigned char survey_pct = gps_payload[2];
-  unsigned short alarm = (unsigned short)gps_payload[9] << 8 
-                       | (unsigned short)gps_payload[10];
-  unsigned char gps_status = gps_payload[11];
-  
-  volatile float quantization_error;
-  char *qeptr = (char *)(&quantization_error);
-  memcpy(qeptr, gps_payload + 62, 1);
-  memcpy(qeptr + 1, gps_payload + 61, 1);
-  memcpy(qeptr + 2, gps_payload + 60, 1);
-  memcpy(qeptr + 3, gps_payload + 59, 1); 
-  int quantization_error_ns = nearbyint(quantization_error);
-  time_set_sawtooth(quantization_error_ns);
+  unsigned char rcv_mode = field[0];
+  unsigned char survey_pct = field[1];
+  unsigned short alarm = field[2];
+  unsigned char gps_status = field[3];
+
+  float quantization_error = tsip_float(field[4]);
+  /* The Thunderbolt's own oscillator against GPS: ns and ppb */
+  gps_clock_update(nearbyint(tsip_float(field[5])), nearbyint(tsip_float(field[6])));
+  struct gps_time_t *rec = gps_time_record(tsip_tow, GPS_TIME_ANY);
+  rec->quant_ns = nearbyint(quantization_error);
+  rec->flags |= GPS_TIME_QUANT;
   debug("GPS Mode: "); 
   if (rcv_mode < sizeof(rcv_mode_msg) / sizeof(*rcv_mode_msg)) {
     debug(rcv_mode_msg[rcv_mode]);
@@ -279,7 +196,7 @@ static void gps_supplemental_timing_packet() {
 
   if (alarm & alarm_mask) {
     debug(" Alarm:");
-    for (int i = 0 ; i < sizeof(alarm_msg) / sizeof(*alarm_msg) ; i++) {
+    for (unsigned int i = 0 ; i < sizeof(alarm_msg) / sizeof(*alarm_msg) ; i++) {
       if (alarm & 1 << i) {
         debug(" ");
         debug(alarm_msg[i]);
@@ -294,6 +211,21 @@ static void gps_supplemental_timing_packet() {
 
   debug("\r\n");
 
+  if (alarm & 0x20) {
+    tsip_surveying = 1;
+    gps_survey_progress(survey_pct, 0);
+  } else if (tsip_surveying && rcv_mode == 7) {
+    /* Survey just finished and we're in overdetermined clock mode, so
+     * the position in this packet is the surveyed one.
+     */
+    int32_t ecef[3];
+    gps_lla_to_ecef(gps_get_double(payload + 35, true), gps_get_double(payload + 43, true),
+        gps_get_double(payload + 51, true), ecef);
+    tsip_surveying = 0;
+    gps_survey_progress(100, 0);
+    gps_survey_done(ecef, 0);
+  }
+
   enum gps_status_t status = GPS_OK;
   if (alarm & 0x820)
     status = GPS_MINOR_ALARM;
@@ -307,33 +239,147 @@ static void gps_supplemental_timing_packet() {
   health_reset_gps_watchdog();
 }
 
-static void gps_handle_message() {
-  switch (gps_packetid) {
-    case 0x8FAB:
-      gps_timing_packet();
-      break;
-    case 0x8FAC:
-      gps_supplemental_timing_packet();
-      break;
-    default:
-      debug("Got "); debug_int(gps_payload_len);
-      debug(" byte message, type "); debug_int(gps_packetid);
-      debug("\r\n");
-      break;
+static const struct gps_message_t tsip_messages[] = {
+  { 0x8FAB, 16, gps_timing_packet, {
+    {0, GPS_U4 | GPS_BE}, {4, GPS_U2 | GPS_BE}, {6, GPS_I2 | GPS_BE}, {8, GPS_U1},
+    {9, GPS_U1}, {10, GPS_U1}, {11, GPS_U1}, {12, GPS_U1}, {13, GPS_U1}, {14, GPS_U2 | GPS_BE}
+  } },
+  { 0x8FAC, 63, gps_supplemental_timing_packet, {
+    {0, GPS_U1}, {2, GPS_U1}, {9, GPS_U2 | GPS_BE}, {11, GPS_U1}, {59, GPS_U4 | GPS_BE},
+    {15, GPS_U4 | GPS_BE}, {19, GPS_U4 | GPS_BE}
+  } },
+  { 0x47, 1, gps_signal_levels_packet, { {0, GPS_U1} } },
+  { 0x5C, 24, gps_sat_tracking_packet, { {0, GPS_U1}, {4, GPS_U4 | GPS_BE}, {12, GPS_U4 | GPS_BE} } },
+  { 0x6D, 17, gps_all_in_view_packet, { {0, GPS_U1} } },
+};
+
+static void gps_handle_message(unsigned short id, const unsigned char *payload, unsigned int len) {
+  if (!gps_dispatch(tsip_messages, sizeof(tsip_messages) / sizeof(*tsip_messages), id, payload, len)) {
+    debug("Got "); debug_int(len);
+    debug(" byte message, type "); debug_int(id);
+    debug("\r\n");
   }
 }
 
-void gps_init() {
-  GPS.begin(9600, SERIAL_8O1);;
-  delay(100);
-  gps_set_serial_options();
-  delay(100);
+struct tsip_framing {
+  static const char *name() { return "TSIP"; }
+  static const unsigned int BUFFER_SIZE = 255;
+
+  static bool two_byte_id(unsigned char id) {
+    return id == 0x8F; // "Superpacket" has 2-byte ID
+  }
+  static void handle(unsigned short id, const unsigned char *payload, unsigned int len) {
+    gps_handle_message(id, payload, len);
+  }
+};
+
+typedef gps_dle_framer<tsip_framing> tsip_framer;
+
+/* Skip the self-survey with the position we saved from the last one. TSIP
+ * only takes single-precision ECEF, so this is good to about half a metre.
+ */
+static void gps_set_position() {
+  struct gps_position_t pos;
+  char packet[12];
+
+  if (!gps_get_position(&pos))
+    return;
+
+  for (int i = 0 ; i < 3 ; i++) {
+    float meters = pos.ecef[i] / 100.0;
+    uint32_t bits;
+    memcpy(&bits, &meters, sizeof(bits));
+    for (int j = 0 ; j < 4 ; j++)
+      packet[4 * i + j] = bits >> (24 - 8 * j);
+  }
+  gps_write_tsip(0x31, packet, sizeof(packet));
+}
+
+static void tsip_configure() {
   gps_set_utc_mode();
   gps_set_pps_config();
+  gps_set_position();
+}
+
+/* Moving the port over takes a few loop passes: 0xBC has to get out at the
+ * old rate and the receiver switch before we follow it, and it wants a
+ * moment at the new rate before it takes anything else. From factory
+ * defaults the probe is held off meanwhile, and gets the port back once
+ * the configuration is out.
+ */
+enum tsip_cfg_state_t {
+  TSIP_CFG_IDLE,
+  TSIP_CFG_FACTORY,  // At 9600 8O1, waiting before we send 0xBC
+  TSIP_CFG_PORT,     // Sent 0xBC, waiting for it to go out
+  TSIP_CFG_SWITCHED, // At 57600, waiting before we configure
+  TSIP_CFG_SENT,     // Configured from factory defaults, waiting for it to go out
+};
+
+static enum tsip_cfg_state_t tsip_cfg_state = TSIP_CFG_IDLE;
+static uint32_t tsip_cfg_sent;
+static char tsip_bringup;
+
+static void gps_tsip_poll() {
+  switch (tsip_cfg_state) {
+    case TSIP_CFG_IDLE:
+      break;
+    case TSIP_CFG_FACTORY:
+      if (millis() - tsip_cfg_sent > 100) {
+        gps_set_serial_options();
+        tsip_cfg_sent = millis();
+        tsip_cfg_state = TSIP_CFG_PORT;
+      }
+      break;
+    case TSIP_CFG_PORT:
+      if (!gps_tx_done())
+        tsip_cfg_sent = millis();
+      else if (millis() - tsip_cfg_sent > 500) {
+        gps_set_serial(57600, GPS_8N1);
+        tsip_cfg_sent = millis();
+        tsip_cfg_state = TSIP_CFG_SWITCHED;
+      }
+      break;
+    case TSIP_CFG_SWITCHED:
+      if (millis() - tsip_cfg_sent > 100) {
+        tsip_configure();
+        tsip_cfg_state = tsip_bringup ? TSIP_CFG_SENT : TSIP_CFG_IDLE;
+      }
+      break;
+    case TSIP_CFG_SENT:
+      /* The probe changes the rate as soon as it has the port back */
+      if (gps_tx_done()) {
+        tsip_cfg_state = TSIP_CFG_IDLE;
+        gps_probe_release();
+      }
+      break;
+  }
 }
 
-void gps_get_timestamp(uint32_t *dest) {
-  return false;
+static void gps_tsip_init(const struct gps_serial_t *serial) {
+  tsip_framer::reset();
+  tsip_surveying = 0;
+  tsip_bringup = !serial;
+  tsip_cfg_sent = millis();
+  if (!serial) {
+    gps_set_serial(9600, GPS_8O1); // Factory default
+    tsip_cfg_state = TSIP_CFG_FACTORY;
+    gps_probe_hold();
+  } else if (serial->baud != 57600 || serial->format != GPS_8N1) {
+    gps_set_serial_options();
+    tsip_cfg_state = TSIP_CFG_PORT;
+  } else {
+    tsip_configure();
+    tsip_cfg_state = TSIP_CFG_IDLE;
+  }
 }
 
-#endif
+const struct gps_protocol_t gps_protocol_tsip = {
+  "tsip",
+  gps_tsip_init,
+  tsip_framer::decode,
+  tsip_framer::probe,
+  &tsip_framer::frames,
+  &tsip_framer::errors,
+  gps_tsip_poll,
+  GPS_TIME_DATE | GPS_TIME_QUANT,
+};
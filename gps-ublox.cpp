@@ -1,41 +1,20 @@
+#define LOG_SUBSYSTEM LOG_GPS /* For debug.h */
 #include "config.h"
-#if GPS_UBLOX
 
 #include <Arduino.h>
 #include "gps.h"
+#include "gps-protocol.h"
 #include "timing.h"
 #include "debug.h"
 #include "health.h"
 #include "monitor.h"
 
-#define GPS_BUFFER_SIZE 256
-
-enum gps_state_t {
-  GPS_SYNC1,     // 0
-  GPS_SYNC2,     // 1
-  GPS_CLASS,     // 2
-  GPS_ID,        // 3
-  GPS_LENGTH1,   // 4
-  GPS_LENGTH2,   // 5
-  GPS_DATA,      // 6
-  GPS_CHECKSUM1, // 7
-  GPS_CHECKSUM2, // 8
-};
-
-static inline int gps_can_read() {
-  return GPS.available();
-}
-
-static inline int gps_read() {
-  return GPS.read();
-}
-
 static inline void gps_write(const char *data) {
-  GPS.print(data);
+  gps_tx_write(data, strlen(data));
 }
 
 static inline void gps_writebyte(const char ch) {
-  GPS.write(ch);
+  gps_tx_write(&ch, 1);
 }
 
 static inline void gps_checksum(const unsigned char ch, unsigned char *ck_a, unsigned char *ck_b) {
@@ -44,11 +23,11 @@ static inline void gps_checksum(const unsigned char ch, unsigned char *ck_a, uns
 }
 
 static inline void gps_writebyte_check(const unsigned char ch, unsigned char *ck_a, unsigned char *ck_b) {
-  GPS.write(ch);
+  gps_tx_write(&ch, 1);
   gps_checksum(ch, ck_a, ck_b);
 }
 
-void gps_write_ublox(const unsigned short packetid, const char *packet, int len) {
+static void gps_write_ublox(const unsigned short packetid, const char *packet, int len) {
   unsigned char ck_a = 0, ck_b = 0;
 
   gps_writebyte(0xb5);
@@ -56,7 +35,7 @@ void gps_write_ublox(const unsigned short packetid, const char *packet, int len)
   gps_writebyte_check(packetid >> 8, &ck_a, &ck_b);
   gps_writebyte_check(packetid & 0xff, &ck_a, &ck_b);
   gps_writebyte_check(len & 0xff, &ck_a, &ck_b);
-  gps_writebyte_check(len >> 16, &ck_a, &ck_b);
+  gps_writebyte_check(len >> 8, &ck_a, &ck_b);
   for (int i = 0 ; i < len ; i++) {
     gps_writebyte_check(packet[i], &ck_a, &ck_b);
   }
@@ -64,155 +43,287 @@ void gps_write_ublox(const unsigned short packetid, const char *packet, int len)
   gps_writebyte(ck_b);
 }
 
-/*
+/* UART1 to 57600 8N1, UBX only in and out. The receiver switches as soon
+ * as it has the message, so the ACK is lost; the caller follows it over.
+ */
 static void gps_set_serial_options() {
-  gps_write_tsip(0xBC,
-    "\x00" // Port 0
-    "\x0A" // Input rate 57600
-    "\x0A" // Output rate 57600
-    "\x03" // 8 bit
-    "\x00" // No parity
-    "\x00" // 1 stop bit
-    "\x00" // No flow control
-    "\x02" // Input TSIP
-    "\x02" // Output TSIP
-    "\x00" // Reserved
-    , 10
+  gps_write_ublox(0x0600,
+      "\x01"             // Port 1
+      "\x00"             // Reserved
+      "\x00\x00"         // txReady disabled
+      "\xd0\x08\x00\x00" // 8N1
+      "\x00\xe1\x00\x00" // 57600
+      "\x01\x00"         // In: UBX
+      "\x01\x00"         // Out: UBX
+      "\x00\x00"         // Flags
+      "\x00\x00",        // Reserved
+      20
   );
-  GPS.flush();
-  delay(500);
-  GPS.begin(57600, SERIAL_8N1);
-  GPS.flush();
 }
-*/
 
-static void gps_set_serial_options() {
-  gps_write_ublox(0x600,
-      "\x01"     // Port 1
-      "\x00"     // Reserved
-      "\x00\x00" // txReady disabled
-      "",
-      4
-  );
+/* Configuration engine. Each step polls the current setting first and only
+ * sends the new one if it differs, so a configured receiver isn't written
+ * to (and a survey in progress isn't restarted) on every boot. A set has
+ * to be ACKed and then read back to match before we move on; timeouts and
+ * mismatches retry up to UBX_CFG_RETRIES times, and a NAK fails the step
+ * outright. It all runs from gps_poll(), a message at a time.
+ */
+
+#define UBX_CFG_IF_NAK 1   /* Only if the step before was NAKed (M8T after 6T) */
+#define UBX_CFG_OPTIONAL 2 /* Not every receiver has it; don't count failure */
+
+struct ubx_cfg_step_t {
+  const char *name;
+  unsigned short id;
+  const char *set;
+  unsigned char set_len;
+  const char *poll;
+  unsigned char poll_len;
+  /* set[set_offset...] must match the poll reply at reply_offset */
+  unsigned char set_offset, reply_offset, verify_len;
+  unsigned char flags;
+};
+
+/* Timing mode: survey-in, or fixed at the saved position once we have one.
+ * Filled in by ubx_cfg_timing_mode(). Verified up to the end of ECEF Z.
+ */
+static char ubx_tmode2[28];
+static char ubx_tmode3[40];
+
+static void ubx_put_u4(char *p, uint32_t val) {
+  for (int i = 0 ; i < 4 ; i++)
+    p[i] = val >> (8 * i);
 }
 
-static enum gps_state_t decoder_state = GPS_SYNC1;
-static char gps_message_valid;
-static unsigned short gps_packetid;
-static unsigned int gps_payload_len;
-static unsigned int gps_payload_read;
-static unsigned char gps_payload[GPS_BUFFER_SIZE];
-static unsigned char *gps_payload_ptr;
-static unsigned char ck_a, ck_b;
-
-void gps_handle_message();
-
-void gps_poll() {
-  while (gps_can_read()) {
-    int ch = gps_read();
-
-    switch (decoder_state) {
-      case GPS_SYNC1:
-//        debug("S1 ");
-        if (ch == 0xb5)
-          decoder_state = GPS_SYNC2;
-        else {
-//          debug("Got garbage char "); debug_hex(ch); debug(" from UBX\r\n");
-        }
-        break;
-      case GPS_SYNC2:
-//        debug("S2 ");
-        if (ch == 0x62) {
-          ck_a = ck_b = 0;
-          decoder_state = GPS_CLASS;
-        } else {
-//          debug("Got garbage char "); debug_hex(ch); debug(" from UBX\r\n");
-          decoder_state = GPS_SYNC1;
-        }
-        break;
-      case GPS_CLASS:
-//        debug("I1 ");
-        gps_packetid = ch << 8;
-        gps_checksum(ch, &ck_a, &ck_b);
-        decoder_state = GPS_ID;
-        break;
-      case GPS_ID:
-//        debug("I2 ");
-        gps_packetid |= ch;
-        gps_checksum(ch, &ck_a, &ck_b);
-        decoder_state = GPS_LENGTH1;
-        break;
-      case GPS_LENGTH1:
-//        debug("L1 ");
-        gps_payload_len = ch;
-        gps_checksum(ch, &ck_a, &ck_b);
-        decoder_state = GPS_LENGTH2;
-        break;
-      case GPS_LENGTH2:
-//        debug("L2 ");
-        gps_payload_len |= ch << 8;
-        gps_checksum(ch, &ck_a, &ck_b);
-        gps_payload_ptr = gps_payload;
-        gps_payload_read = 0;
-        if (gps_payload_len < GPS_BUFFER_SIZE)
-          gps_message_valid = 1;
-        else
-          gps_message_valid = 0;
-        if (gps_payload_len > 0)
-          decoder_state = GPS_DATA;
-        else
-          decoder_state = GPS_CHECKSUM1;
-        break;
-      case GPS_DATA:
-//        debug("DD ");
-        if (gps_message_valid)
-          *(gps_payload_ptr++) = ch;
-        gps_checksum(ch, &ck_a, &ck_b);
-        gps_payload_read ++;
-        if (gps_payload_read == gps_payload_len)
-          decoder_state = GPS_CHECKSUM1;
-        break;
-      case GPS_CHECKSUM1:
-//        debug("C1 ");
-        if (ch != ck_a) {
-          debug("Invalid CK_A from UBX: "); debug_hex(ch); debug(" != "); debug_hex(ck_a); debug(", message was "); debug_hex(gps_packetid); debug("\r\n");
-          gps_message_valid = 0;
-        }
-        decoder_state = GPS_CHECKSUM2;
-        break;
-      case GPS_CHECKSUM2:
-//        debug("C2 ");
-        if (ch != ck_b) {
-          debug("Invalid CK_B from UBX: "); debug_hex(ch); debug(" != "); debug_hex(ck_b); debug(", message was "); debug_hex(gps_packetid); debug("\r\n");
-          gps_message_valid = 0;
-        }
-        if (gps_message_valid)
-          gps_handle_message();
-        decoder_state = GPS_SYNC1;
-        break;
+static void ubx_cfg_timing_mode() {
+  struct gps_position_t pos;
+  bool fixed = gps_get_position(&pos);
+
+  memset(ubx_tmode2, 0, sizeof(ubx_tmode2));
+  memset(ubx_tmode3, 0, sizeof(ubx_tmode3));
+
+  if (fixed) {
+    ubx_tmode2[0] = 2;  // Fixed mode, ECEF
+    ubx_tmode3[2] = 2;  // Fixed mode, ECEF
+    for (int i = 0 ; i < 3 ; i++) {
+      ubx_put_u4(ubx_tmode2 + 4 + 4 * i, pos.ecef[i]);  // cm
+      ubx_put_u4(ubx_tmode3 + 4 + 4 * i, pos.ecef[i]);  // cm
     }
-//    debug_hex(ch);
-//    debug("\r\n");
+    ubx_put_u4(ubx_tmode2 + 16, pos.acc_mm ? pos.acc_mm : GPS_SURVEY_ACC_MM);      // mm
+    ubx_put_u4(ubx_tmode3 + 20, (pos.acc_mm ? pos.acc_mm : GPS_SURVEY_ACC_MM) * 10); // 0.1mm
+  } else {
+    ubx_tmode2[0] = 1;  // Survey-in
+    ubx_tmode3[2] = 1;  // Survey-in
   }
+  ubx_put_u4(ubx_tmode2 + 20, GPS_SURVEY_MIN_SEC);
+  ubx_put_u4(ubx_tmode2 + 24, GPS_SURVEY_ACC_MM);       // mm
+  ubx_put_u4(ubx_tmode3 + 24, GPS_SURVEY_MIN_SEC);
+  ubx_put_u4(ubx_tmode3 + 28, GPS_SURVEY_ACC_MM * 10);  // 0.1mm
 }
 
-static int32_t pps_adjust;
+static const struct ubx_cfg_step_t ubx_cfg_steps[] = {
+  { "TMODE2", 0x063d, ubx_tmode2, sizeof(ubx_tmode2), "", 0, 0, 0, 16, UBX_CFG_OPTIONAL },
+  { "TMODE3", 0x0671, ubx_tmode3, sizeof(ubx_tmode3), "", 0, 0, 0, 16, UBX_CFG_IF_NAK },
+  { "TP5", 0x0631,
+    "\x00"             // TIMEPULSE
+    "\x00"             // Version
+    "\x00\x00"         // Reserved
+    "\x00\x00"         // Antenna cable delay
+    "\x00\x00"         // RF group delay
+    "\x40\x42\x0f\x00" // Period 1s
+    "\x40\x42\x0f\x00" // Period when locked 1s
+    "\xa0\x86\x01\x00" // Pulse length 100ms
+    "\xa0\x86\x01\x00" // Pulse length when locked 100ms
+    "\x00\x00\x00\x00" // User delay
+    "\x77\x00\x00\x00" // Active, locked to GPS, period and length, aligned to TOW, rising
+    , 32, "\x00", 1, 8, 8, 24, 0 },
+  { "MSG TIM-TP", 0x0601, "\x0d\x01\x01", 3, "\x0d\x01", 2, 2, 3, 1, 0 },
+#if GPS_UBLOX_TIMESTAMP
+  { "MSG TIM-TM2", 0x0601, "\x0d\x03\x01", 3, "\x0d\x03", 2, 2, 3, 1, 0 },
+#endif
+  { "MSG NAV-STATUS", 0x0601, "\x01\x03\x01", 3, "\x01\x03", 2, 2, 3, 1, 0 },
+  { "MSG NAV-TIMEUTC", 0x0601, "\x01\x21\x01", 3, "\x01\x21", 2, 2, 3, 1, 0 },
+  /* Satellite telemetry, every few seconds is plenty */
+  { "MSG NAV-SAT", 0x0601, "\x01\x35\x05", 3, "\x01\x35", 2, 2, 3, 1, UBX_CFG_OPTIONAL },
+  { "MSG NAV-SVINFO", 0x0601, "\x01\x30\x05", 3, "\x01\x30", 2, 2, 3, 1, UBX_CFG_OPTIONAL },
+  { "MSG NAV-CLOCK", 0x0601, "\x01\x22\x05", 3, "\x01\x22", 2, 2, 3, 1, 0 },
+  { "MSG TIM-SVIN", 0x0601, "\x0d\x04\x01", 3, "\x0d\x04", 2, 2, 3, 1, UBX_CFG_OPTIONAL },
+  { "MSG NAV-SVIN", 0x0601, "\x01\x3b\x01", 3, "\x01\x3b", 2, 2, 3, 1, UBX_CFG_OPTIONAL },
+};
 
-void gps_message_tim_tp() {
-  unsigned int tow_msec = *((unsigned int *)(gps_payload));
-  unsigned short gps_week = *((unsigned short *)(gps_payload + 12));
-  char flags = gps_payload[14];
-  int32_t quant = *((int32_t *)(gps_payload + 8));
-  monitor_send("sawtooth", quant);
-  pps_adjust = -quant / 1000;
+#define UBX_CFG_STEPS (sizeof(ubx_cfg_steps) / sizeof(*ubx_cfg_steps))
 
-  time_set_date(gps_week, (tow_msec / 1000), -1);
+enum ubx_cfg_state_t {
+  UBX_CFG_IDLE,
+  UBX_CFG_PORT,         // Sent CFG-PRT, waiting for it to go out
+  UBX_CFG_BRINGUP,      // Likewise, from factory defaults
+  UBX_CFG_BRINGUP_MSGS, // Turned the messages on blind, waiting for them to go out
+  UBX_CFG_POLL,         // Polled, waiting for the reply
+  UBX_CFG_SET,          // Sent the setting, waiting for ACK
+  UBX_CFG_VERIFY,       // ACKed, polled, waiting for the reply
+};
+
+static enum ubx_cfg_state_t cfg_state = UBX_CFG_IDLE;
+static unsigned int cfg_step;
+static unsigned int cfg_tries;
+static uint32_t cfg_sent;
+static char cfg_last_nak;
+static unsigned int cfg_failed;
+
+static void ubx_cfg_poll_step() {
+  const struct ubx_cfg_step_t *step = &ubx_cfg_steps[cfg_step];
+  gps_write_ublox(step->id, step->poll, step->poll_len);
+  cfg_sent = millis();
+}
+
+static void ubx_cfg_set_step() {
+  const struct ubx_cfg_step_t *step = &ubx_cfg_steps[cfg_step];
+  gps_write_ublox(step->id, step->set, step->set_len);
+  cfg_sent = millis();
+  cfg_state = UBX_CFG_SET;
+}
+
+static void ubx_cfg_start_step() {
+  while (cfg_step < UBX_CFG_STEPS && (ubx_cfg_steps[cfg_step].flags & UBX_CFG_IF_NAK) && !cfg_last_nak) {
+    cfg_step++;
+  }
+
+  if (cfg_step == UBX_CFG_STEPS) {
+    debug("UBX config done, "); debug_int(cfg_failed); debug(" failed\r\n");
+    monitor_send(MONITOR_GPS_CFG_FAILED, cfg_failed);
+    cfg_state = UBX_CFG_IDLE;
+    return;
+  }
+
+  cfg_tries = 0;
+  cfg_last_nak = 0;
+  cfg_state = UBX_CFG_POLL;
+  ubx_cfg_poll_step();
+}
+
+static void ubx_cfg_finish_step(const char *result, char failed) {
+  debug("UBX CFG-"); debug(ubx_cfg_steps[cfg_step].name); debug(": "); debug(result); debug("\r\n");
+  if (failed && !(ubx_cfg_steps[cfg_step].flags & UBX_CFG_OPTIONAL))
+    cfg_failed++;
+  cfg_step++;
+  ubx_cfg_start_step();
+}
+
+static void ubx_cfg_start() {
+  ubx_cfg_timing_mode();
+  cfg_step = 0;
+  cfg_failed = 0;
+  cfg_last_nak = 0;
+  ubx_cfg_start_step();
+}
+
+static void ubx_cfg_ack(const int32_t *field, const unsigned char *payload, unsigned int len) {
+  if (cfg_state != UBX_CFG_SET || (unsigned short)field[0] != ubx_cfg_steps[cfg_step].id)
+    return;
+  cfg_state = UBX_CFG_VERIFY;
+  ubx_cfg_poll_step();
+}
+
+static void ubx_cfg_nak(const int32_t *field, const unsigned char *payload, unsigned int len) {
+  if ((cfg_state != UBX_CFG_POLL && cfg_state != UBX_CFG_SET && cfg_state != UBX_CFG_VERIFY) || (unsigned short)field[0] != ubx_cfg_steps[cfg_step].id)
+    return;
+  cfg_last_nak = 1;
+  ubx_cfg_finish_step("NAK", 1);
+}
+
+static void ubx_cfg_reply(unsigned short id, const unsigned char *payload, unsigned int len) {
+  if (cfg_state != UBX_CFG_POLL && cfg_state != UBX_CFG_VERIFY)
+    return;
+
+  const struct ubx_cfg_step_t *step = &ubx_cfg_steps[cfg_step];
+  if (id != step->id)
+    return;
+  /* CFG-MSG replies are for whichever message we asked about */
+  if (id == 0x0601 && (len < 2 || memcmp(payload, step->poll, 2)))
+    return;
+
+  if (len >= step->reply_offset + step->verify_len &&
+      !memcmp(payload + step->reply_offset, step->set + step->set_offset, step->verify_len)) {
+    ubx_cfg_finish_step(cfg_state == UBX_CFG_POLL ? "already set" : "set", 0);
+  } else if (cfg_tries++ < UBX_CFG_RETRIES) {
+    ubx_cfg_set_step();
+  } else {
+    ubx_cfg_finish_step("mismatch", 1);
+  }
+}
+
+static void gps_ublox_poll() {
+  switch (cfg_state) {
+    case UBX_CFG_IDLE:
+      break;
+    case UBX_CFG_PORT:
+    case UBX_CFG_BRINGUP:
+      /* Let CFG-PRT get out at the old rate, and the receiver switch */
+      if (!gps_tx_done())
+        cfg_sent = millis();
+      else if (millis() - cfg_sent > 100) {
+        gps_set_serial(57600, GPS_8N1);
+        if (cfg_state == UBX_CFG_PORT) {
+          ubx_cfg_start();
+          break;
+        }
+        for (unsigned int i = 0 ; i < UBX_CFG_STEPS ; i++) {
+          if (ubx_cfg_steps[i].id == 0x0601)
+            gps_write_ublox(0x0601, ubx_cfg_steps[i].set, ubx_cfg_steps[i].set_len);
+        }
+        cfg_state = UBX_CFG_BRINGUP_MSGS;
+      }
+      break;
+    case UBX_CFG_BRINGUP_MSGS:
+      /* The probe changes the rate as soon as it has the port back */
+      if (gps_tx_done()) {
+        cfg_state = UBX_CFG_IDLE;
+        gps_probe_release();
+      }
+      break;
+    default:
+      if (millis() - cfg_sent > UBX_CFG_TIMEOUT_MS) {
+        if (cfg_tries++ < UBX_CFG_RETRIES) {
+          if (cfg_state == UBX_CFG_SET)
+            ubx_cfg_set_step();
+          else
+            ubx_cfg_poll_step();
+        } else {
+          ubx_cfg_finish_step("timeout", 1);
+        }
+      }
+      break;
+  }
 }
 
-void gps_message_nav_sat() {
+/* TIM-TP and TIM-TM2 can each be in GPS or UTC time, depending on the
+ * receiver and CFG-TP5. Records are kept in TIM-TP's, and NAV-TIMEUTC tells
+ * us the leap seconds to get between them; -1 until it has.
+ */
+static char ubx_tp_utc = 1;
+static int ubx_leap = -1;
+
+/* TIM-TP comes before the pulse it describes */
+static void gps_message_tim_tp(const int32_t *field, const unsigned char *payload, unsigned int len) {
+  uint32_t tow_msec = field[0];
+  int32_t quant = field[1];
+  unsigned short gps_week = field[2];
+  unsigned char flags = field[3];
+  monitor_send(MONITOR_SAWTOOTH, quant);
+
+  struct gps_time_t *rec = gps_time_record(tow_msec / 1000, GPS_TIME_NEXT);
+  rec->quant_ns = quant / 1000; // ps
+  rec->flags |= GPS_TIME_QUANT;
+
+  ubx_tp_utc = flags & 0x01;
+  if (ubx_tp_utc || ubx_leap >= 0) {
+    rec->week = gps_week;
+    rec->utc_offset = ubx_tp_utc ? 0 : -ubx_leap;
+    rec->flags |= GPS_TIME_DATE;
+  }
 }
 
-void gps_message_nav_status() {
+static void gps_message_nav_status(const int32_t *field, const unsigned char *payload, unsigned int len) {
   static const char *fix_type_msg[] = {
     "NONE", "DR", "2D", "3D", "GPS+DR", "TIME"
   };
@@ -221,13 +332,16 @@ void gps_message_nav_status() {
     "FIX_OK", "DGPS", "WN_OK", "TOW_OK"
   };
 
-  unsigned char fix_type = gps_payload[4];
-  unsigned char flags = gps_payload[5];
+  unsigned char fix_type = field[0];
+  unsigned char flags = field[1];
 
   debug("NAV-STATUS: ");
-  debug(fix_type_msg[fix_type]);
+  if (fix_type < sizeof(fix_type_msg) / sizeof(*fix_type_msg))
+    debug(fix_type_msg[fix_type]);
+  else
+    debug_int(fix_type);
 
-  for (int i = 0 ; i < sizeof(flag_msg) / sizeof(*flag_msg) ; i++) {
+  for (unsigned int i = 0 ; i < sizeof(flag_msg) / sizeof(*flag_msg) ; i++) {
     if (flags & 1 << i) {
       debug(" ");
       debug(flag_msg[i]);
@@ -235,7 +349,8 @@ void gps_message_nav_status() {
   }
   debug("\r\n");
 
-  if (flags & 0x0B == 0x0B) {
+  /* FIX_OK, WN_OK and TOW_OK; DGPS only means corrections are in use */
+  if ((flags & 0x0D) == 0x0D) {
     health_set_gps_status(GPS_OK);
   } else {
     health_set_gps_status(GPS_UNLOCK);
@@ -244,14 +359,20 @@ void gps_message_nav_status() {
   health_reset_gps_watchdog();
 }
 
-void gps_message_nav_timeutc() {
-  unsigned short year = *((unsigned short *)(gps_payload + 12));
-  unsigned char month = gps_payload[14];
-  unsigned char day = gps_payload[15];
-  unsigned char hour = gps_payload[16];
-  unsigned char minute = gps_payload[17];
-  unsigned char second = gps_payload[18];
-  unsigned char flags = gps_payload[19];
+static void gps_message_nav_timeutc(const int32_t *field, const unsigned char *payload, unsigned int len) {
+  unsigned short year = field[0];
+  unsigned char month = field[1];
+  unsigned char day = field[2];
+  unsigned char hour = field[3];
+  unsigned char minute = field[4];
+  unsigned char second = field[5];
+  uint32_t itow = field[6];
+  unsigned char valid = field[7];
+
+  if (valid & 0x04) { // validUTC
+    int32_t tod = (int32_t)hour * 3600 + minute * 60 + second;
+    ubx_leap = (((int32_t)((itow + 500) / 1000) - tod) % 86400 + 86400) % 86400;
+  }
 
   debug("NAV-TIMEUTC: ");
   debug_int(year); debug("-"); debug_int(month); debug("-"); debug_int(day);
@@ -260,86 +381,182 @@ void gps_message_nav_timeutc() {
   debug("\r\n");
 }
 
-void gps_message_nav_clock() {
+static void ubx_survey(uint32_t dur, const int32_t *ecef_cm, uint32_t acc_mm, bool valid, bool active) {
+  if (active) {
+    uint32_t pct = dur * 100 / GPS_SURVEY_MIN_SEC;
+    gps_survey_progress(pct > 99 ? 99 : pct, acc_mm);
+  } else if (valid) {
+    gps_survey_progress(100, acc_mm);
+    gps_survey_done(ecef_cm, acc_mm);
+  }
 }
 
-void gps_message_nav_svin() {
+/* u-blox 6T */
+static void gps_message_tim_svin(const int32_t *field, const unsigned char *payload, unsigned int len) {
+  int32_t ecef[3] = { field[1], field[2], field[3] };
+  /* Variance in mm^2 */
+  uint32_t acc_mm = sqrt((double)(uint32_t)field[4]);
+  ubx_survey(field[0], ecef, acc_mm, field[5], field[6]);
 }
 
-#if GPS_UBLOX_TIMESTAMP
-// To use this, connect the PPS output of the Due (pin 22)
-// to EXTINT0 on the uBlox.
-
-static bool have_timestamp;
-static int32_t timestamp;
+/* u-blox M8T */
+static void gps_message_nav_svin(const int32_t *field, const unsigned char *payload, unsigned int len) {
+  int32_t ecef[3] = { field[1], field[2], field[3] };
+  /* Accuracy in 0.1mm */
+  ubx_survey(field[0], ecef, (uint32_t)field[4] / 10, field[5], field[6]);
+}
 
-void gps_message_tim_tm2() {
-  unsigned char flags = gps_payload[1];
+/* u-blox M8: all GNSS */
+static void gps_message_nav_sat(const int32_t *field, const unsigned char *payload, unsigned int len) {
+  unsigned int num_svs = field[0];
 
-  if (flags & 0xe0 == 0xe0) {
-    uint32_t ms_r = *((uint32_t *)(gps_payload + 8));
-    uint32_t ns_r = *((uint32_t *)(gps_payload + 12));
-    have_timestamp = true;
-    timestamp = -((ms_r % 1000) * 1000000 + ns_r) + PPSOUT_OFFSET_NS;
+  for (unsigned int i = 0 ; i < num_svs && 8 + 12 * (i + 1) <= len ; i++) {
+    const unsigned char *sv = payload + 8 + 12 * i;
+    gps_sat_update(sv[0], sv[1], sv[2], (signed char)sv[3], (sv[8] & 0x08) != 0);
   }
 }
 
-bool gps_get_timestamp(int32_t *dest) {
-  if (have_timestamp) {
-    *dest = timestamp + pps_adjust;
-    have_timestamp = false;
-    return true;
+/* u-blox 6: GPS only */
+static void gps_message_nav_svinfo(const int32_t *field, const unsigned char *payload, unsigned int len) {
+  unsigned int num_ch = field[0];
+
+  for (unsigned int i = 0 ; i < num_ch && 8 + 12 * (i + 1) <= len ; i++) {
+    const unsigned char *ch = payload + 8 + 12 * i;
+    if (ch[1])
+      gps_sat_update(GPS_GNSS_GPS, ch[1], ch[4], (signed char)ch[5], ch[2] & 0x01);
   }
-  return false;
 }
 
-#else
-
-void gps_message_tim_tm2() {
+static void gps_message_nav_clock(const int32_t *field, const unsigned char *payload, unsigned int len) {
+  gps_clock_update(field[0], field[1]); // ns, ns/s
 }
 
-bool gps_get_timestamp(int32_t *dest) {
-  return false;
+#if GPS_UBLOX_TIMESTAMP
+// To use this, connect the PPS output of the Due (pin 22)
+// to EXTINT0 on the uBlox.
+
+/* TIM-TM2 comes after the edge it measured, at the receiver's next
+ * navigation epoch, which may be a second later still; so it goes by its
+ * TOW rather than by when it arrived.
+ */
+static void gps_message_tim_tm2(const int32_t *field, const unsigned char *payload, unsigned int len) {
+  unsigned char flags = field[0];
+
+  if ((flags & 0xc0) == 0xc0) { // New rising edge, time valid
+    uint32_t ms_r = field[1];
+    uint32_t ns_r = field[2];
+    int32_t tow = (ms_r + 500) / 1000;
+    char utc = (flags >> 3 & 0x03) == 2;
+
+    if (utc != ubx_tp_utc) {
+      if (ubx_leap < 0)
+        return;
+      tow += utc ? ubx_leap : -ubx_leap;
+    }
+    tow = (tow + 604800L) % 604800L;
+
+    struct gps_time_t *rec = gps_time_record(tow, GPS_TIME_ANY);
+    rec->tm2_ns = -((ms_r % 1000) * 1000000 + ns_r) + PPSOUT_OFFSET_NS;
+    rec->flags |= GPS_TIME_TM2;
+  }
 }
 
+#else
+
+#define gps_message_tim_tm2 0
+
 #endif
 
+static const struct gps_message_t ubx_messages[] = {
+  { 0x0d01, 16, gps_message_tim_tp, { {0, GPS_U4}, {8, GPS_I4}, {12, GPS_U2}, {14, GPS_U1} } },
+  { 0x0103, 16, gps_message_nav_status, { {4, GPS_U1}, {5, GPS_U1} } },
+  { 0x0121, 20, gps_message_nav_timeutc, {
+    {12, GPS_U2}, {14, GPS_U1}, {15, GPS_U1}, {16, GPS_U1}, {17, GPS_U1}, {18, GPS_U1},
+    {0, GPS_U4}, {19, GPS_U1}
+  } },
+  { 0x0d03, 28, gps_message_tim_tm2, { {1, GPS_U1}, {8, GPS_U4}, {12, GPS_U4} } },
+  { 0x0d04, 28, gps_message_tim_svin, {
+    {0, GPS_U4}, {4, GPS_I4}, {8, GPS_I4}, {12, GPS_I4}, {16, GPS_U4}, {24, GPS_U1}, {25, GPS_U1}
+  } },
+  { 0x013b, 40, gps_message_nav_svin, {
+    {8, GPS_U4}, {12, GPS_I4}, {16, GPS_I4}, {20, GPS_I4}, {28, GPS_U4}, {36, GPS_U1}, {37, GPS_U1}
+  } },
+  { 0x0501, 2, ubx_cfg_ack, { {0, GPS_U2 | GPS_BE} } }, // ACK-ACK
+  { 0x0500, 2, ubx_cfg_nak, { {0, GPS_U2 | GPS_BE} } }, // ACK-NAK
+  { 0x0135, 8, gps_message_nav_sat, { {5, GPS_U1} } },
+  { 0x0130, 8, gps_message_nav_svinfo, { {4, GPS_U1} } },
+  { 0x0122, 20, gps_message_nav_clock, { {4, GPS_I4}, {8, GPS_I4} } },
+};
 
-void gps_handle_message() {
-  switch (gps_packetid) {
-    case 0x0d01:
-      gps_message_tim_tp();
-      break;
-    case 0x0135:
-      gps_message_nav_sat();
-      break;
-    case 0x0103:
-      gps_message_nav_status();
-      break;
-    case 0x0121:
-      gps_message_nav_timeutc();
-      break;
-    case 0x0122:
-      gps_message_nav_clock();
-      break;
-    case 0x0d03:
-      gps_message_tim_tm2();
-    case 0x0d04:
-      gps_message_nav_svin();
-      break;
-    default:
-      debug("Got "); debug_int(gps_payload_len);
-      debug(" byte message, type "); debug_hex(gps_packetid);
-      debug("\r\n");
-      break;
+static void gps_handle_message(unsigned short id, const unsigned char *payload, unsigned int len) {
+  if ((id >> 8) == 0x06) { // CFG-*, replies to our polls
+    ubx_cfg_reply(id, payload, len);
+    return;
+  }
+  if (!gps_dispatch(ubx_messages, sizeof(ubx_messages) / sizeof(*ubx_messages), id, payload, len)) {
+    debug("Got "); debug_int(len);
+    debug(" byte message, type "); debug_hex(id);
+    debug("\r\n");
   }
 }
 
-void gps_init() {
-  // We don't send any configuration to the unit. It should be configured
-  // for fixed position, timing mode (if applicable), 1Hz positive timepulse,
-  // and UBX-TIM-TP, UBX-NAV-TIMEUTC, and UBX-NAV-STATUS messages at a minimum.
-  GPS.begin(57600, SERIAL_8N1);
+struct ubx_framing {
+  static const char *name() { return "UBX"; }
+  static const unsigned char SYNC1 = 0xb5, SYNC2 = 0x62;
+  static const unsigned int HEADER_LEN = 4; // class, id, length
+  static const bool CHECKSUM_HEADER = true;
+  static const bool HAS_TRAILER = false;
+  static const unsigned char TRAILER1 = 0, TRAILER2 = 0;
+  static const unsigned int BUFFER_SIZE = 8 + 12 * GPS_MAX_SATS; // NAV-SAT
+  typedef gps_fletcher8 checksum;
+
+  static unsigned int payload_len(const unsigned char *header) {
+    return header[2] | header[3] << 8;
+  }
+  static unsigned short message_id(const unsigned char *header, const unsigned char *payload) {
+    return header[0] << 8 | header[1];
+  }
+  static void handle(unsigned short id, const unsigned char *payload, unsigned int len) {
+    gps_handle_message(id, payload, len);
+  }
+};
+
+typedef gps_length_framer<ubx_framing> ubx_framer;
+
+static void gps_ublox_init(const struct gps_serial_t *serial) {
+  ubx_framer::reset();
+
+  if (!serial) {
+    /* Factory bring-up: the receiver is at 9600 putting out NMEA only, so
+     * there's nothing for the probe to find. Move it over and turn on the
+     * messages blind; the probe picks it up from there and the full
+     * configuration runs once it locks. It takes a few loop passes
+     * (UBX_CFG_BRINGUP), with the probe held off meanwhile.
+     */
+    gps_set_serial(9600, GPS_8N1);
+    gps_set_serial_options();
+    cfg_sent = millis();
+    cfg_state = UBX_CFG_BRINGUP;
+    gps_probe_hold();
+    return;
+  }
+
+  if (serial->baud != 57600 || serial->format != GPS_8N1) {
+    gps_set_serial_options();
+    cfg_sent = millis();
+    cfg_state = UBX_CFG_PORT;
+  } else {
+    ubx_cfg_start();
+  }
 }
 
-#endif
+const struct gps_protocol_t gps_protocol_ublox = {
+  "ublox",
+  gps_ublox_init,
+  ubx_framer::decode,
+  ubx_framer::probe,
+  &ubx_framer::frames,
+  &ubx_framer::errors,
+  gps_ublox_poll,
+  GPS_TIME_DATE | GPS_TIME_QUANT | (GPS_UBLOX_TIMESTAMP ? GPS_TIME_TM2 : 0),
+};
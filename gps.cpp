@@ -0,0 +1,321 @@
+#define LOG_SUBSYSTEM LOG_GPS /* For debug.h */
+#include "config.h"
+#include <Arduino.h>
+#include "gps.h"
+#include "debug.h"
+#include "storage.h"
+#include "monitor.h"
+
+/* All of the receiver drivers are built in; which one is talking to the
+ * GPS port is picked at runtime and kept in flash, so a spare receiver of
+ * another make can be swapped in without reflashing.
+ *
+ * gps_init() doesn't assume a port setting. It cycles through the likely
+ * baud rates and parities, running every driver's framer over what comes
+ * in (counting only, no handlers), and locks onto the first protocol to
+ * show GPS_PROBE_MIN_FRAMES good frames, and more good frames than framing
+ * errors, within GPS_PROBE_WINDOW_MS. "gps protocol <name>" restricts the
+ * search to one driver; "gps protocol auto" opens it back up.
+ *
+ * Most receivers talk NMEA out of the box, binary ones included, so NMEA
+ * is only settled for if it's what we had last time, or once the default
+ * driver has had its go at switching the receiver to something better.
+ */
+
+static const struct gps_protocol_t *gps_protocols[GPS_PROTOCOLS] = {
+  &gps_protocol_ublox,
+  &gps_protocol_tsip,
+  &gps_protocol_sirf,
+  &gps_protocol_nmea,
+};
+
+static const struct gps_serial_t gps_probe_serial[] = {
+  { 57600, GPS_8N1 },
+  { 9600, GPS_8O1 },
+  { 9600, GPS_8N1 },
+  { 38400, GPS_8N1 },
+  { 115200, GPS_8N1 },
+  { 4800, GPS_8N1 },
+  { 19200, GPS_8N1 },
+  { 57600, GPS_8O1 },
+};
+
+#define GPS_PROBE_SETTINGS (sizeof(gps_probe_serial) / sizeof(*gps_probe_serial))
+
+struct gps_saved_t {
+  uint32_t protocol;
+  uint32_t fixed;
+  struct gps_serial_t serial;
+};
+
+static const struct gps_protocol_t *gps_protocol = gps_protocols[GPS_DEFAULT_PROTOCOL];
+static char gps_protocol_fixed = 0;
+static struct gps_serial_t gps_serial;
+static char gps_loaded = 0;
+static struct gps_saved_t gps_saved;
+
+static char gps_probing = 0;
+static char gps_brought_up;
+static char probe_held; /* By the driver bringing a receiver up */
+static unsigned int probe_index, probe_tried;
+static uint32_t probe_start;
+static uint32_t probe_frames[GPS_PROTOCOLS], probe_errors[GPS_PROTOCOLS];
+
+static const char *gps_format_name(enum gps_format_t format) {
+  return format == GPS_8O1 ? "8O1" : "8N1";
+}
+
+void gps_set_serial(uint32_t baud, enum gps_format_t format) {
+  gps_serial.baud = baud;
+  gps_serial.format = format;
+  if (format == GPS_8O1)
+    GPS.begin(baud, SERIAL_8O1);
+  else
+    GPS.begin(baud, SERIAL_8N1);
+  gps_rx_init();
+  gps_rx_set_rate(baud, format == GPS_8O1 ? 11 : 10);
+}
+
+static void gps_save() {
+  struct gps_saved_t saved;
+
+  memset(&saved, 0, sizeof(saved));
+  for (uint32_t i = 0 ; i < GPS_PROTOCOLS ; i++) {
+    if (gps_protocols[i] == gps_protocol)
+      saved.protocol = i;
+  }
+  saved.fixed = gps_protocol_fixed;
+  saved.serial = gps_serial;
+  if (memcmp(&saved, &gps_saved, sizeof(saved)) && storage_write(STORAGE_GPS_PROTOCOL, &saved, sizeof(saved)))
+    gps_saved = saved;
+}
+
+static void gps_load() {
+  struct gps_saved_t saved;
+
+  gps_loaded = 1;
+  if (!storage_read(STORAGE_GPS_PROTOCOL, &saved, sizeof(saved)) || saved.protocol >= GPS_PROTOCOLS)
+    return;
+
+  gps_saved = saved;
+  gps_protocol = gps_protocols[saved.protocol];
+  gps_protocol_fixed = saved.fixed;
+  /* Start the search where we last found it */
+  for (unsigned int i = 0 ; i < GPS_PROBE_SETTINGS ; i++) {
+    if (gps_probe_serial[i].baud == saved.serial.baud && gps_probe_serial[i].format == saved.serial.format)
+      probe_index = i;
+  }
+}
+
+static void gps_probe_setting() {
+  const struct gps_serial_t *serial = &gps_probe_serial[probe_index];
+
+  gps_set_serial(serial->baud, serial->format);
+  for (unsigned int i = 0 ; i < GPS_PROTOCOLS ; i++) {
+    probe_frames[i] = *gps_protocols[i]->frames;
+    probe_errors[i] = *gps_protocols[i]->errors;
+  }
+  probe_start = millis();
+}
+
+static void gps_probe_decode(const unsigned char *buf, unsigned int len) {
+  for (unsigned int i = 0 ; i < GPS_PROTOCOLS ; i++) {
+    if (!gps_protocol_fixed || gps_protocols[i] == gps_protocol)
+      gps_protocols[i]->probe(buf, len);
+  }
+}
+
+static void gps_probe_lock(unsigned int i) {
+  gps_probing = 0;
+  gps_protocol = gps_protocols[i];
+  debug("GPS: found "); debug(gps_protocol->name);
+  debug(" at "); debug_long(gps_serial.baud); debug(" ");
+  debug(gps_format_name(gps_serial.format)); debug("\r\n");
+
+  struct gps_serial_t found = gps_serial;
+  gps_protocol->init(&found);
+  gps_time_reset(gps_protocol->time_flags);
+  gps_save();
+}
+
+/* For a driver's init(NULL) that needs loop passes to finish, as for
+ * bytes to get out before a rate change: the probe leaves the port alone,
+ * and calls the driver's poll(), till it's released.
+ */
+void gps_probe_hold() {
+  probe_held = 1;
+}
+
+void gps_probe_release() {
+  probe_held = 0;
+}
+
+static void gps_probe_next() {
+  probe_index = (probe_index + 1) % GPS_PROBE_SETTINGS;
+  gps_probe_setting();
+}
+
+static void gps_probe_poll() {
+  gps_rx_poll(gps_probe_decode);
+  if (probe_held) {
+    gps_protocol->poll();
+    if (!probe_held)
+      gps_probe_next();
+    return;
+  }
+
+  for (unsigned int i = 0 ; i < GPS_PROTOCOLS ; i++) {
+    uint32_t frames = *gps_protocols[i]->frames - probe_frames[i];
+    uint32_t errors = *gps_protocols[i]->errors - probe_errors[i];
+    if (gps_protocols[i] == &gps_protocol_nmea && gps_protocol != &gps_protocol_nmea && !gps_brought_up)
+      continue;
+    if (frames >= GPS_PROBE_MIN_FRAMES && frames > errors) {
+      gps_probe_lock(i);
+      return;
+    }
+  }
+
+  if (millis() - probe_start < GPS_PROBE_WINDOW_MS)
+    return;
+
+  if (++probe_tried == GPS_PROBE_SETTINGS) {
+    /* Nothing anywhere. Maybe it's fresh from the factory and talking
+     * NMEA; give the driver one go at setting it up, then keep looking,
+     * NMEA included.
+     */
+    probe_tried = 0;
+    if (!gps_brought_up) {
+      debug("GPS: nothing found, trying "); debug(gps_protocol->name); debug(" defaults\r\n");
+      gps_brought_up = 1;
+      gps_protocol->init(NULL);
+      if (probe_held)
+        return;
+    }
+  }
+  gps_probe_next();
+}
+
+void gps_init() {
+  if (!gps_loaded)
+    gps_load();
+  gps_probing = 1;
+  gps_time_reset(0);
+  gps_brought_up = 0;
+  probe_held = 0;
+  probe_tried = 0;
+  gps_probe_setting();
+}
+
+void gps_poll() {
+  if (gps_probing)
+    gps_probe_poll();
+  else {
+    gps_rx_poll(gps_protocol->decode);
+    if (gps_protocol->poll)
+      gps_protocol->poll();
+    gps_sat_report();
+  }
+}
+
+void gps_decode(const unsigned char *buf, unsigned int len) {
+  gps_protocol->decode(buf, len);
+}
+
+const char *gps_get_protocol() {
+  return gps_protocol_fixed ? gps_protocol->name : "auto";
+}
+
+bool gps_set_protocol(const char *name) {
+  if (!strcmp(name, "auto")) {
+    gps_protocol_fixed = 0;
+  } else {
+    unsigned int i;
+    for (i = 0 ; i < GPS_PROTOCOLS ; i++) {
+      if (!strcmp(name, gps_protocols[i]->name))
+        break;
+    }
+    if (i == GPS_PROTOCOLS)
+      return false;
+    gps_protocol = gps_protocols[i];
+    gps_protocol_fixed = 1;
+  }
+  gps_loaded = 1;
+  gps_save();
+  gps_init();
+  return true;
+}
+
+const char *gps_get_status() {
+  static char status[40];
+
+  snprintf(status, sizeof(status), "%s %lu %s",
+      gps_probing ? "probing" : gps_protocol->name,
+      (unsigned long)gps_serial.baud,
+      gps_format_name(gps_serial.format));
+  return status;
+}
+
+/* Survey-in. The drivers report progress while the receiver surveys, and
+ * the result when it's done; the result goes to flash, and on later boots
+ * the drivers push it to the receiver as a fixed position instead of
+ * surveying again.
+ */
+
+static struct gps_position_t gps_position;
+static char gps_position_loaded = 0;
+
+bool gps_get_position(struct gps_position_t *pos) {
+  if (!gps_position_loaded) {
+    gps_position_loaded = 1;
+    if (!storage_read(STORAGE_GPS_POSITION, &gps_position, sizeof(gps_position)))
+      gps_position.valid = 0;
+  }
+  *pos = gps_position;
+  return gps_position.valid;
+}
+
+void gps_survey_progress(uint32_t progress, uint32_t acc_mm) {
+  monitor_send(MONITOR_GPS_SURVEY, progress);
+  if (acc_mm)
+    monitor_send(MONITOR_GPS_SURVEY_ACC, acc_mm);
+}
+
+void gps_survey_done(const int32_t *ecef_cm, uint32_t acc_mm) {
+  struct gps_position_t pos;
+
+  gps_get_position(&pos);
+  /* Receivers keep reporting the finished survey; only write it once */
+  if (pos.valid && !memcmp(pos.ecef, ecef_cm, sizeof(pos.ecef)))
+    return;
+
+  memcpy(pos.ecef, ecef_cm, sizeof(pos.ecef));
+  pos.acc_mm = acc_mm;
+  pos.valid = 1;
+  if (storage_write(STORAGE_GPS_POSITION, &pos, sizeof(pos))) {
+    gps_position = pos;
+    debug("GPS: survey done, position saved: ");
+    debug_long(pos.ecef[0]); debug(" "); debug_long(pos.ecef[1]); debug(" "); debug_long(pos.ecef[2]);
+    debug(" cm, +/- "); debug_long(pos.acc_mm); debug(" mm\r\n");
+  }
+}
+
+/* Forget the saved position (the antenna moved) and survey again */
+void gps_survey_restart() {
+  memset(&gps_position, 0, sizeof(gps_position));
+  gps_position_loaded = 1;
+  storage_write(STORAGE_GPS_POSITION, &gps_position, sizeof(gps_position));
+  gps_init();
+}
+
+/* WGS84 */
+#define WGS84_A 6378137.0
+#define WGS84_E2 6.69437999014e-3
+
+void gps_lla_to_ecef(double lat, double lon, double alt, int32_t *ecef_cm) {
+  double sin_lat = sin(lat);
+  double n = WGS84_A / sqrt(1 - WGS84_E2 * sin_lat * sin_lat);
+
+  ecef_cm[0] = lround((n + alt) * cos(lat) * cos(lon) * 100);
+  ecef_cm[1] = lround((n + alt) * cos(lat) * sin(lon) * 100);
+  ecef_cm[2] = lround((n * (1 - WGS84_E2) + alt) * sin_lat * 100);
+}
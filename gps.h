@@ -1,9 +1,131 @@
 #ifndef __GPS_H
 #define __GPS_H
 
+enum gps_protocol_id_t {
+  GPS_PROTOCOL_UBLOX,
+  GPS_PROTOCOL_TSIP,
+  GPS_PROTOCOL_SIRF,
+  GPS_PROTOCOL_NMEA,
+  GPS_PROTOCOLS
+};
+
+enum gps_format_t {
+  GPS_8N1,
+  GPS_8O1,
+};
+
+struct gps_serial_t {
+  uint32_t baud;
+  enum gps_format_t format;
+};
+
+/* One per receiver driver; gps.cpp forwards to the selected one.
+ * init() gets the port settings the receiver was found at, or NULL to
+ * bring it up from factory defaults. A bring-up that takes more than one
+ * call calls gps_probe_hold() and finishes from poll().
+ */
+struct gps_protocol_t {
+  const char *name;
+  void (*init)(const struct gps_serial_t *serial);
+  void (*decode)(const unsigned char *buf, unsigned int len);
+  void (*probe)(const unsigned char *buf, unsigned int len);
+  const uint32_t *frames, *errors;
+  void (*poll)(); /* Called from gps_poll() once locked or held, if set */
+  unsigned char time_flags; /* GPS_TIME_* it fills in for every second */
+};
+
+extern const struct gps_protocol_t gps_protocol_ublox;
+extern const struct gps_protocol_t gps_protocol_tsip;
+extern const struct gps_protocol_t gps_protocol_sirf;
+extern const struct gps_protocol_t gps_protocol_nmea;
+
 extern void gps_init();
 extern void gps_poll();
+extern void gps_decode(const unsigned char *buf, unsigned int len);
+
+extern const char *gps_get_protocol();
+extern bool gps_set_protocol(const char *name);
+extern const char *gps_get_status();
+extern void gps_set_serial(uint32_t baud, enum gps_format_t format);
+extern void gps_probe_hold();
+extern void gps_probe_release();
+
+/* Surveyed antenna position, ECEF in cm. It belongs to the antenna, not the
+ * receiver, so it's kept here rather than in a driver.
+ */
+struct gps_position_t {
+  int32_t ecef[3];
+  uint32_t acc_mm; /* 0 if the receiver doesn't say */
+  uint32_t valid;
+};
+
+extern bool gps_get_position(struct gps_position_t *pos);
+extern void gps_survey_progress(uint32_t progress, uint32_t acc_mm);
+extern void gps_survey_done(const int32_t *ecef_cm, uint32_t acc_mm);
+extern void gps_survey_restart();
+extern void gps_lla_to_ecef(double lat, double lon, double alt, int32_t *ecef_cm);
+
+/* Satellite table and receiver clock, for telemetry */
+#define GPS_SAT_UNKNOWN -128
+#define GPS_GNSS_GPS 0 /* u-blox gnssId numbering */
+#define GPS_GNSS_SBAS 1
+#define GPS_GNSS_GLONASS 6
+
+extern void gps_sat_update(unsigned char gnss, unsigned char svid, int cno, int elev, int used);
+extern void gps_sat_clear_used();
+extern void gps_clock_update(int32_t bias_ns, int32_t drift_ppb);
+extern void gps_sat_report();
+extern void gps_sat_print();
+
+extern void gps_rx_init();
+extern void gps_rx_poll(void (*decode)(const unsigned char *, unsigned int));
+extern void gps_rx_set_rate(uint32_t baud, unsigned int bits);
+extern uint64_t gps_rx_tick(const unsigned char *p);
+extern void gps_tx_write(const void *buf, unsigned int len);
+extern void gps_tx_flush();
+extern bool gps_tx_done();
+
+/* Per-second time records, see gps-time.cpp. The drivers fill them in from
+ * whichever messages carry each part; the loop reads back the one for the
+ * PPS edge it captured.
+ */
+#define GPS_TIME_DATE 0x01  /* week, tow, utc_offset */
+#define GPS_TIME_QUANT 0x02 /* quant_ns */
+#define GPS_TIME_TM2 0x04   /* tm2_ns */
+#define GPS_TIME_EDGE 0x80  /* edge */
+
+enum gps_time_when_t {
+  GPS_TIME_ANY,  /* Message says which second it's about, but not which edge */
+  GPS_TIME_NEXT, /* Message is about the next pulse */
+  GPS_TIME_LAST, /* Message is about the pulse just gone */
+};
+
+struct gps_time_t {
+  uint32_t tow;          /* Receiver's time of week of the pulse, seconds */
+  uint32_t edge;         /* pps_count of our capture of it */
+  uint64_t rx_tick;      /* Timer time the first byte about it arrived */
+  unsigned short week;
+  short utc_offset;      /* Add to tow for UTC */
+  int32_t quant_ns;      /* Receiver's quantization error for the pulse */
+  int32_t tm2_ns;        /* Our PPS output against the receiver, u-blox TIM-TM2 */
+  unsigned char flags;
+};
+
+/* Timer time the first byte of the frame being handled arrived */
+extern uint64_t gps_frame_tick;
+
+extern struct gps_time_t *gps_time_record(uint32_t tow, enum gps_time_when_t when);
+extern uint32_t gps_time_last_edge(uint64_t tick, uint64_t *edge_tick);
+extern void gps_time_reset(unsigned char expect);
+extern bool gps_time_ready();
+extern void gps_time_edge();
+
+enum gps_phase_t {
+  GPS_PHASE_NONE,    /* Nothing to go on for this edge */
+  GPS_PHASE_CAPTURE, /* Our capture of the receiver's PPS */
+  GPS_PHASE_TM2,     /* The receiver's timestamp of our PPS */
+};
 
-extern bool gps_get_timestamp(int32_t *dest);
+extern enum gps_phase_t gps_get_phase(int32_t *dest);
 
 #endif
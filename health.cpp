@@ -1,3 +1,4 @@
+#define LOG_SUBSYSTEM LOG_HEALTH /* For debug.h */
 #include "config.h"
 #include "debug.h"
 #define HEALTH_H_DEFINE_CONSTANTS
@@ -11,10 +12,10 @@ static enum gps_status_t gps_status = GPS_UNLOCK;
 static enum rb_status_t rb_status = RB_UNLOCK;
 static enum health_status_t health_status = HEALTH_UNLOCK;
 static uint32_t reftime_upper, reftime_lower;
-static uint32_t entered_holdover_upper = ~0UL, entered_holdover_lower = ~0UL;
+static uint32_t entered_holdover_upper = ~0U, entered_holdover_lower = ~0U;
 
 static unsigned char gps_watchdog = 0;
-static uint32_t fll_watchdog = ~0UL;
+static uint32_t fll_watchdog = ~0U;
 
 void health_update();
 
@@ -87,6 +88,11 @@ enum health_status_t health_get_status() {
   return health_status;
 }
 
+/* All the statuses, packed: overall in bits 0-1, PLL 2, FLL 3, GPS 4-5, Rb 6-7 */
+uint32_t health_get_flags() {
+  return health_status | pll_status << 2 | fll_status << 3 | gps_status << 4 | rb_status << 6;
+}
+
 void health_set_reftime(uint32_t upper, uint32_t lower) {
   reftime_upper = upper;
   reftime_lower = lower;
@@ -116,7 +122,7 @@ uint32_t health_get_ref_age() {
  * If Rb and PLL are OK, but GPS is UNLOCK, enter HOLDOVER.
  * If in HOLDOVER and FLL solution becomes too old, enter UNLOCK.
  * If Rb or PLL are UNLOCK, state is UNLOCK.
- * Can't go from UNLOCK or HOLDOVER to OK if GPS has MINOR_ALARM,
+ * Can't go from UNLOCK or HOLDOVER to OK if GPS or Rb has MINOR_ALARM,
  * but if we're currently OK then a MINOR_ALARM won't make us leave.
  */
 void health_update() {
@@ -154,7 +160,7 @@ void health_update() {
   if (new_status != health_status) {
     health_notify_change("Health", health_status_description, health_status, new_status);
     if (new_status == HEALTH_OK) {
-      if (entered_holdover_lower != ~0UL || entered_holdover_upper != ~0UL)
+      if (entered_holdover_lower != ~0U || entered_holdover_upper != ~0U)
         pll_leave_holdover(time_since(entered_holdover_upper, entered_holdover_lower));
       pps_output_enable();
     } else if (new_status == HEALTH_HOLDOVER) {
@@ -41,13 +41,15 @@ const char *gps_status_description[] = {
 
 enum rb_status_t {
   RB_UNLOCK,
+  RB_MINOR_ALARM,
   RB_OK
 };
 
 #ifdef HEALTH_H_DEFINE_CONSTANTS
 const char *rb_status_description[] = {
-  [RB_UNLOCK] = "UNLOCK",
-  [RB_OK]     = "OK"
+  [RB_UNLOCK]      = "UNLOCK",
+  [RB_MINOR_ALARM] = "MINOR ALARM",
+  [RB_OK]          = "OK"
 };
 #endif
 
@@ -76,6 +78,7 @@ void health_reset_fll_watchdog();
 void health_print_status();
 
 enum health_status_t health_get_status();
+uint32_t health_get_flags();
 char health_should_run_pll();
 
 void health_set_reftime(uint32_t upper, uint32_t lower);
@@ -0,0 +1,244 @@
+#include "config.h"
+#include "console.h"
+#include "hist.h"
+
+#if HIST_ENABLED
+
+#include "timing.h"
+#include "monitor.h"
+
+/* Log-linear histograms, in the manner of HdrHistogram: values below
+ * 2 << HIST_SUB_BITS get a bucket each, and every power of 2 above that is
+ * cut into 1 << HIST_SUB_BITS equal buckets, so a bucket is never wider
+ * than 1 / (1 << HIST_SUB_BITS) of the values in it. Anything from
+ * 1 << HIST_MAX_BITS up goes in the top bucket; the exact max is kept too.
+ *
+ * hist_record() is a count of leading zeros, a shift and an increment, so
+ * it can go in an interrupt handler. Each histogram has one writer, either
+ * an interrupt or the loop; the loop takes the counts with an atomic
+ * exchange (LDREX/STREX, which an interrupt in between makes retry), so
+ * nothing is lost and interrupts are never masked.
+ *
+ * Counts build up for HIST_REPORT_SEC, aligned to unix time like the
+ * monitor windows. Then they're added to the totals, and the interval's
+ * p50, p99, p99.9 and max go to the monitor as hist.<name>.*. The totals
+ * run until "hist reset", for "hist" and the bucket dumps on the console.
+ */
+
+#define HIST_SUB (1UL << HIST_SUB_BITS)
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct hist_t {
+  const char *name;
+  char ticks;                    /* Values are timer ticks, shown in ns */
+  enum monitor_metric_t metric;  /* .p50, then .p99, .p999 and .max */
+  uint32_t counts[HIST_BUCKETS]; /* This interval, from the writer */
+  uint32_t max;
+  uint32_t totals[HIST_BUCKETS]; /* Since reset, loop only */
+  uint32_t total_max;
+};
+
+static struct hist_t hists[HIST_COUNT] = {
+  [HIST_PHASE] = { "phase", 0, MONITOR_HIST_PHASE_P50 },
+  [HIST_PHASE_FILTERED] = { "phase_filtered", 0, MONITOR_HIST_PHASE_FILTERED_P50 },
+  [HIST_NTP] = { "ntp", 1, MONITOR_HIST_NTP_P50 },
+  [HIST_PPS_IRQ] = { "pps_irq", 1, MONITOR_HIST_PPS_IRQ_P50 },
+};
+
+/* Per mille, in the order of the monitor metrics */
+static const unsigned short hist_quantiles[] = { 500, 990, 999 };
+#define HIST_QUANTILES (sizeof(hist_quantiles) / sizeof(*hist_quantiles))
+
+static int32_t hist_start;
+static uint32_t hist_scratch[HIST_BUCKETS];
+
+static unsigned int hist_bucket(uint32_t value) {
+  if (value < 2 * HIST_SUB)
+    return value;
+  if (value >> HIST_MAX_BITS)
+    value = (1UL << HIST_MAX_BITS) - 1;
+  unsigned int shift = 31 - __builtin_clz(value) - HIST_SUB_BITS;
+  return shift * HIST_SUB + (value >> shift);
+}
+
+static uint32_t hist_bucket_low(unsigned int bucket) {
+  if (bucket < 2 * HIST_SUB)
+    return bucket;
+  unsigned int shift = bucket / HIST_SUB - 1;
+  return (bucket - shift * HIST_SUB) << shift;
+}
+
+static uint32_t hist_bucket_high(unsigned int bucket) {
+  if (bucket == HIST_BUCKETS - 1)
+    return 0xffffffffUL;
+  return hist_bucket_low(bucket + 1) - 1;
+}
+
+static uint32_t hist_ns(const struct hist_t *h, uint32_t value) {
+  if (!h->ticks)
+    return value;
+  return (uint64_t)value * 1000000000LL / HZ;
+}
+
+void hist_record(enum hist_id_t hist, uint32_t value) {
+  struct hist_t *h = &hists[hist];
+
+  h->counts[hist_bucket(value)]++;
+  if (value > h->max)
+    h->max = value;
+}
+
+/* The highest value each quantile's bucket could hold, never past max */
+static uint32_t hist_percentiles(const uint32_t *counts, uint32_t max, uint32_t out[HIST_QUANTILES]) {
+  uint32_t count = 0;
+
+  for (unsigned int i = 0 ; i < HIST_BUCKETS ; i++)
+    count += counts[i];
+
+  unsigned int q = 0;
+  uint32_t seen = 0;
+  for (unsigned int i = 0 ; i < HIST_BUCKETS && q < HIST_QUANTILES ; i++) {
+    seen += counts[i];
+    while (q < HIST_QUANTILES && seen && (uint64_t)seen * 1000 >= (uint64_t)count * hist_quantiles[q]) {
+      uint32_t high = hist_bucket_high(i);
+      out[q++] = high < max ? high : max;
+    }
+  }
+  return count;
+}
+
+static struct hist_t *hist_find(const char *name) {
+  for (unsigned int i = 0 ; i < HIST_COUNT ; i++)
+    if (!strcmp(name, hists[i].name))
+      return &hists[i];
+  return NULL;
+}
+
+/* Once a second, from loop() */
+void hist_report() {
+  int32_t now = time_get_unix();
+  int32_t start = now - now % HIST_REPORT_SEC;
+
+  if (start == hist_start)
+    return;
+  hist_start = start;
+
+  for (unsigned int i = 0 ; i < HIST_COUNT ; i++) {
+    struct hist_t *h = &hists[i];
+    for (unsigned int b = 0 ; b < HIST_BUCKETS ; b++) {
+      hist_scratch[b] = __atomic_exchange_n(&h->counts[b], 0, __ATOMIC_RELAXED);
+      h->totals[b] += hist_scratch[b];
+    }
+    uint32_t max = __atomic_exchange_n(&h->max, 0, __ATOMIC_RELAXED);
+    if (max > h->total_max)
+      h->total_max = max;
+
+    uint32_t pct[HIST_QUANTILES];
+    if (!hist_percentiles(hist_scratch, max, pct))
+      continue;
+    for (unsigned int q = 0 ; q < HIST_QUANTILES ; q++)
+      monitor_send((enum monitor_metric_t)(h->metric + q), hist_ns(h, pct[q]));
+    monitor_send((enum monitor_metric_t)(h->metric + HIST_QUANTILES), hist_ns(h, max));
+  }
+}
+
+static struct hist_t *hist_printing;
+
+/* Totals since reset, one line a histogram */
+static bool hist_summary_line(unsigned int *pos) {
+  if (*pos >= HIST_COUNT)
+    return false;
+
+  struct hist_t *h = &hists[(*pos)++];
+  uint32_t pct[HIST_QUANTILES];
+  uint32_t count = hist_percentiles(h->totals, h->total_max, pct);
+
+  Console.print(h->name);
+  Console.print(": ");
+  Console.print(count);
+  if (count) {
+    Console.print(" p50 ");
+    Console.print(hist_ns(h, pct[0]));
+    Console.print(" p99 ");
+    Console.print(hist_ns(h, pct[1]));
+    Console.print(" p99.9 ");
+    Console.print(hist_ns(h, pct[2]));
+    Console.print(" max ");
+    Console.print(hist_ns(h, h->total_max));
+    Console.print(" ns");
+  }
+  Console.print("\r\n");
+  return true;
+}
+
+void hist_print_summary() {
+  console_print_lines(hist_summary_line);
+}
+
+/* The totals' non-empty buckets, as "low high count" in ns */
+static bool hist_bucket_line(unsigned int *pos) {
+  struct hist_t *h = hist_printing;
+  unsigned int b = *pos;
+
+  while (b < HIST_BUCKETS && !h->totals[b])
+    b++;
+  if (b >= HIST_BUCKETS)
+    return false;
+  *pos = b + 1;
+  Console.print(hist_ns(h, hist_bucket_low(b)));
+  Console.print(" ");
+  Console.print(hist_ns(h, b == HIST_BUCKETS - 1 ? h->total_max : hist_bucket_high(b)));
+  Console.print(" ");
+  Console.print(h->totals[b]);
+  Console.print("\r\n");
+  return true;
+}
+
+bool hist_print_buckets(const char *name) {
+  struct hist_t *h = hist_find(name);
+
+  if (!h)
+    return false;
+  hist_printing = h;
+  console_print_lines(hist_bucket_line);
+  return true;
+}
+
+/* name NULL for all of them */
+bool hist_reset(const char *name) {
+  struct hist_t *h = name ? hist_find(name) : NULL;
+
+  if (name && !h)
+    return false;
+  for (unsigned int i = 0 ; i < HIST_COUNT ; i++) {
+    if (h && h != &hists[i])
+      continue;
+    memset(hists[i].totals, 0, sizeof(hists[i].totals));
+    hists[i].total_max = 0;
+  }
+  return true;
+}
+
+#else
+
+void hist_record(enum hist_id_t hist, uint32_t value) {
+  /* empty */
+}
+
+void hist_report() {
+  /* empty */
+}
+
+void hist_print_summary() {
+  Console.println("disabled");
+}
+
+bool hist_print_buckets(const char *name) {
+  return false;
+}
+
+bool hist_reset(const char *name) {
+  return false;
+}
+
+#endif
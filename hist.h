@@ -0,0 +1,21 @@
+#ifndef __HIST_H
+#define __HIST_H
+
+/* Distributions we keep (see hist.cpp). Phases are recorded as magnitudes,
+ * in ns; latencies in timer ticks, and shown in ns.
+ */
+enum hist_id_t {
+  HIST_PHASE,          /* |phase| the loop ran on */
+  HIST_PHASE_FILTERED, /* |filtered phase| */
+  HIST_NTP,            /* NTP request's receive interrupt to its reply queued */
+  HIST_PPS_IRQ,        /* PPS edge to TC1_Handler reading the capture */
+  HIST_COUNT
+};
+
+extern void hist_record(enum hist_id_t hist, uint32_t value);
+extern void hist_report();
+extern void hist_print_summary();
+extern bool hist_print_buckets(const char *name);
+extern bool hist_reset(const char *name);
+
+#endif
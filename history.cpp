@@ -0,0 +1,366 @@
+#include "config.h"
+#include "console.h"
+#include "history.h"
+
+#if HISTORY_ENABLED
+
+#include "timing.h"
+#include "timer.h"
+#include "health.h"
+#include "rb.h"
+
+/* What the loop did over the last day or so, kept in RAM so it can be had
+ * after an outage the monitor missed: "history" on the console, or over
+ * UDP with host/history_pull, which asks just as capture_pull does.
+ *
+ * A day of seconds doesn't fit: the phase is noise of some tens of ns, and
+ * even packed tight that's most of a byte a second. So each record sums up
+ * HISTORY_STEP_SEC, aligned to unix time: the mean phase, which averages
+ * the noise down, the largest phase, so a spike isn't lost, and the last
+ * of the rest. The phases are kept in units of HISTORY_PHASE_QUANTUM_NS,
+ * around the noise floor of the mean.
+ *
+ * Records are staged HISTORY_BLOCK at a time and then written to the ring
+ * as one block, which stands on its own, so the ring only ever drops whole
+ * blocks from the old end. Offsets count bytes since boot and only go up.
+ * A block is, little-endian:
+ *   length    2 bytes, the whole block
+ *   start     4 bytes, unix time of the first record's step
+ *   step      1 byte, seconds from one record to the next
+ *   quantum   1 byte, ns in a unit of the phase fields
+ *   count     1 byte, records in the block
+ *   fields    for each of history_field_t: the first record's value as a
+ *             zigzag varint, then a byte of order << 6 | width
+ *   the rest  for each record after the first, for each field, width bits
+ *             of zigzag: the change from the record before (order 1) or
+ *             the change in that change (order 2). Low bit first.
+ * Each field of each block gets whichever order needs fewer bits. The
+ * phases take most of the space, about 1.5 bytes a record between them;
+ * the rest sit still or move smoothly, and cost a bit or two. That's
+ * about 15KB a day.
+ *
+ * A step that's missed (or a jump in the date) ends the block early.
+ */
+
+#define HISTORY_HEADER 9
+
+static unsigned char history_buf[HISTORY_BUFFER_SIZE];
+static uint32_t history_head;    /* Bytes ever written */
+static uint32_t history_tail;    /* Oldest block still whole */
+static int32_t history_stage[HISTORY_FIELDS][HISTORY_BLOCK];
+static unsigned int history_count;
+static int32_t history_start;
+
+/* The step being summed up */
+static int32_t history_step_start;
+static unsigned int history_step_count;
+static int64_t history_phase_sum;
+static int32_t history_phase_max;
+static int32_t history_phase_filtered, history_rate, history_rb; /* Last */
+static uint32_t history_health;
+
+static unsigned char history_byte(uint32_t offset) {
+  return history_buf[offset % HISTORY_BUFFER_SIZE];
+}
+
+static void history_put(unsigned char ch) {
+  history_buf[history_head++ % HISTORY_BUFFER_SIZE] = ch;
+}
+
+static uint32_t history_zigzag(int32_t val) {
+  return (uint32_t)val << 1 ^ (uint32_t)(val >> 31);
+}
+
+static uint64_t history_zigzag64(int64_t val) {
+  return (uint64_t)val << 1 ^ (uint64_t)(val >> 63);
+}
+
+static unsigned int history_varint_len(uint32_t val) {
+  unsigned int len = 1;
+  while (val >= 0x80) {
+    val >>= 7;
+    len++;
+  }
+  return len;
+}
+
+static unsigned int history_width(uint64_t val) {
+  return val ? 64 - __builtin_clzll(val) : 0;
+}
+
+/* The change (order 1) or change in change (order 2) going into record i */
+static int64_t history_delta(const int32_t *v, unsigned int i, unsigned int order) {
+  int64_t d = (int64_t)v[i] - v[i - 1];
+  if (order == 2 && i > 1)
+    d -= (int64_t)v[i - 1] - v[i - 2];
+  return d;
+}
+
+static void history_write_block() {
+  unsigned char widths[HISTORY_FIELDS];
+  unsigned int len = HISTORY_HEADER, bits = 0;
+
+  for (unsigned int f = 0 ; f < HISTORY_FIELDS ; f++) {
+    unsigned int w[3] = { 0, 0, 0 };
+    for (unsigned int order = 1 ; order <= 2 ; order++) {
+      for (unsigned int i = 1 ; i < history_count ; i++) {
+        unsigned int width = history_width(history_zigzag64(history_delta(history_stage[f], i, order)));
+        if (width > w[order])
+          w[order] = width;
+      }
+    }
+    widths[f] = w[2] < w[1] ? 2 << 6 | w[2] : 1 << 6 | w[1];
+    len += history_varint_len(history_zigzag(history_stage[f][0])) + 1;
+    bits += (widths[f] & 0x3f) * (history_count - 1);
+  }
+  len += (bits + 7) / 8;
+
+  /* Make room, a whole block at a time */
+  while (history_head + len - history_tail > HISTORY_BUFFER_SIZE)
+    history_tail += history_byte(history_tail) | history_byte(history_tail + 1) << 8;
+
+  history_put(len);
+  history_put(len >> 8);
+  for (int i = 0 ; i < 4 ; i++)
+    history_put(history_start >> (8 * i));
+  history_put(HISTORY_STEP_SEC);
+  history_put(HISTORY_PHASE_QUANTUM_NS);
+  history_put(history_count);
+  for (unsigned int f = 0 ; f < HISTORY_FIELDS ; f++) {
+    uint32_t zz = history_zigzag(history_stage[f][0]);
+    while (zz >= 0x80) {
+      history_put(zz | 0x80);
+      zz >>= 7;
+    }
+    history_put(zz);
+    history_put(widths[f]);
+  }
+
+  uint64_t acc = 0;
+  unsigned int acc_bits = 0;
+  for (unsigned int i = 1 ; i < history_count ; i++) {
+    for (unsigned int f = 0 ; f < HISTORY_FIELDS ; f++) {
+      unsigned int width = widths[f] & 0x3f;
+      if (!width)
+        continue;
+      acc |= history_zigzag64(history_delta(history_stage[f], i, widths[f] >> 6)) << acc_bits;
+      acc_bits += width;
+      while (acc_bits >= 8) {
+        history_put(acc);
+        acc >>= 8;
+        acc_bits -= 8;
+      }
+    }
+  }
+  if (acc_bits)
+    history_put(acc);
+
+  history_count = 0;
+}
+
+/* ns to the nearest quantum */
+static int32_t history_quantize(int64_t ns) {
+  return (ns + (ns < 0 ? -HISTORY_PHASE_QUANTUM_NS : HISTORY_PHASE_QUANTUM_NS) / 2) / HISTORY_PHASE_QUANTUM_NS;
+}
+
+/* The step just finished, as a record */
+static void history_add_step() {
+  int32_t start = history_step_start;
+
+  if (history_count && start != history_start + (int32_t)history_count * HISTORY_STEP_SEC)
+    history_write_block();
+  if (!history_count)
+    history_start = start;
+
+  unsigned int i = history_count++;
+  history_stage[HISTORY_PHASE][i] = history_quantize(history_phase_sum / (int32_t)history_step_count);
+  history_stage[HISTORY_PHASE_MAX][i] = history_quantize(history_phase_max);
+  history_stage[HISTORY_PHASE_FILTERED][i] = history_quantize(history_phase_filtered);
+  history_stage[HISTORY_RATE][i] = history_rate;
+  history_stage[HISTORY_RB][i] = history_rb;
+  history_stage[HISTORY_HEALTH][i] = history_health;
+
+  if (history_count == HISTORY_BLOCK)
+    history_write_block();
+}
+
+/* Once a second, from loop() */
+void history_record() {
+  int32_t now = time_get_unix();
+  int32_t start = now - now % HISTORY_STEP_SEC;
+
+  if (history_step_count && start != history_step_start)
+    history_add_step();
+  if (start != history_step_start || !history_step_count) {
+    history_step_start = start;
+    history_step_count = 0;
+    history_phase_sum = 0;
+    history_phase_max = 0;
+    history_health = 0;
+  }
+
+  int32_t phase = pll_get_phase();
+  history_step_count++;
+  history_phase_sum += phase;
+  if (phase < 0)
+    phase = -phase;
+  if (phase > history_phase_max)
+    history_phase_max = phase;
+  history_phase_filtered = pll_get_phase_filtered();
+  history_rate = pll_get_rate();
+  history_rb = rb_get_frequency();
+  history_health |= health_get_flags() | (timers_slew_pending() ? 0x100 : 0);
+}
+
+const char *history_get_status() {
+  static char status[64];
+
+  if (history_tail == history_head)
+    return "empty";
+  uint32_t from = 0;
+  for (int i = 0 ; i < 4 ; i++)
+    from |= (uint32_t)history_byte(history_tail + 2 + i) << (8 * i);
+  snprintf(status, sizeof(status), "from %lu, at %lu, since %lu",
+      (unsigned long)history_tail, (unsigned long)history_head, (unsigned long)from);
+  return status;
+}
+
+/* The block being printed, decoded a record a line */
+static struct history_print_t {
+  uint32_t block, p, next;
+  int32_t start;
+  unsigned int step, quantum, count;
+  int32_t val[HISTORY_FIELDS];
+  int64_t delta[HISTORY_FIELDS];
+  unsigned char widths[HISTORY_FIELDS];
+  uint64_t acc;
+  unsigned int acc_bits;
+} history_printing;
+
+static bool history_record_line(unsigned int *pos) {
+  struct history_print_t *d = &history_printing;
+  unsigned int i = *pos;
+
+  if (i > d->count)
+    return false;
+  (*pos)++;
+  if ((int32_t)(d->block - history_tail) < 0) {
+    /* Overwritten while we were printing it */
+    Console.println("overwritten");
+    d->next = history_tail;
+    d->count = i;
+  }
+  if (i == d->count) {
+    Console.print("next ");
+    Console.println(d->next);
+    return true;
+  }
+
+  if (i) {
+    for (unsigned int f = 0 ; f < HISTORY_FIELDS ; f++) {
+      unsigned int width = d->widths[f] & 0x3f;
+      while (d->acc_bits < width) {
+        d->acc |= (uint64_t)history_byte(d->p++) << d->acc_bits;
+        d->acc_bits += 8;
+      }
+      uint64_t zz = width ? d->acc & (~0ULL >> (64 - width)) : 0;
+      d->acc = width < 64 ? d->acc >> width : 0;
+      d->acc_bits -= width;
+      int64_t delta = (int64_t)(zz >> 1) ^ -(int64_t)(zz & 1);
+      d->delta[f] = d->widths[f] >> 6 == 2 ? d->delta[f] + delta : delta;
+      d->val[f] += d->delta[f];
+    }
+  }
+  Console.print(d->start + i * d->step);
+  for (unsigned int f = 0 ; f < HISTORY_FIELDS ; f++) {
+    Console.print(" ");
+    Console.print(f <= HISTORY_PHASE_FILTERED ? d->val[f] * (int32_t)d->quantum : d->val[f]);
+  }
+  Console.print("\r\n");
+  return true;
+}
+
+/* The records of the block at offset (or the oldest, if that's gone) as
+ * "time phase phase-max filtered rate rb health" lines, the phases in ns,
+ * then "next" and the next block's offset. A line a console_poll().
+ */
+void history_print_block(uint32_t offset) {
+  struct history_print_t *d = &history_printing;
+
+  if ((int32_t)(offset - history_tail) < 0)
+    offset = history_tail;
+  d->block = offset;
+  d->count = 0;
+  d->next = offset;
+  if (offset != history_head) {
+    uint32_t p = offset;
+    unsigned int len = history_byte(p) | history_byte(p + 1) << 8;
+    d->start = 0;
+    for (int i = 0 ; i < 4 ; i++)
+      d->start |= (uint32_t)history_byte(p + 2 + i) << (8 * i);
+    d->step = history_byte(p + 6);
+    d->quantum = history_byte(p + 7);
+    d->count = history_byte(p + 8);
+    p += HISTORY_HEADER;
+
+    for (unsigned int f = 0 ; f < HISTORY_FIELDS ; f++) {
+      uint32_t zz = 0;
+      for (int shift = 0 ; shift < 35 ; shift += 7) {
+        unsigned char ch = history_byte(p++);
+        zz |= (uint32_t)(ch & 0x7f) << shift;
+        if (!(ch & 0x80))
+          break;
+      }
+      d->val[f] = (int32_t)(zz >> 1) ^ -(int32_t)(zz & 1);
+      d->delta[f] = 0;
+      d->widths[f] = history_byte(p++);
+    }
+    d->p = p;
+    d->acc = 0;
+    d->acc_bits = 0;
+    d->next = offset + len;
+  }
+  console_print_lines(history_record_line);
+}
+
+/* Up to len bytes of the ring from *offset on. If that's already been
+ * overwritten, *offset moves up to the oldest block we still have.
+ */
+unsigned int history_read(uint32_t *offset, unsigned char *buf, unsigned int len) {
+  if ((int32_t)(*offset - history_tail) < 0)
+    *offset = history_tail;
+  if (len > history_head - *offset)
+    len = history_head - *offset;
+  for (unsigned int i = 0 ; i < len ; i++)
+    buf[i] = history_byte(*offset + i);
+  return len;
+}
+
+uint32_t history_get_head() {
+  return history_head;
+}
+
+#else
+
+void history_record() {
+  /* empty */
+}
+
+const char *history_get_status() {
+  return "disabled";
+}
+
+void history_print_block(uint32_t offset) {
+  Console.print("next ");
+  Console.println(offset);
+}
+
+unsigned int history_read(uint32_t *offset, unsigned char *buf, unsigned int len) {
+  return 0;
+}
+
+uint32_t history_get_head() {
+  return 0;
+}
+
+#endif
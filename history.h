@@ -0,0 +1,24 @@
+#ifndef __HISTORY_H
+#define __HISTORY_H
+
+/* What each history record holds, in order, for HISTORY_STEP_SEC; the
+ * layout is described in history.cpp
+ */
+enum history_field_t {
+  HISTORY_PHASE,          /* Mean, ns */
+  HISTORY_PHASE_MAX,      /* Largest |phase|, ns */
+  HISTORY_PHASE_FILTERED, /* Last, ns */
+  HISTORY_RATE,           /* Last applied, ppt */
+  HISTORY_RB,             /* Last Rb frequency offset, ppt */
+  HISTORY_HEALTH,         /* health_get_flags() ORed over the step, bit 8 set if slewing */
+  HISTORY_FIELDS
+};
+
+extern void history_record();
+extern const char *history_get_status();
+extern void history_print_block(uint32_t offset);
+
+extern unsigned int history_read(uint32_t *offset, unsigned char *buf, unsigned int len);
+extern uint32_t history_get_head();
+
+#endif
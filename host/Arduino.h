@@ -0,0 +1,63 @@
+#ifndef __HOST_ARDUINO_H
+#define __HOST_ARDUINO_H
+
+/* Just enough of the Arduino API to build the protocol and loop code on
+ * the host, for benchmarks and replays. Hardware access is a no-op.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+#define DEC 10
+#define HEX 16
+#define SERIAL_8N1 0
+#define SERIAL_8O1 1
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+class String {
+  public:
+    template<typename... T> String(T...) {}
+    const char *c_str() const { return ""; }
+};
+
+class Print {
+  public:
+    size_t write(uint8_t) { return 1; }
+    size_t write(const uint8_t *, size_t len) { return len; }
+    template<typename... T> size_t print(T...) { return 0; }
+    template<typename... T> size_t println(T...) { return 0; }
+};
+
+class HardwareSerial : public Print {
+  public:
+    void begin(unsigned long, int = 0) {}
+    int available() { return 0; }
+    int read() { return -1; }
+    void flush() {}
+    operator bool() { return true; }
+};
+
+inline HardwareSerial Serial, Serial1, Serial2;
+
+inline void delay(unsigned long) {}
+unsigned long millis();
+unsigned long micros();
+
+/* Timer registers, for the accessors in timer.h */
+typedef volatile uint32_t RwReg;
+struct TcChannel { RwReg TC_CCR, TC_CMR, TC_SMMR, TC_RESERVED, TC_CV, TC_RA, TC_RB, TC_RC, TC_SR, TC_IER, TC_IDR, TC_IMR; };
+struct Tc { TcChannel TC_CHANNEL[3]; };
+extern Tc *TC0;
+
+#define __get_IPSR() 0
+#define __get_PRIMASK() 0
+#define __set_PRIMASK(x) ((void)(x))
+#define __disable_irq()
+
+#endif
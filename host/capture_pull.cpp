@@ -0,0 +1,71 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Pulls the capture log off the clock over UDP and writes it to stdout,
+ * following it as it grows until interrupted. Start it before "capture
+ * start", or give the offset "capture status" shows, so the log begins with
+ * its CAPTURE_START record.
+ */
+
+#define CAPTURE_PORT 2004
+
+static uint32_t get_be32(const unsigned char *p) {
+  return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "usage: %s clock-ip [offset] > capture.log\n", argv[0]);
+    return 1;
+  }
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(CAPTURE_PORT);
+  if (!inet_aton(argv[1], &addr.sin_addr)) {
+    fprintf(stderr, "Bad address %s\n", argv[1]);
+    return 1;
+  }
+  uint32_t offset = argc > 2 ? strtoul(argv[2], NULL, 0) : 0;
+
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  struct timeval timeout = { 1, 0 };
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+    perror("socket");
+    return 1;
+  }
+
+  for (;;) {
+    unsigned char req[4] = {
+      (unsigned char)(offset >> 24), (unsigned char)(offset >> 16),
+      (unsigned char)(offset >> 8), (unsigned char)offset
+    };
+    unsigned char reply[1500];
+
+    send(fd, req, sizeof(req), 0);
+    ssize_t n = recv(fd, reply, sizeof(reply), 0);
+    if (n < 8)
+      continue; /* Lost, or timed out: ask again */
+
+    uint32_t from = get_be32(reply);
+    uint32_t head = get_be32(reply + 4);
+    if (from != offset) {
+      fprintf(stderr, "Lost %lu bytes at %lu; the log after this won't replay\n",
+          (unsigned long)(from - offset), (unsigned long)offset);
+    }
+    fwrite(reply + 8, 1, n - 8, stdout);
+    fflush(stdout);
+    offset = from + (n - 8);
+    if (offset == head)
+      usleep(200000);
+  }
+}
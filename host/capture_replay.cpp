@@ -0,0 +1,286 @@
+#include <string>
+#include <vector>
+#include "config.h"
+#include "../clock.ino"
+#include "capture.h"
+#include "storage.h"
+
+/* Runs a capture log (see capture.cpp) back through the firmware: the real
+ * GPS drivers, time records, health and loop code, with the clock's own
+ * loop() called as it would have been, on the log's timer time. Prints what
+ * the loop sends to the monitor and the Rb, and the Rb commands the device
+ * actually sent, one per line:
+ *
+ *   <timer seconds> <metric> <value>
+ *   <timer seconds> rb <command>       from this run
+ *   <timer seconds> rec.rb <command>   from the log
+ *
+ * so a change to the decoders or the loop can be diffed against a known
+ * run. The Rb is taken to be locked throughout; its replies aren't logged.
+ */
+
+#define REPLAY_STEP (HZ / 1000) /* Run loop() at least this often, in ticks */
+
+static uint64_t replay_tick;
+static uint32_t replay_seconds;
+static uint64_t replay_top;           /* Timer time at the top of this period */
+static uint32_t replay_max = HZ;      /* TC_RC without the slew */
+static uint32_t replay_period = HZ;   /* This period's length, as TC_RC */
+
+static double replay_time() {
+  return (double)replay_tick / HZ;
+}
+
+/* Timer */
+
+volatile char pps_int = 0;
+volatile char second_tick = 0;
+volatile uint32_t pps_count, pps_capture;
+volatile uint64_t pps_capture_tick;
+volatile uint32_t pps_capture_second;
+static Tc replay_tc;
+Tc *TC0 = &replay_tc;
+static int32_t slew_remaining, slew_step, slew_max = PLL_SLEW_MAX_NS / NSPT;
+
+void timer_init() {}
+uint64_t timer_now() { return replay_tick; }
+uint32_t timer_get_seconds() { return replay_seconds; }
+void timers_set_max(uint32_t max) {
+  replay_max = max;
+  replay_period = replay_max + slew_step;
+}
+void timers_jam_sync() { printf("%.3f jam_sync\n", replay_time()); }
+void timers_slew(int32_t ticks) { slew_remaining += ticks; }
+bool timers_slew_pending() { return slew_remaining != 0; }
+int32_t timers_get_slew_remaining() { return slew_remaining; }
+void timers_set_slew_max(int32_t ticks) { slew_max = ticks > 0 ? ticks : 1; }
+void pps_output_enable() {}
+void pps_output_disable() {}
+
+unsigned long millis() { return replay_tick / (HZ / 1000); }
+unsigned long micros() { return replay_tick / (HZ / 1000000); }
+
+/* GPS port: one span at a time, as the device polled it */
+
+static const unsigned char *replay_span, *replay_span_end;
+static unsigned int replay_span_len;
+static uint32_t replay_byte_ticks = HZ / 960;
+
+void gps_rx_init() {}
+void gps_rx_set_rate(uint32_t baud, unsigned int bits) { replay_byte_ticks = (uint64_t)HZ * bits / baud; }
+
+void gps_rx_poll(void (*decode)(const unsigned char *, unsigned int)) {
+  if (replay_span_len) {
+    unsigned int len = replay_span_len;
+    replay_span_len = 0;
+    decode(replay_span, len);
+  }
+}
+
+uint64_t gps_rx_tick(const unsigned char *p) {
+  return replay_tick - (uint64_t)(replay_span_end - p) * replay_byte_ticks;
+}
+
+void gps_tx_write(const void *buf, unsigned int len) {}
+void gps_tx_flush() {}
+bool gps_tx_done() { return true; }
+
+/* Rb: accept everything, say what would have been sent */
+
+static int32_t rb_ppt;
+
+void rb_init() {}
+void rb_poll() {}
+void rb_enable() {}
+void rb_disable() {}
+void rb_write_divisor() { printf("%.3f rb o\n", replay_time()); }
+int32_t rb_get_frequency() { return rb_ppt; }
+
+int32_t rb_set_frequency(int32_t ppt) {
+  if (ppt == rb_ppt)
+    return rb_ppt;
+  rb_ppt = constrain(ppt, rb_ppt - 2000, rb_ppt + 2000);
+  uint32_t mag = rb_ppt < 0 ? -rb_ppt : rb_ppt;
+  printf("%.3f rb f%s%u", replay_time(), rb_ppt < 0 ? "-" : "", mag / 10);
+  if (mag % 10)
+    printf(".%u", mag % 10);
+  printf("\n");
+  return rb_ppt;
+}
+
+int32_t rb_restore_frequency(int32_t ppt) {
+  return rb_ppt = ppt;
+}
+
+/* Everything else the loop touches */
+
+char console_input = 0;
+volatile char ether_int = 0;
+ConsoleOutput console_out;
+
+void console_init() {}
+void console_handle_input() {}
+void console_poll() {}
+void console_write(const char *buf, unsigned int len) {}
+void console_print_lines(console_lines_t lines) {}
+bool console_write_line(const char *buf, unsigned int len) { return true; }
+void ether_init() {}
+void ether_recv() {}
+void ethernet_send_ntp_stats() {}
+
+#define MONITOR_METRIC_NAME(id, name, type) name,
+static const char *const replay_metric_names[] = { MONITOR_METRICS(MONITOR_METRIC_NAME) };
+
+/* Not prof.*: those are this machine's timings, and differ run to run */
+void monitor_send(enum monitor_metric_t metric, int value) {
+  if (metric >= MONITOR_PROF_NTP_REQUEST_MEAN && metric <= MONITOR_PROF_IRQ_MASKED_MAX)
+    return;
+  printf("%.3f %s %d\n", replay_time(), replay_metric_names[metric], value);
+}
+void monitor_flush() {}
+void monitor_poll() {}
+
+bool storage_read(enum storage_slot_t slot, void *data, unsigned int len) { return false; }
+bool storage_write(enum storage_slot_t slot, const void *data, unsigned int len) { return true; }
+
+/* Start any new timer periods up to replay_tick, as the timer interrupt
+ * does: each is TC_RC long, and the slew is taken a step at a time at the
+ * top of each.
+ */
+static void replay_wrap() {
+  while (replay_tick >= replay_top + replay_period) {
+    replay_top += replay_period;
+    replay_seconds++;
+    slew_step = constrain(slew_remaining, -slew_max, slew_max);
+    slew_remaining -= slew_step;
+    replay_period = replay_max + slew_step;
+    second_int();
+    second_tick = 1;
+  }
+  replay_tc.TC_CHANNEL[1].TC_CV = replay_tick - replay_top;
+}
+
+/* Move timer time on to tick, running loop() on the way */
+static void replay_advance(uint64_t tick) {
+  while (replay_tick + REPLAY_STEP <= tick) {
+    replay_tick += REPLAY_STEP;
+    replay_wrap();
+    loop();
+  }
+  if (tick > replay_tick) {
+    replay_tick = tick;
+    replay_wrap();
+  }
+}
+
+static bool get_varint(const unsigned char *&p, const unsigned char *end, uint64_t *val) {
+  *val = 0;
+  for (int shift = 0 ; p < end && shift < 64 ; shift += 7) {
+    *val |= (uint64_t)(*p & 0x7f) << shift;
+    if (!(*p++ & 0x80))
+      return true;
+  }
+  return false;
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s capture.log\n", argv[0]);
+    return 1;
+  }
+  FILE *f = fopen(argv[1], "rb");
+  if (!f) {
+    perror(argv[1]);
+    return 1;
+  }
+  std::vector<unsigned char> log;
+  unsigned char chunk[4096];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+    log.insert(log.end(), chunk, chunk + n);
+  fclose(f);
+
+  const unsigned char *p = log.data(), *end = p + log.size();
+  uint64_t tick = 0, val;
+  bool started = false;
+
+  while (p < end) {
+    const unsigned char *rec = p;
+    unsigned char type = *p++;
+    if (!get_varint(p, end, &val))
+      break;
+    tick += (int64_t)(val >> 1) ^ -(int64_t)(val & 1);
+
+    switch (type) {
+      case CAPTURE_START: {
+        if (end - p < 8)
+          goto truncated;
+        tick = 0;
+        for (int i = 0 ; i < 8 ; i++)
+          tick |= (uint64_t)*p++ << (8 * i);
+        if (!get_varint(p, end, &val) || (uint64_t)(end - p) < val)
+          goto truncated;
+        std::string name((const char *)p, val);
+        p += val;
+        if (!started) {
+          replay_tick = tick;
+          replay_seconds = tick / HZ;
+          replay_top = (uint64_t)replay_seconds * HZ;
+          setup();
+          health_set_rb_status(RB_OK);
+          gps_set_protocol(name.c_str());
+          started = true;
+        }
+        printf("%.3f start %s\n", (double)tick / HZ, name.c_str());
+        break;
+      }
+      case CAPTURE_GPS:
+        if (!get_varint(p, end, &val) || (uint64_t)(end - p) < val)
+          goto truncated;
+        if (started) {
+          replay_advance(tick);
+          replay_span = p;
+          replay_span_len = val;
+          replay_span_end = p + val;
+          loop();
+        }
+        p += val;
+        break;
+      case CAPTURE_PPS: {
+        uint64_t edges, tm;
+        if (!get_varint(p, end, &edges) || !get_varint(p, end, &tm))
+          goto truncated;
+        if (started) {
+          replay_advance(tick);
+          pps_count += edges;
+          pps_capture = tm;
+          pps_capture_tick = tick;
+          pps_capture_second = tm > replay_period / 2 ? replay_seconds + 1 : replay_seconds;
+          pps_int = 1;
+          loop();
+        }
+        break;
+      }
+      case CAPTURE_RB:
+        if (!get_varint(p, end, &val) || (uint64_t)(end - p) < val)
+          goto truncated;
+        if (started) {
+          unsigned int len = val;
+          while (len && (p[len - 1] == '\r' || p[len - 1] == '\n'))
+            len--;
+          replay_advance(tick);
+          printf("%.3f rec.rb %.*s\n", replay_time(), (int)len, p);
+        }
+        p += val;
+        break;
+      default:
+        fprintf(stderr, "Unknown record type %u at byte %zu\n", type, (size_t)(rec - log.data()));
+        return 1;
+    }
+  }
+  return 0;
+
+truncated:
+  fprintf(stderr, "Log ends mid-record\n");
+  return 0;
+}
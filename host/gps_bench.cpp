@@ -0,0 +1,92 @@
+#include <time.h>
+#include <vector>
+#include "config.h"
+#include "gps.h"
+#include "prof.h"
+
+/* Feeds a synthetic UBX stream through gps_decode(), once in PDC-sized
+ * spans and once a byte at a time like the old gps_poll(), and reports
+ * throughput in bytes per microsecond. Each span is timed with prof too,
+ * as gps_poll() is on the board, so "prof" there compares with this.
+ */
+
+static void ubx_append(std::vector<unsigned char> &out, unsigned short id, unsigned int len) {
+  unsigned char ck_a = 0, ck_b = 0;
+  unsigned char hdr[4] = {
+    (unsigned char)(id >> 8), (unsigned char)(id & 0xff),
+    (unsigned char)(len & 0xff), (unsigned char)(len >> 8)
+  };
+
+  out.push_back(0xb5);
+  out.push_back(0x62);
+  for (int i = 0 ; i < 4 ; i++) {
+    out.push_back(hdr[i]);
+    ck_a += hdr[i];
+    ck_b += ck_a;
+  }
+  for (unsigned int i = 0 ; i < len ; i++) {
+    unsigned char ch = rand();
+    out.push_back(ch);
+    ck_a += ch;
+    ck_b += ck_a;
+  }
+  out.push_back(ck_a);
+  out.push_back(ck_b);
+}
+
+static double now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static double bench(const std::vector<unsigned char> &stream, unsigned int span, int reps) {
+  prof_reset();
+  double start = now_us();
+  for (int r = 0 ; r < reps ; r++) {
+    for (size_t i = 0 ; i < stream.size() ; i += span) {
+      size_t n = stream.size() - i < span ? stream.size() - i : span;
+      uint32_t cycles = prof_cycles();
+      gps_decode(stream.data() + i, n);
+      prof_end(PROF_GPS_POLL, cycles);
+    }
+  }
+  double elapsed = now_us() - start;
+  return stream.size() * (double)reps / elapsed;
+}
+
+static void print_spans() {
+  struct prof_stats_t s;
+
+  if (!prof_get(PROF_GPS_POLL, &s))
+    return;
+  printf("  per span: mean %lu max %lu cycles, mean %lu max %lu ns\n",
+      (unsigned long)(s.sum / s.count), (unsigned long)s.max,
+      (unsigned long)prof_ns(s.sum / s.count), (unsigned long)prof_ns(s.max));
+}
+
+int main() {
+  std::vector<unsigned char> stream;
+
+  /* One second's worth: the messages we handle, a big NAV-SAT we mostly
+   * skip, and a bit of line noise between seconds.
+   */
+  for (int sec = 0 ; sec < 4096 ; sec++) {
+    ubx_append(stream, 0x0134, 8 + 12 * 20); /* Unhandled, skipped */
+    ubx_append(stream, 0x0121, 20);          /* NAV-TIMEUTC */
+    ubx_append(stream, 0x0122, 20);          /* NAV-CLOCK */
+    ubx_append(stream, 0x0d03, 28);          /* TIM-TM2 */
+    for (int i = 0 ; i < 16 ; i++)
+      stream.push_back(rand() & 0x7f);
+  }
+
+  prof_init();
+  printf("%zu byte stream\n", stream.size());
+  printf("256 byte spans: %.2f bytes/us\n", bench(stream, 256, 20));
+  print_spans();
+  printf("64 byte spans:  %.2f bytes/us\n", bench(stream, 64, 20));
+  print_spans();
+  printf("1 byte spans:   %.2f bytes/us\n", bench(stream, 1, 20));
+  print_spans();
+  return 0;
+}
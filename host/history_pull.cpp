@@ -0,0 +1,161 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+/* Pulls the PLL history off the clock over UDP, everything it still has
+ * up to now, and prints it a record (HISTORY_STEP_SEC) a line:
+ *   unix-time phase max-phase filtered-phase rate rb-ppt health
+ * with the phases in ns.
+ * With -r, writes the blocks as they came instead. The block layout is
+ * described in history.cpp.
+ */
+
+#define HISTORY_PORT 2005
+#define HISTORY_FIELDS 6
+#define HISTORY_PHASES 3 /* The first fields, in quanta */
+#define HISTORY_HEADER 9
+
+static uint32_t get_be32(const unsigned char *p) {
+  return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static uint32_t get_le32(const unsigned char *p) {
+  return (uint32_t)p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* One block; false if it runs off the end of what we have */
+static bool print_block(const unsigned char *p, const unsigned char *end) {
+  if (end - p < HISTORY_HEADER)
+    return false;
+  const unsigned char *block_end = p + (p[0] | p[1] << 8);
+  int32_t start = get_le32(p + 2);
+  unsigned int step = p[6], quantum = p[7], count = p[8];
+  if (block_end < p + HISTORY_HEADER || block_end > end)
+    return false;
+  p += HISTORY_HEADER;
+
+  int32_t val[HISTORY_FIELDS];
+  int64_t delta[HISTORY_FIELDS];
+  unsigned char widths[HISTORY_FIELDS];
+  for (unsigned int f = 0 ; f < HISTORY_FIELDS ; f++) {
+    uint32_t zz = 0;
+    for (int shift = 0 ; shift < 35 && p < block_end ; shift += 7) {
+      unsigned char ch = *p++;
+      zz |= (uint32_t)(ch & 0x7f) << shift;
+      if (!(ch & 0x80))
+        break;
+    }
+    val[f] = (int32_t)(zz >> 1) ^ -(int32_t)(zz & 1);
+    delta[f] = 0;
+    widths[f] = p < block_end ? *p++ : 0;
+  }
+
+  uint64_t acc = 0;
+  unsigned int acc_bits = 0;
+  for (unsigned int i = 0 ; i < count ; i++) {
+    for (unsigned int f = 0 ; i && f < HISTORY_FIELDS ; f++) {
+      unsigned int width = widths[f] & 0x3f;
+      while (acc_bits < width) {
+        if (p == block_end) {
+          fprintf(stderr, "Block at %ld is short\n", (long)start);
+          return true;
+        }
+        acc |= (uint64_t)*p++ << acc_bits;
+        acc_bits += 8;
+      }
+      uint64_t zz = width ? acc & (~0ULL >> (64 - width)) : 0;
+      acc = width < 64 ? acc >> width : 0;
+      acc_bits -= width;
+      int64_t d = (int64_t)(zz >> 1) ^ -(int64_t)(zz & 1);
+      delta[f] = widths[f] >> 6 == 2 ? delta[f] + d : d;
+      val[f] += delta[f];
+    }
+    printf("%ld", (long)(start + i * step));
+    for (unsigned int f = 0 ; f < HISTORY_FIELDS ; f++)
+      printf(" %ld", (long)(f < HISTORY_PHASES ? val[f] * (int32_t)quantum : val[f]));
+    printf("\n");
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  bool raw = false;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "r")) != -1) {
+    switch (opt) {
+      case 'r': raw = true; break;
+      default:
+        fprintf(stderr, "usage: %s [-r] clock-ip\n", argv[0]);
+        return 1;
+    }
+  }
+  if (optind + 1 != argc) {
+    fprintf(stderr, "usage: %s [-r] clock-ip\n", argv[0]);
+    return 1;
+  }
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(HISTORY_PORT);
+  if (!inet_aton(argv[optind], &addr.sin_addr)) {
+    fprintf(stderr, "Bad address %s\n", argv[optind]);
+    return 1;
+  }
+
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  struct timeval timeout = { 1, 0 };
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+    perror("socket");
+    return 1;
+  }
+
+  /* Offset 0 is long gone on a clock that's been up a while; the clock
+   * answers from its oldest block instead.
+   */
+  std::vector<unsigned char> history;
+  uint32_t offset = 0, end = 0;
+  bool started = false;
+  do {
+    unsigned char req[4] = {
+      (unsigned char)(offset >> 24), (unsigned char)(offset >> 16),
+      (unsigned char)(offset >> 8), (unsigned char)offset
+    };
+    unsigned char reply[1500];
+
+    send(fd, req, sizeof(req), 0);
+    ssize_t n = recv(fd, reply, sizeof(reply), 0);
+    if (n < 8)
+      continue; /* Lost, or timed out: ask again */
+
+    uint32_t from = get_be32(reply);
+    if (!started) {
+      end = get_be32(reply + 4);
+      started = true;
+    } else if (from != offset) {
+      /* Overwritten while we were pulling; start from the oldest again */
+      fprintf(stderr, "Lost the blocks at %lu, starting over\n", (unsigned long)offset);
+      history.clear();
+    }
+    history.insert(history.end(), reply + 8, reply + n);
+    offset = from + (n - 8);
+  } while (!started || (int32_t)(offset - end) < 0);
+
+  if (raw) {
+    fwrite(history.data(), 1, history.size(), stdout);
+    return 0;
+  }
+  const unsigned char *p = history.data(), *stop = p + history.size();
+  while (p < stop && print_block(p, stop))
+    p += p[0] | p[1] << 8;
+  return 0;
+}
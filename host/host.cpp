@@ -0,0 +1,55 @@
+#include <time.h>
+#include "config.h"
+#include "health.h"
+#include "storage.h"
+#include "monitor.h"
+#include "console.h"
+
+/* Stand-ins for the firmware pieces the protocol code calls into */
+
+char console_input = 0;
+ConsoleOutput console_out;
+static Tc host_tc;
+Tc *TC0 = &host_tc;
+
+void console_write(const char *buf, unsigned int len) {}
+void console_print_lines(console_lines_t lines) {}
+
+bool console_write_line(const char *buf, unsigned int len) {
+  return true;
+}
+
+unsigned long millis() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+unsigned long micros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+void time_set_date(unsigned short gps_week, unsigned int gps_tow_sec, short offset) {}
+int32_t time_get_unix() { return 0; }
+uint32_t time_get_ns(uint32_t tm, char *carry) { return 0; }
+void monitor_send(enum monitor_metric_t metric, int value) {}
+void health_set_gps_status(enum gps_status_t status) {}
+void health_reset_gps_watchdog() {}
+void gps_rx_init() {}
+void gps_rx_set_rate(uint32_t baud, unsigned int bits) {}
+void gps_rx_poll(void (*decode)(const unsigned char *, unsigned int)) {}
+uint64_t gps_rx_tick(const unsigned char *p) { return 0; }
+void gps_tx_write(const void *buf, unsigned int len) {}
+void gps_tx_flush() {}
+bool gps_tx_done() { return true; }
+
+volatile uint32_t pps_count, pps_capture;
+volatile uint64_t pps_capture_tick;
+volatile uint32_t pps_capture_second;
+volatile char pps_int;
+uint64_t timer_now() { return 0; }
+uint32_t timer_get_seconds() { return 0; }
+bool storage_read(enum storage_slot_t slot, void *data, unsigned int len) { return false; }
+bool storage_write(enum storage_slot_t slot, const void *data, unsigned int len) { return false; }
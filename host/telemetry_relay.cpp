@@ -0,0 +1,214 @@
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include "monitor.h"
+
+/* Takes the clock's binary monitor packets ("monitor format binary") and
+ * turns them back into Graphite plaintext, on stdout or to a Graphite
+ * server over TCP. With -P it also keeps a Prometheus textfile (for
+ * node_exporter's textfile collector) of the latest value of each line.
+ * Gaps in the sequence numbers are reported, and counted in the textfile
+ * as <prefix>telemetry_lost.
+ */
+
+#define RELAY_PORT 2003 /* MONITOR_PORT */
+
+static const char *const relay_metric_names[] = {
+#define MONITOR_METRIC_NAME(id, name, type) name,
+  MONITOR_METRICS(MONITOR_METRIC_NAME)
+#undef MONITOR_METRIC_NAME
+};
+
+static const char *const relay_suffixes[] = {
+  [MONITOR_SUFFIX_NONE] = "",
+  [MONITOR_SUFFIX_MIN] = ".min",
+  [MONITOR_SUFFIX_MAX] = ".max",
+  [MONITOR_SUFFIX_LAST] = ".last",
+};
+
+static std::string prefix = "duet.";
+static FILE *graphite;
+static const char *graphite_host;
+static const char *prom_path;
+static int32_t prom_values[MONITOR_METRIC_COUNT][4];
+static bool prom_seen[MONITOR_METRIC_COUNT][4];
+static uint64_t lost, packets;
+
+static uint32_t get_le32(const unsigned char *p) {
+  return (uint32_t)p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static bool get_varint(const unsigned char *&p, const unsigned char *end, int32_t *val) {
+  uint32_t zz = 0;
+
+  for (int shift = 0 ; p < end && shift < 35 ; shift += 7) {
+    zz |= (uint32_t)(*p & 0x7f) << shift;
+    if (!(*p++ & 0x80)) {
+      *val = (int32_t)(zz >> 1) ^ -(int32_t)(zz & 1);
+      return true;
+    }
+  }
+  return false;
+}
+
+static FILE *graphite_connect(const char *spec) {
+  std::string host = spec, port = "2003";
+  size_t colon = host.rfind(':');
+  if (colon != std::string::npos) {
+    port = host.substr(colon + 1);
+    host = host.substr(0, colon);
+  }
+
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res)) {
+    fprintf(stderr, "Can't resolve %s\n", spec);
+    return NULL;
+  }
+  int fd = socket(res->ai_family, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+    perror(spec);
+    if (fd >= 0)
+      close(fd);
+    freeaddrinfo(res);
+    return NULL;
+  }
+  freeaddrinfo(res);
+  return fdopen(fd, "w");
+}
+
+static void prom_write() {
+  std::string tmp = std::string(prom_path) + ".tmp";
+  FILE *f = fopen(tmp.c_str(), "w");
+  if (!f) {
+    perror(tmp.c_str());
+    return;
+  }
+
+  std::string base = prefix;
+  for (char &c : base)
+    if (c == '.')
+      c = '_';
+  for (unsigned int m = 0 ; m < MONITOR_METRIC_COUNT ; m++) {
+    for (unsigned int s = 0 ; s < 4 ; s++) {
+      if (!prom_seen[m][s])
+        continue;
+      std::string name = base + relay_metric_names[m] + relay_suffixes[s];
+      for (char &c : name)
+        if (c == '.')
+          c = '_';
+      fprintf(f, "%s %d\n", name.c_str(), prom_values[m][s]);
+    }
+  }
+  fprintf(f, "%stelemetry_lost %llu\n", base.c_str(), (unsigned long long)lost);
+  fprintf(f, "%stelemetry_packets %llu\n", base.c_str(), (unsigned long long)packets);
+  fclose(f);
+  rename(tmp.c_str(), prom_path);
+}
+
+static void relay_packet(const unsigned char *buf, size_t len) {
+  static bool have_seq;
+  static uint32_t next_seq;
+
+  if (len < MONITOR_BINARY_HEADER || buf[0] != MONITOR_BINARY_MAGIC) {
+    fprintf(stderr, "Not a binary monitor packet\n");
+    return;
+  }
+  if (buf[1] != MONITOR_BINARY_VERSION) {
+    fprintf(stderr, "Packet version %u, expected %u\n", buf[1], MONITOR_BINARY_VERSION);
+    return;
+  }
+
+  uint32_t seq = get_le32(buf + 2);
+  if (have_seq && seq != next_seq) {
+    if ((int32_t)(seq - next_seq) > 0) {
+      fprintf(stderr, "Lost %lu packets\n", (unsigned long)(seq - next_seq));
+      lost += seq - next_seq;
+    } else {
+      fprintf(stderr, "Sequence went back from %lu to %lu; clock restarted?\n",
+          (unsigned long)next_seq, (unsigned long)seq);
+    }
+  }
+  have_seq = true;
+  next_seq = seq + 1;
+  packets++;
+
+  int32_t stamp = get_le32(buf + 6);
+  uint32_t key = 0;
+  const unsigned char *p = buf + MONITOR_BINARY_HEADER, *end = buf + len;
+  FILE *out = graphite ? graphite : stdout;
+
+  while (p < end) {
+    int32_t delta, value;
+    if (!get_varint(p, end, &delta) || !get_varint(p, end, &value)) {
+      fprintf(stderr, "Packet %lu ends mid-entry\n", (unsigned long)seq);
+      break;
+    }
+    key += delta;
+    if (key == 0) {
+      stamp += value;
+      continue;
+    }
+    unsigned int metric = key / 4 - 1, suffix = key % 4;
+    if (metric >= MONITOR_METRIC_COUNT) {
+      fprintf(stderr, "Unknown metric %u; relay built from a different monitor.h?\n", metric);
+      continue;
+    }
+    fprintf(out, "%s%s%s %d %d\n", prefix.c_str(), relay_metric_names[metric], relay_suffixes[suffix], value, stamp);
+    prom_values[metric][suffix] = value;
+    prom_seen[metric][suffix] = true;
+  }
+
+  if (fflush(out) != 0 && graphite) {
+    fprintf(stderr, "Lost the Graphite connection, reconnecting\n");
+    fclose(graphite);
+    graphite = graphite_connect(graphite_host);
+  }
+  if (prom_path)
+    prom_write();
+}
+
+int main(int argc, char **argv) {
+  int port = RELAY_PORT, opt;
+
+  while ((opt = getopt(argc, argv, "l:g:P:x:")) != -1) {
+    switch (opt) {
+      case 'l': port = atoi(optarg); break;
+      case 'g': graphite_host = optarg; break;
+      case 'P': prom_path = optarg; break;
+      case 'x': prefix = optarg; break;
+      default:
+        fprintf(stderr, "usage: %s [-l listen-port] [-g graphite-host[:port]] [-P prom-file] [-x prefix]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  if (graphite_host && !(graphite = graphite_connect(graphite_host)))
+    return 1;
+
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("bind");
+    return 1;
+  }
+
+  for (;;) {
+    unsigned char buf[1500];
+    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+    if (n > 0)
+      relay_packet(buf, n);
+  }
+}
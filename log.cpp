@@ -0,0 +1,269 @@
+#include "config.h"
+#include "console.h"
+#include "log.h"
+#include "storage.h"
+
+/* Console output is deferred, so nothing that logs, in an interrupt or in
+ * pll_run(), waits on the serial port or touches the heap. A log call keeps
+ * the format, its one argument and TIMER_CLOCK in the next slot of a ring.
+ * That is a few dozen cycles. The text is made up in loop(), from
+ * log_drain(), when it gets round to it.
+ *
+ * Any context can log. A slot is claimed by moving the ring's head on
+ * with a compare-and-swap (LDREX/STREX). An interrupt in between makes that
+ * retry, so no lock is needed. The loop is the only reader, and an
+ * interrupt always finishes before the loop runs again. So when the loop
+ * reads, every slot up to the head has been filled. If the ring is full,
+ * the record is dropped and counted.
+ *
+ * Interrupts log to a ring of their own. A loop line is often several
+ * records (debug() a piece at a time), and an interrupt's record in the
+ * middle would come out in the middle of the line. Each ring's text is
+ * put together a line at a time, in a buffer of its own, and handed to
+ * the console whole (console_write_line()), which drops it if there's no
+ * room. Lines from interrupts start with the counter they were logged at,
+ * since they can come out a while later.
+ *
+ * What's logged at all is up to a level for each subsystem, set with "log"
+ * on the console and kept in flash. A site that's off costs the load of
+ * its level and a branch, before anything is put together.
+ */
+
+struct log_record_t {
+  uint32_t stamp;
+  const char *fmt;
+  uintptr_t arg;
+};
+
+struct log_ring_t {
+  struct log_record_t *records;
+  uint32_t size;
+  uint32_t head, tail;
+  char line[LOG_LINE_MAX]; /* Being put together by log_drain() */
+  unsigned int len;
+};
+
+static struct log_record_t log_loop_records[LOG_RECORDS];
+static struct log_record_t log_irq_records[LOG_IRQ_RECORDS];
+static struct log_ring_t log_loop = { log_loop_records, LOG_RECORDS };
+static struct log_ring_t log_irq = { log_irq_records, LOG_IRQ_RECORDS };
+static struct log_ring_t *log_out; /* The ring whose line log_char() adds to */
+static uint32_t log_dropped;
+
+unsigned char log_levels[LOG_SUBSYSTEMS]; /* All off till log_init() */
+
+static const char *const log_subsystem_names[LOG_SUBSYSTEMS] = {
+  [LOG_TIMER] = "timer",
+  [LOG_PLL] = "pll",
+  [LOG_GPS] = "gps",
+  [LOG_HEALTH] = "health",
+  [LOG_ETHERNET] = "ethernet",
+  [LOG_RB] = "rb",
+  [LOG_SYSTEM] = "system",
+};
+
+static const char *const log_level_names[LOG_LEVELS] = {
+  [LOG_OFF] = "off",
+  [LOG_ERROR] = "error",
+  [LOG_DEBUG] = "debug",
+};
+
+/* From setup(), before anything logs */
+void log_init() {
+  unsigned char saved[LOG_SUBSYSTEMS];
+
+  memset(log_levels, LOG_LEVEL_DEFAULT, sizeof(log_levels));
+  if (!storage_read(STORAGE_LOG_LEVELS, saved, sizeof(saved)))
+    return;
+  for (unsigned int i = 0 ; i < LOG_SUBSYSTEMS ; i++)
+    if (saved[i] < LOG_LEVELS)
+      log_levels[i] = saved[i];
+}
+
+void log_print_levels() {
+  for (unsigned int i = 0 ; i < LOG_SUBSYSTEMS ; i++) {
+    Console.print(log_subsystem_names[i]);
+    Console.print(" ");
+    Console.println(log_level_names[log_levels[i]]);
+  }
+}
+
+/* subsystem "all" for every one of them. Saved to flash if it changed. */
+bool log_set_level(const char *subsystem, const char *level) {
+  unsigned int sub, lvl;
+
+  for (lvl = 0 ; lvl < LOG_LEVELS ; lvl++)
+    if (!strcmp(level, log_level_names[lvl]))
+      break;
+  for (sub = 0 ; sub < LOG_SUBSYSTEMS ; sub++)
+    if (!strcmp(subsystem, log_subsystem_names[sub]))
+      break;
+  if (lvl == LOG_LEVELS || (sub == LOG_SUBSYSTEMS && strcmp(subsystem, "all")))
+    return false;
+
+  unsigned char levels[LOG_SUBSYSTEMS];
+  for (unsigned int i = 0 ; i < LOG_SUBSYSTEMS ; i++)
+    levels[i] = sub == LOG_SUBSYSTEMS || sub == i ? lvl : log_levels[i];
+  if (memcmp(levels, log_levels, sizeof(levels))) {
+    memcpy(log_levels, levels, sizeof(levels));
+    storage_write(STORAGE_LOG_LEVELS, levels, sizeof(levels));
+  }
+  return true;
+}
+
+void log_put(const char *fmt, uintptr_t arg) {
+  struct log_ring_t *ring = in_interrupt() ? &log_irq : &log_loop;
+  uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+  do {
+    if (head - ring->tail >= ring->size) {
+      __atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+      return;
+    }
+  } while (!__atomic_compare_exchange_n(&ring->head, &head, head + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  struct log_record_t *r = &ring->records[head % ring->size];
+  r->stamp = *TIMER_CLOCK;
+  r->fmt = fmt;
+  r->arg = arg;
+}
+
+static void log_char(char ch) {
+  log_out->line[log_out->len++] = ch;
+  if (ch == '\n' || log_out->len == LOG_LINE_MAX) {
+    console_write_line(log_out->line, log_out->len);
+    log_out->len = 0;
+  }
+}
+
+static void log_str(const char *s) {
+  while (*s)
+    log_char(*s++);
+}
+
+static void log_ulong(unsigned long n, unsigned int base) {
+  char digits[32];
+  unsigned int len = 0;
+
+  do {
+    digits[len++] = "0123456789ABCDEF"[n % base];
+    n /= base;
+  } while (n);
+  while (len)
+    log_char(digits[--len]);
+}
+
+/* As Print does it: rounded to digits places */
+static void log_float(float f, unsigned int digits) {
+  if (isnan(f)) {
+    log_str("nan");
+    return;
+  }
+  if (f < 0) {
+    log_char('-');
+    f = -f;
+  }
+  float rounding = 0.5;
+  for (unsigned int i = 0 ; i < digits ; i++)
+    rounding /= 10;
+  f += rounding;
+  if (f > 4294967040.0) {
+    log_str("ovf");
+    return;
+  }
+  unsigned long whole = f;
+  log_ulong(whole, 10);
+  if (digits)
+    log_char('.');
+  f -= whole;
+  while (digits--) {
+    f *= 10;
+    unsigned int digit = f;
+    log_char('0' + digit);
+    f -= digit;
+  }
+}
+
+/* fmt, with the conversions log.h uses: %s %c %d %u %x (l or not) and
+ * %.<digits>f of a float's bits
+ */
+static void log_format(const char *fmt, uintptr_t arg) {
+  for (const char *p = fmt ; *p ; p++) {
+    if (*p != '%' || !p[1]) {
+      log_char(*p);
+      continue;
+    }
+
+    unsigned int digits = 2;
+    p++;
+    if (*p == '.' && p[1] >= '0' && p[1] <= '9') {
+      digits = p[1] - '0';
+      p += 2;
+    }
+    if (*p == 'l')
+      p++;
+    switch (*p) {
+      case 's':
+        log_str((const char *)arg);
+        break;
+      case 'c':
+        log_char(arg);
+        break;
+      case 'd':
+        if ((long)arg < 0) {
+          log_char('-');
+          log_ulong(-(unsigned long)arg, 10);
+        } else {
+          log_ulong(arg, 10);
+        }
+        break;
+      case 'u':
+        log_ulong(arg, 10);
+        break;
+      case 'x':
+        log_ulong(arg, 16);
+        break;
+      case 'f': {
+        union { uint32_t bits; float f; } v = { (uint32_t)arg };
+        log_float(v.f, digits);
+        break;
+      }
+      default:
+        log_char(*p);
+        break;
+    }
+  }
+}
+
+/* Format up to max of ring's records; how many it did */
+static unsigned int log_drain_ring(struct log_ring_t *ring, unsigned int max) {
+  uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  unsigned int n;
+
+  log_out = ring;
+  for (n = 0 ; ring->tail != head && n < max ; n++) {
+    struct log_record_t r = ring->records[ring->tail % ring->size];
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+
+    if (!ring->len && ring == &log_irq) {
+      log_char('[');
+      log_ulong(r.stamp, 10);
+      log_str("] ");
+    }
+    log_format(r.fmt, r.arg);
+  }
+  return n;
+}
+
+/* From loop(): format up to LOG_DRAIN_MAX records, interrupts' first */
+void log_drain() {
+  unsigned int n = log_drain_ring(&log_irq, LOG_DRAIN_MAX);
+  log_drain_ring(&log_loop, LOG_DRAIN_MAX - n);
+
+  if (log_loop.tail == log_loop.head && !log_loop.len && log_dropped) {
+    log_out = &log_loop;
+    log_str("[");
+    log_ulong(__atomic_exchange_n(&log_dropped, 0, __ATOMIC_RELAXED), 10);
+    log_str(" log records dropped]\r\n");
+  }
+}
@@ -0,0 +1,81 @@
+#ifndef __LOG_H
+#define __LOG_H
+
+/* Deferred console output; see log.cpp. fmt takes at most one argument.
+ * Both it and a string argument are printed later, so they have to be
+ * literals or static tables, not buffers.
+ */
+extern void log_put(const char *fmt, uintptr_t arg);
+extern void log_drain();
+
+/* Each file that logs (through debug.h) says which of these it is, with
+ * LOG_SUBSYSTEM, and logs only as far as that one's level goes.
+ */
+enum log_subsystem_t {
+  LOG_TIMER,
+  LOG_PLL,
+  LOG_GPS,
+  LOG_HEALTH,
+  LOG_ETHERNET,
+  LOG_RB,
+  LOG_SYSTEM,
+  LOG_SUBSYSTEMS
+};
+
+enum log_level_t {
+  LOG_OFF,
+  LOG_ERROR,
+  LOG_DEBUG,
+  LOG_LEVELS
+};
+
+extern unsigned char log_levels[LOG_SUBSYSTEMS];
+
+#define log_enabled(subsystem, level) (log_levels[subsystem] >= (level))
+
+extern void log_init();
+extern void log_print_levels();
+extern bool log_set_level(const char *subsystem, const char *level);
+
+/* Text with nothing to fill in, printed as it is, '%' and all */
+static inline void log_text(const char *s) {
+  log_put("%s", (uintptr_t)s);
+}
+
+/* A piece of a line, typed as Print would take it */
+static inline void log_piece(const char *s) {
+  log_text(s);
+}
+
+static inline void log_piece(char c) {
+  log_put("%c", (unsigned char)c);
+}
+
+static inline void log_piece(unsigned long n, int base = DEC) {
+  log_put(base == HEX ? "%lx" : "%lu", n);
+}
+
+static inline void log_piece(long n, int base = DEC) {
+  log_put(base == HEX ? "%lx" : "%ld", n);
+}
+
+static inline void log_piece(unsigned char n, int base = DEC) {
+  log_piece((unsigned long)n, base);
+}
+
+static inline void log_piece(unsigned int n, int base = DEC) {
+  log_piece((unsigned long)n, base);
+}
+
+static inline void log_piece(int n, int base = DEC) {
+  log_piece((long)n, base);
+}
+
+/* As a float's bits, with the digits in the format */
+static inline void log_piece(double n, int digits = 2) {
+  static const char *const fmts[] = { "%.0f", "%.1f", "%.2f", "%.3f", "%.4f" };
+  union { float f; uint32_t bits; } v = { (float)n };
+  log_put(fmts[digits < 0 ? 0 : digits > 4 ? 4 : digits], v.bits);
+}
+
+#endif
@@ -1,60 +1,372 @@
 #include "config.h"
+#include "console.h"
+#include "monitor.h"
 
 #if MONITOR_ENABLED
 
 #include "timing.h"
 #include "ethernet.h"
 
-static char monitor_packet[1024];
+/* Graphite plaintext, "name value timestamp\n" a line, as many lines to a
+ * UDP packet as fit. Lines are written straight into the packet at
+ * monitor_len; the names are fixed strings, and the timestamp is only
+ * formatted again when it changes, so a line is a couple of memcpy()s and
+ * the value's digits.
+ *
+ * Most metrics don't need to reach the collector every second, so each is
+ * summed up over a window of its own ("monitor window"), aligned to
+ * multiples of the window in unix time and stamped with its start. The
+ * summary goes out with the first sample of the next window, or at the
+ * first flush after the window if no sample comes. A window of 1 sends
+ * every sample as it comes.
+ *
+ * "monitor format binary" sends the same lines in a fraction of the space,
+ * for host/telemetry_relay to turn back into Graphite lines:
+ *   header   MONITOR_BINARY_MAGIC, MONITOR_BINARY_VERSION, sequence number
+ *            (4 bytes LE, one more each packet), timestamp (4 bytes LE)
+ *   entries  key change, value: zigzag varints, 7 bits a byte, low first
+ * The key is (metric ID + 1) * 4 + suffix, sent as the change from the
+ * previous entry's key (from 0 at the start of the packet). Key 0 means
+ * the value is a change to the timestamp for the entries after it.
+ */
 
-void monitor_flush() {
+struct monitor_name_t {
+  const char *name;
+  unsigned char len;
+};
+
+struct monitor_info_t {
+  struct monitor_name_t name;
+  enum monitor_type_t type;
+};
+
+#define MONITOR_METRIC_NAME(id, name, type) { { MONITOR_PREFIX name, sizeof(MONITOR_PREFIX name) - 1 }, MONITOR_##type },
+static const struct monitor_info_t monitor_metrics[MONITOR_METRIC_COUNT] = {
+  MONITOR_METRICS(MONITOR_METRIC_NAME)
+};
+#undef MONITOR_METRIC_NAME
+
+static const struct monitor_name_t monitor_suffixes[] = {
+  [MONITOR_SUFFIX_NONE] = { "", 0 },
+  [MONITOR_SUFFIX_MIN]  = { ".min", 4 },
+  [MONITOR_SUFFIX_MAX]  = { ".max", 4 },
+  [MONITOR_SUFFIX_LAST] = { ".last", 5 },
+};
+
+#define MONITOR_SUFFIX_LEN 5
+#define MONITOR_INT_MAX 11 /* -2147483648 */
+#define MONITOR_ENTRY_MAX 20 /* Binary: a timestamp change and an entry */
+
+struct monitor_window_t {
+  unsigned short seconds;
+  int32_t start;           /* Of the window the samples are from */
+  uint32_t count;
+  int32_t min, max, last;
+  int64_t sum;
+};
+
+#define MONITOR_METRIC_WINDOW(id, name, type) { MONITOR_##type == MONITOR_SAMPLE ? 1 : MONITOR_WINDOW_SEC },
+static struct monitor_window_t monitor_windows[MONITOR_METRIC_COUNT] = {
+  MONITOR_METRICS(MONITOR_METRIC_WINDOW)
+};
+#undef MONITOR_METRIC_WINDOW
+
+#define MONITOR_PACKET_SIZE 1024
+
+/* Packets are filled on the PPS path and sent from monitor_poll() once
+ * the EMAC has nothing else queued, so NTP replies don't wait behind them
+ * and pll_run() doesn't wait on the network. The ring holds the packet
+ * being filled and up to MONITOR_BUFFERS - 1 waiting to go; when it's full,
+ * the packet just finished is dropped whole, and counted.
+ */
+static char monitor_packets[MONITOR_BUFFERS][MONITOR_PACKET_SIZE];
+static unsigned int monitor_packet_len[MONITOR_BUFFERS];
+static unsigned int monitor_head, monitor_tail; /* Filling, oldest waiting */
+static char *monitor_packet = monitor_packets[0];
+static unsigned int monitor_len;
+static uint32_t monitor_dropped; /* Since boot */
+static char monitor_stamp[MONITOR_INT_MAX + 2]; /* " timestamp\n" */
+static unsigned int monitor_stamp_len;
+static int32_t monitor_stamp_time;
+static char monitor_binary = MONITOR_BINARY;
+static uint32_t monitor_seq;
+static uint32_t monitor_key;       /* Binary: of the last entry */
+
+/* Queue the packet being filled for monitor_poll(), and start another */
+static void monitor_send_packet() {
+  if (monitor_len == 0)
+    return;
+
+  if (monitor_head - monitor_tail == MONITOR_BUFFERS - 1) {
+    monitor_dropped++;
+  } else {
+    monitor_packet_len[monitor_head % MONITOR_BUFFERS] = monitor_len;
+    monitor_head++;
+    monitor_packet = monitor_packets[monitor_head % MONITOR_BUFFERS];
+  }
+  monitor_len = 0;
+}
+
+/* Called from loop(). Sends the oldest waiting packet if the link's idle. */
+void monitor_poll() {
   const char ip[4] = {MONITOR_IP_ADDRESS};
   const char mac[6] = {MONITOR_MAC_ADDRESS};
 
-  size_t packet_size = strlen(monitor_packet);
-  if (packet_size == 0)
+  if (monitor_tail == monitor_head || !ethernet_tx_idle())
+    return;
+
+  unsigned int i = monitor_tail % MONITOR_BUFFERS;
+  if (!ethernet_send_udp_packet(ip, mac, MONITOR_PORT, MONITOR_PORT, monitor_packets[i], monitor_packet_len[i]))
+    monitor_dropped++;
+  monitor_tail++;
+}
+
+static char *monitor_put_int(char *p, int32_t value) {
+  char digits[10];
+  unsigned int n = 0;
+  uint32_t mag = value;
+
+  if (value < 0) {
+    *p++ = '-';
+    mag = -mag;
+  }
+  do {
+    digits[n++] = '0' + mag % 10;
+    mag /= 10;
+  } while (mag);
+  while (n)
+    *p++ = digits[--n];
+  return p;
+}
+
+static char *monitor_put_varint(char *p, int32_t value) {
+  uint32_t zz = (uint32_t)value << 1 ^ (uint32_t)(value >> 31);
+
+  while (zz >= 0x80) {
+    *p++ = zz | 0x80;
+    zz >>= 7;
+  }
+  *p++ = zz;
+  return p;
+}
+
+static char *monitor_put_le32(char *p, uint32_t value) {
+  for (int i = 0 ; i < 4 ; i++)
+    *p++ = value >> (8 * i);
+  return p;
+}
+
+static void monitor_put_binary(enum monitor_metric_t metric, enum monitor_suffix_t suffix, int32_t value, int32_t stamp) {
+  if (monitor_len + MONITOR_ENTRY_MAX > MONITOR_PACKET_SIZE)
+    monitor_send_packet();
+
+  char *p = monitor_packet + monitor_len;
+  if (monitor_len == 0) {
+    *p++ = MONITOR_BINARY_MAGIC;
+    *p++ = MONITOR_BINARY_VERSION;
+    p = monitor_put_le32(p, monitor_seq++);
+    p = monitor_put_le32(p, stamp);
+    monitor_stamp_time = stamp;
+    monitor_key = 0;
+  } else if (stamp != monitor_stamp_time) {
+    p = monitor_put_varint(p, -monitor_key);
+    p = monitor_put_varint(p, stamp - monitor_stamp_time);
+    monitor_stamp_time = stamp;
+    monitor_key = 0;
+  }
+
+  uint32_t key = (metric + 1) * 4 + suffix;
+  p = monitor_put_varint(p, key - monitor_key);
+  p = monitor_put_varint(p, value);
+  monitor_key = key;
+  monitor_len = p - monitor_packet;
+}
+
+static void monitor_put_line(enum monitor_metric_t metric, enum monitor_suffix_t suffix, int32_t value, int32_t stamp) {
+  if (monitor_binary) {
+    monitor_put_binary(metric, suffix, value, stamp);
+    return;
+  }
+
+  const struct monitor_name_t *name = &monitor_metrics[metric].name;
+  const struct monitor_name_t *sfx = &monitor_suffixes[suffix];
+
+  if (stamp != monitor_stamp_time || !monitor_stamp_len) {
+    char *p = monitor_stamp;
+    *p++ = ' ';
+    p = monitor_put_int(p, stamp);
+    *p++ = '\n';
+    monitor_stamp_len = p - monitor_stamp;
+    monitor_stamp_time = stamp;
+  }
+
+  if (monitor_len + name->len + MONITOR_SUFFIX_LEN + 1 + MONITOR_INT_MAX + monitor_stamp_len > MONITOR_PACKET_SIZE)
+    monitor_send_packet();
+
+  char *p = monitor_packet + monitor_len;
+  memcpy(p, name->name, name->len);
+  p += name->len;
+  memcpy(p, sfx->name, sfx->len);
+  p += sfx->len;
+  *p++ = ' ';
+  p = monitor_put_int(p, value);
+  memcpy(p, monitor_stamp, monitor_stamp_len);
+  p += monitor_stamp_len;
+  monitor_len = p - monitor_packet;
+}
+
+/* Send what the window has and start it over */
+static void monitor_summarize(enum monitor_metric_t metric) {
+  struct monitor_window_t *w = &monitor_windows[metric];
+
+  if (monitor_metrics[metric].type == MONITOR_COUNTER) {
+    monitor_put_line(metric, MONITOR_SUFFIX_NONE, w->sum, w->start);
+  } else {
+    monitor_put_line(metric, MONITOR_SUFFIX_NONE, w->sum / w->count, w->start);
+    monitor_put_line(metric, MONITOR_SUFFIX_MIN, w->min, w->start);
+    monitor_put_line(metric, MONITOR_SUFFIX_MAX, w->max, w->start);
+    monitor_put_line(metric, MONITOR_SUFFIX_LAST, w->last, w->start);
+  }
+  w->count = 0;
+}
+
+/* End of a second's metrics: send what's due and queue the packet */
+void monitor_flush() {
+  int32_t now = time_get_unix();
+
+  /* A total, so it's still right after a packet with it in is dropped */
+  if (monitor_dropped)
+    monitor_send(MONITOR_MONITOR_DROPPED, monitor_dropped);
+  for (unsigned int i = 0 ; i < MONITOR_METRIC_COUNT ; i++) {
+    struct monitor_window_t *w = &monitor_windows[i];
+    if (w->count && now - now % w->seconds != w->start)
+      monitor_summarize((enum monitor_metric_t)i);
+  }
+  monitor_send_packet();
+}
+
+/* Without the prefix, for debug output */
+const char *monitor_get_name(enum monitor_metric_t metric) {
+  return monitor_metrics[metric].name.name + sizeof(MONITOR_PREFIX) - 1;
+}
+
+void monitor_send(enum monitor_metric_t metric, int value) {
+  struct monitor_window_t *w = &monitor_windows[metric];
+  int32_t now = time_get_unix();
+
+  if (w->seconds <= 1) {
+    monitor_put_line(metric, MONITOR_SUFFIX_NONE, value, now);
     return;
+  }
 
-  ethernet_send_udp_packet(ip, mac, MONITOR_PORT, MONITOR_PORT, monitor_packet, packet_size);
-  monitor_packet[0] = '\0';
+  int32_t start = now - now % w->seconds;
+  if (w->count && start != w->start)
+    monitor_summarize(metric);
+  if (!w->count) {
+    w->start = start;
+    w->sum = 0;
+    w->min = w->max = value;
+  }
+  w->count++;
+  w->sum += value;
+  if (value < w->min)
+    w->min = value;
+  if (value > w->max)
+    w->max = value;
+  w->last = value;
 }
 
-static void monitor_append(const char *buf) {
-  if (strlen(buf) + strlen(monitor_packet) >= sizeof(monitor_packet)) {
-    monitor_flush();
+/* metric NULL for all of them. Whatever the old window had is dropped. */
+bool monitor_set_window(const char *metric, int seconds) {
+  bool found = false;
+
+  if (seconds < 1 || seconds > MONITOR_WINDOW_MAX)
+    return false;
+
+  for (unsigned int i = 0 ; i < MONITOR_METRIC_COUNT ; i++) {
+    if (metric && strcmp(metric, monitor_get_name((enum monitor_metric_t)i)))
+      continue;
+    monitor_windows[i].seconds = seconds;
+    monitor_windows[i].count = 0;
+    found = true;
   }
-  strcat(monitor_packet, buf);
+  return found;
+}
+
+static bool monitor_window_line(unsigned int *pos) {
+  unsigned int i = *pos;
+
+  if (i >= MONITOR_METRIC_COUNT)
+    return false;
+  (*pos)++;
+  Console.print(monitor_get_name((enum monitor_metric_t)i));
+  Console.print(" ");
+  Console.print(monitor_windows[i].seconds);
+  Console.println(monitor_metrics[i].type == MONITOR_COUNTER ? " sum" : "");
+  return true;
 }
 
-void monitor_send(const char *metric, int value) {
-  char buf[512] = MONITOR_PREFIX;
-  strcat(buf, metric);
-  strcat(buf, " ");
-  itoa(value, buf + strlen(buf), 10);
-  strcat(buf, " ");
-  itoa(time_get_unix(), buf + strlen(buf), 10);
-  strcat(buf, "\n");
-  monitor_append(buf);
+void monitor_print_windows() {
+  console_print_lines(monitor_window_line);
 }
 
-void monitor_sendf(const char *metric, float value) {
-  char buf[512] = MONITOR_PREFIX;
-  strcat(buf, metric);
-  strcat(buf, " ");
-  sprintf(buf + strlen(buf), "%f", value);
-  strcat(buf, " ");
-  itoa(time_get_unix(), buf + strlen(buf), 10);
-  strcat(buf, "\n");
-  monitor_append(buf);
+const char *monitor_get_format() {
+  return monitor_binary ? "binary" : "text";
+}
+
+bool monitor_set_format(const char *format) {
+  char binary;
+
+  if (!strcmp(format, "text"))
+    binary = 0;
+  else if (!strcmp(format, "binary"))
+    binary = 1;
+  else
+    return false;
+  /* Don't mix them in a packet */
+  monitor_send_packet();
+  monitor_binary = binary;
+  monitor_stamp_len = 0;
+  return true;
 }
 
 #else
 
-void monitor_send(const char *metric, int value) {
+#define MONITOR_METRIC_NAME(id, name, type) name,
+static const char *const monitor_names[MONITOR_METRIC_COUNT] = {
+  MONITOR_METRICS(MONITOR_METRIC_NAME)
+};
+#undef MONITOR_METRIC_NAME
+
+const char *monitor_get_name(enum monitor_metric_t metric) {
+  return monitor_names[metric];
+}
+
+void monitor_send(enum monitor_metric_t metric, int value) {
+  /* empty */
+}
+
+void monitor_flush() {
   /* empty */
 }
 
-void monitor_sendf(const char *metric, float value) {
+void monitor_poll() {
   /* empty */
 }
+
+bool monitor_set_window(const char *metric, int seconds) {
+  return false;
+}
+
+void monitor_print_windows() {
+  Console.println("disabled");
+}
+
+const char *monitor_get_format() {
+  return "disabled";
+}
+
+bool monitor_set_format(const char *format) {
+  return false;
+}
 #endif
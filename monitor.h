@@ -1,8 +1,118 @@
 #ifndef _MONITOR_H
 #define _MONITOR_H
 
-extern void monitor_send(const char *metric, int value);
-extern void monitor_sendf(const char *metric, float value);
+/* Every metric we send, as X(id, name, type). The name goes out with
+ * MONITOR_PREFIX in front, joined at compile time; callers only pass the
+ * MONITOR_<id>. Over an aggregation window a GAUGE is reduced to its mean
+ * (under the plain name) and .min, .max and .last; a COUNTER, a count since
+ * its last send, to the sum. A SAMPLE is already a summary (the hist.*
+ * percentiles, the prof.* means and maxes), so its window starts at 1 and
+ * it goes out as it comes.
+ */
+#define MONITOR_METRICS(X) \
+  X(PHASE, "phase", GAUGE) \
+  X(PHASE_RAW, "phase_raw", GAUGE) \
+  X(PHASE_FILTERED, "phase_filtered", GAUGE) \
+  X(SLEW, "slew", GAUGE) \
+  X(FLL, "fll", GAUGE) \
+  X(FLL_ACCUM, "fll_accum", GAUGE) \
+  X(FREQ, "freq", GAUGE) \
+  X(PLL_FACTOR, "pll_factor", GAUGE) \
+  X(FLL_FACTOR, "fll_factor", GAUGE) \
+  X(GEAR, "gear", GAUGE) \
+  X(GEAR_SHIFT, "gear_shift", GAUGE) \
+  X(DRIFT, "drift", GAUGE) \
+  X(DRIFT_SIGMA, "drift_sigma", GAUGE) \
+  X(DRIFT_RESIDUAL, "drift_residual", GAUGE) \
+  X(SAWTOOTH, "sawtooth", GAUGE) \
+  X(GPS_SATS_TRACKED, "gps.sats_tracked", GAUGE) \
+  X(GPS_SATS_USED, "gps.sats_used", GAUGE) \
+  X(GPS_CNO_MEAN, "gps.cno_mean", GAUGE) \
+  X(GPS_CNO_MIN, "gps.cno_min", GAUGE) \
+  X(GPS_CLOCK_BIAS, "gps.clock_bias", GAUGE) \
+  X(GPS_CLOCK_DRIFT, "gps.clock_drift", GAUGE) \
+  X(GPS_SURVEY, "gps.survey", GAUGE) \
+  X(GPS_SURVEY_ACC, "gps.survey_acc", GAUGE) \
+  X(GPS_CFG_FAILED, "gps.cfg_failed", GAUGE) \
+  X(GPS_NMEA_LATENCY, "gps.nmea_latency", GAUGE) \
+  X(RB_STATUS, "rb.status", GAUGE) \
+  X(RB_TEMP, "rb.temp", GAUGE) \
+  X(RB_LAMP, "rb.lamp", GAUGE) \
+  X(RB_HEATER, "rb.heater", GAUGE) \
+  X(RB_FREQ, "rb.freq", GAUGE) \
+  X(RB_FREQ_MISMATCH, "rb.freq_mismatch", GAUGE) \
+  X(RB_FREQ_LATENCY, "rb.freq_latency", GAUGE) \
+  X(RB_CMD_DROPPED, "rb.cmd_dropped", COUNTER) \
+  X(RB_MISSED, "rb.missed", GAUGE) \
+  X(NTP_INVALID, "ntp.invalid", COUNTER) \
+  X(NTP_WRONGVERSION, "ntp.wrongversion", COUNTER) \
+  X(NTP_WRONGMODE, "ntp.wrongmode", COUNTER) \
+  X(NTP_ERROR, "ntp.error", COUNTER) \
+  X(NTP_OK, "ntp.ok", COUNTER) \
+  X(MONITOR_DROPPED, "monitor.dropped", GAUGE) \
+  X(HIST_PHASE_P50, "hist.phase.p50", SAMPLE) \
+  X(HIST_PHASE_P99, "hist.phase.p99", SAMPLE) \
+  X(HIST_PHASE_P999, "hist.phase.p999", SAMPLE) \
+  X(HIST_PHASE_MAX, "hist.phase.max", SAMPLE) \
+  X(HIST_PHASE_FILTERED_P50, "hist.phase_filtered.p50", SAMPLE) \
+  X(HIST_PHASE_FILTERED_P99, "hist.phase_filtered.p99", SAMPLE) \
+  X(HIST_PHASE_FILTERED_P999, "hist.phase_filtered.p999", SAMPLE) \
+  X(HIST_PHASE_FILTERED_MAX, "hist.phase_filtered.max", SAMPLE) \
+  X(HIST_NTP_P50, "hist.ntp.p50", SAMPLE) \
+  X(HIST_NTP_P99, "hist.ntp.p99", SAMPLE) \
+  X(HIST_NTP_P999, "hist.ntp.p999", SAMPLE) \
+  X(HIST_NTP_MAX, "hist.ntp.max", SAMPLE) \
+  X(HIST_PPS_IRQ_P50, "hist.pps_irq.p50", SAMPLE) \
+  X(HIST_PPS_IRQ_P99, "hist.pps_irq.p99", SAMPLE) \
+  X(HIST_PPS_IRQ_P999, "hist.pps_irq.p999", SAMPLE) \
+  X(HIST_PPS_IRQ_MAX, "hist.pps_irq.max", SAMPLE) \
+  X(PROF_NTP_REQUEST_MEAN, "prof.ntp_request.mean", SAMPLE) \
+  X(PROF_NTP_REQUEST_MAX, "prof.ntp_request.max", SAMPLE) \
+  X(PROF_PLL_RUN_MEAN, "prof.pll_run.mean", SAMPLE) \
+  X(PROF_PLL_RUN_MAX, "prof.pll_run.max", SAMPLE) \
+  X(PROF_GPS_POLL_MEAN, "prof.gps_poll.mean", SAMPLE) \
+  X(PROF_GPS_POLL_MAX, "prof.gps_poll.max", SAMPLE) \
+  X(PROF_TC1_HANDLER_MEAN, "prof.tc1_handler.mean", SAMPLE) \
+  X(PROF_TC1_HANDLER_MAX, "prof.tc1_handler.max", SAMPLE) \
+  X(PROF_IRQ_MASKED_MEAN, "prof.irq_masked.mean", SAMPLE) \
+  X(PROF_IRQ_MASKED_MAX, "prof.irq_masked.max", SAMPLE)
+
+enum monitor_type_t {
+  MONITOR_GAUGE,
+  MONITOR_COUNTER,
+  MONITOR_SAMPLE,
+};
+
+#define MONITOR_METRIC_ID(id, name, type) MONITOR_##id,
+enum monitor_metric_t {
+  MONITOR_METRICS(MONITOR_METRIC_ID)
+  MONITOR_METRIC_COUNT
+};
+#undef MONITOR_METRIC_ID
+
+/* What a line is, for windowed metrics (see monitor.cpp) */
+enum monitor_suffix_t {
+  MONITOR_SUFFIX_NONE, /* Sample, mean or sum */
+  MONITOR_SUFFIX_MIN,
+  MONITOR_SUFFIX_MAX,
+  MONITOR_SUFFIX_LAST,
+};
+
+/* Binary packets, "monitor format binary"; host/telemetry_relay reads them.
+ * The metric IDs are the order of MONITOR_METRICS, so the relay has to be
+ * built from the same monitor.h as the firmware.
+ */
+#define MONITOR_BINARY_MAGIC 0xD7
+#define MONITOR_BINARY_VERSION 1
+#define MONITOR_BINARY_HEADER 10
+
+extern void monitor_send(enum monitor_metric_t metric, int value);
 extern void monitor_flush();
+extern void monitor_poll();
+extern const char *monitor_get_name(enum monitor_metric_t metric);
+extern bool monitor_set_window(const char *metric, int seconds);
+extern void monitor_print_windows();
+extern const char *monitor_get_format();
+extern bool monitor_set_format(const char *format);
 
 #endif
@@ -0,0 +1,198 @@
+#include "config.h"
+#include "console.h"
+#include "prof.h"
+
+#if PROF_ENABLED
+
+#include "timing.h"
+#include "monitor.h"
+
+/* Cycle counts for the hot paths: count, min, max and sum for each. On the
+ * Due they come from the DWT's CYCCNT, at the core clock; a host build
+ * counts with rdtsc (or clock_gettime, as ns), so the benchmarks there give
+ * numbers that go side by side with the board's.
+ *
+ * Recording is a call, two compares and two adds, and a site that's
+ * compiled out (PROF_ENABLED 0) is nothing at all. No probe is written from
+ * two contexts at once: TC1_Handler's is written in the interrupt, the
+ * critical sections' with interrupts still masked, and the rest in the
+ * loop. So the loop only has to mask interrupts for the moment it takes an
+ * interval's stats.
+ *
+ * Like the histograms, an interval is HIST_REPORT_SEC, aligned to unix
+ * time; its mean and max go to the monitor, in ns, as prof.<name>.*, and
+ * it's added to the totals that "prof" shows.
+ */
+
+struct prof_t {
+  const char *name;
+  enum monitor_metric_t metric;  /* .mean, then .max */
+  struct prof_stats_t interval;  /* From the writer */
+  struct prof_stats_t total;     /* Since reset, loop only */
+};
+
+static struct prof_t profs[PROF_COUNT] = {
+  [PROF_NTP_REQUEST] = { "ntp_request", MONITOR_PROF_NTP_REQUEST_MEAN },
+  [PROF_PLL_RUN] = { "pll_run", MONITOR_PROF_PLL_RUN_MEAN },
+  [PROF_GPS_POLL] = { "gps_poll", MONITOR_PROF_GPS_POLL_MEAN },
+  [PROF_TC1_HANDLER] = { "tc1_handler", MONITOR_PROF_TC1_HANDLER_MEAN },
+  [PROF_IRQ_MASKED] = { "irq_masked", MONITOR_PROF_IRQ_MASKED_MEAN },
+};
+
+static uint32_t prof_hz;
+static int32_t prof_start;
+
+/* From setup(), or a host tool's main() */
+void prof_init() {
+#if defined(__arm__)
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CYCCNT = 0;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+  prof_hz = SystemCoreClock;
+#elif defined(__x86_64__) || defined(__i386__)
+  /* The TSC's rate, against the clock over 10ms */
+  struct timespec from, to;
+  clock_gettime(CLOCK_MONOTONIC, &from);
+  uint32_t start = prof_cycles();
+  do {
+    clock_gettime(CLOCK_MONOTONIC, &to);
+  } while ((to.tv_sec - from.tv_sec) * 1000000000LL + to.tv_nsec - from.tv_nsec < 10000000);
+  uint32_t cycles = prof_cycles() - start;
+  prof_hz = (uint64_t)cycles * 1000000000LL / ((to.tv_sec - from.tv_sec) * 1000000000LL + to.tv_nsec - from.tv_nsec);
+#else
+  prof_hz = 1000000000UL;
+#endif
+}
+
+void prof_record(enum prof_id_t id, uint32_t cycles) {
+  struct prof_stats_t *s = &profs[id].interval;
+
+  if (!s->count || cycles < s->min)
+    s->min = cycles;
+  if (cycles > s->max)
+    s->max = cycles;
+  s->count++;
+  s->sum += cycles;
+}
+
+uint32_t prof_ns(uint32_t cycles) {
+  if (!prof_hz)
+    return 0;
+  return (uint64_t)cycles * 1000000000LL / prof_hz;
+}
+
+static void prof_add(struct prof_stats_t *to, const struct prof_stats_t *from) {
+  if (!from->count)
+    return;
+  if (!to->count || from->min < to->min)
+    to->min = from->min;
+  if (from->max > to->max)
+    to->max = from->max;
+  to->count += from->count;
+  to->sum += from->sum;
+}
+
+/* Once a second, from loop() */
+void prof_report() {
+  int32_t now = time_get_unix();
+  int32_t start = now - now % HIST_REPORT_SEC;
+
+  if (start == prof_start)
+    return;
+  prof_start = start;
+
+  for (unsigned int i = 0 ; i < PROF_COUNT ; i++) {
+    struct prof_t *p = &profs[i];
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    struct prof_stats_t s = p->interval;
+    memset(&p->interval, 0, sizeof(p->interval));
+    __set_PRIMASK(primask);
+
+    if (!s.count)
+      continue;
+    prof_add(&p->total, &s);
+    monitor_send(p->metric, prof_ns(s.sum / s.count));
+    monitor_send((enum monitor_metric_t)(p->metric + 1), prof_ns(s.max));
+  }
+}
+
+/* Totals since reset, one line a probe */
+void prof_print_summary() {
+  for (unsigned int i = 0 ; i < PROF_COUNT ; i++) {
+    const struct prof_stats_t *s = &profs[i].total;
+
+    Console.print(profs[i].name);
+    Console.print(": ");
+    Console.print(s->count);
+    if (s->count) {
+      uint32_t mean = s->sum / s->count;
+      Console.print(" min ");
+      Console.print(s->min);
+      Console.print(" mean ");
+      Console.print(mean);
+      Console.print(" max ");
+      Console.print(s->max);
+      Console.print(" cycles, mean ");
+      Console.print(prof_ns(mean));
+      Console.print(" max ");
+      Console.print(prof_ns(s->max));
+      Console.print(" ns");
+    }
+    Console.print("\r\n");
+  }
+}
+
+void prof_reset() {
+  for (unsigned int i = 0 ; i < PROF_COUNT ; i++) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    memset(&profs[i].interval, 0, sizeof(profs[i].interval));
+    __set_PRIMASK(primask);
+    memset(&profs[i].total, 0, sizeof(profs[i].total));
+  }
+}
+
+/* The totals, and what's built up since the last report */
+bool prof_get(enum prof_id_t id, struct prof_stats_t *stats) {
+  *stats = profs[id].total;
+  prof_add(stats, &profs[id].interval);
+  return stats->count != 0;
+}
+
+const char *prof_get_name(enum prof_id_t id) {
+  return profs[id].name;
+}
+
+#else
+
+void prof_init() {
+  /* empty */
+}
+
+void prof_report() {
+  /* empty */
+}
+
+void prof_print_summary() {
+  Console.println("disabled");
+}
+
+void prof_reset() {
+  /* empty */
+}
+
+bool prof_get(enum prof_id_t id, struct prof_stats_t *stats) {
+  memset(stats, 0, sizeof(*stats));
+  return false;
+}
+
+const char *prof_get_name(enum prof_id_t id) {
+  return "";
+}
+
+uint32_t prof_ns(uint32_t cycles) {
+  return 0;
+}
+
+#endif
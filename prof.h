@@ -0,0 +1,72 @@
+#ifndef __PROF_H
+#define __PROF_H
+
+/* Where the cycles go (see prof.cpp). Around each:
+ *   uint32_t start = prof_cycles();
+ *   ...
+ *   prof_end(PROF_..., start);
+ */
+enum prof_id_t {
+  PROF_NTP_REQUEST, /* do_ntp_request() */
+  PROF_PLL_RUN,     /* pll_run() */
+  PROF_GPS_POLL,    /* gps_poll() */
+  PROF_TC1_HANDLER, /* TC1_Handler() */
+  PROF_IRQ_MASKED,  /* Interrupts masked, in a critical section */
+  PROF_COUNT
+};
+
+struct prof_stats_t {
+  uint32_t count;
+  uint32_t min, max; /* Cycles */
+  uint64_t sum;
+};
+
+#if PROF_ENABLED
+
+#if defined(__arm__)
+/* The Cortex-M3's DWT cycle counter, started by prof_init() */
+static inline uint32_t prof_cycles() {
+  return DWT->CYCCNT;
+}
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#include <time.h> /* For prof_init() */
+static inline uint32_t prof_cycles() {
+  return __rdtsc();
+}
+#else
+#include <time.h>
+static inline uint32_t prof_cycles() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+#endif
+
+extern void prof_record(enum prof_id_t id, uint32_t cycles);
+
+static inline void prof_end(enum prof_id_t id, uint32_t start) {
+  prof_record(id, prof_cycles() - start);
+}
+
+#else
+
+static inline uint32_t prof_cycles() {
+  return 0;
+}
+
+static inline void prof_end(enum prof_id_t id, uint32_t start) {
+  /* empty */
+}
+
+#endif
+
+extern void prof_init();
+extern void prof_report();
+extern void prof_print_summary();
+extern void prof_reset();
+extern bool prof_get(enum prof_id_t id, struct prof_stats_t *stats);
+extern const char *prof_get_name(enum prof_id_t id);
+extern uint32_t prof_ns(uint32_t cycles);
+
+#endif
@@ -1,18 +1,172 @@
+#define LOG_SUBSYSTEM LOG_RB /* For debug.h */
 #include "config.h"
 #include "debug.h"
 #include "health.h"
+#include "monitor.h"
+#include "capture.h"
+#include "prof.h"
 
 static int32_t rb_ppt = 0;
 static char rb_divisor = 3;
 
+enum rb_query_t {
+  RB_QUERY_STATUS,
+  RB_QUERY_TEMP,
+  RB_QUERY_LAMP,
+  RB_QUERY_HEATER,
+  RB_QUERY_FREQ,
+  RB_QUERIES
+};
+
+static const struct {
+  const char *cmd;
+  enum monitor_metric_t metric;
+} rb_queries[RB_QUERIES] = {
+  [RB_QUERY_STATUS] = { RB_CMD_STATUS, MONITOR_RB_STATUS },
+  [RB_QUERY_TEMP]   = { RB_CMD_TEMP,   MONITOR_RB_TEMP },
+  [RB_QUERY_LAMP]   = { RB_CMD_LAMP,   MONITOR_RB_LAMP },
+  [RB_QUERY_HEATER] = { RB_CMD_HEATER, MONITOR_RB_HEATER },
+  [RB_QUERY_FREQ]   = { RB_CMD_FREQ,   MONITOR_RB_FREQ },
+};
+
+static int32_t rb_telemetry[RB_QUERIES];
+static unsigned char rb_fresh;  /* Bit per query: answered this round */
+static unsigned char rb_faults; /* Bit per query: reading out of range */
+static char rb_line[64];
+static unsigned char rb_line_len = 0;
+static int rb_query = -1; /* Query awaiting a reply, or -1 */
+static unsigned long rb_query_sent;
+static int rb_resume = -1; /* After a missed reply: the query to go on with */
+static unsigned long rb_next_poll;
+static int32_t rb_ppt_queried;
+static unsigned char rb_missed = 0;
+static char rb_alarm = 0;
+
 void rb_update_health();
 void rb_enable();
+static void rb_write_frequency();
+
+/* Commands to the Rb go through a small fixed queue, and are sent by the
+ * USART's PDC so nobody waits on the serial port. Commands are formatted
+ * in place; nothing is allocated. A frequency command that hasn't started
+ * sending yet is replaced by a newer one instead of queueing both.
+ *
+ * The Arduino core owns the USART interrupt, so completion is noticed by
+ * rb_cmd_service(), called on every enqueue and from rb_poll().
+ */
+#define RB_CMD_SIZE 16
+#define RB_CMD_QUEUE 8
+
+enum rb_cmd_type_t {
+  RB_CMD_OTHER,
+  RB_CMD_FREQUENCY
+};
+
+struct rb_cmd_t {
+  char buf[RB_CMD_SIZE];
+  unsigned char len;
+  unsigned char type;
+  uint32_t queued; /* micros() */
+};
+
+static struct rb_cmd_t rb_cmd_queue[RB_CMD_QUEUE];
+static unsigned char rb_cmd_head = 0; /* Oldest, possibly being sent */
+static unsigned char rb_cmd_tail = 0; /* Next free */
+static char rb_cmd_busy = 0;
+static unsigned int rb_cmd_dropped = 0;
+static volatile uint32_t rb_freq_done = 0;
+static volatile int32_t rb_freq_latency = -1;
+
+/* Call with interrupts disabled */
+static void rb_cmd_service() {
+  if (rb_cmd_busy) {
+    if (RB_USART->US_TCR || !(RB_USART->US_CSR & US_CSR_TXEMPTY))
+      return;
+    struct rb_cmd_t *cmd = &rb_cmd_queue[rb_cmd_head];
+    if (cmd->type == RB_CMD_FREQUENCY) {
+      rb_freq_done = micros();
+      rb_freq_latency = rb_freq_done - cmd->queued;
+    }
+    rb_cmd_head = (rb_cmd_head + 1) % RB_CMD_QUEUE;
+    rb_cmd_busy = 0;
+  }
+
+  if (rb_cmd_head != rb_cmd_tail) {
+    struct rb_cmd_t *cmd = &rb_cmd_queue[rb_cmd_head];
+    RB_USART->US_TPR = (uintptr_t)cmd->buf;
+    RB_USART->US_TCR = cmd->len;
+    RB_USART->US_PTCR = US_PTCR_TXTEN;
+    rb_cmd_busy = 1;
+  }
+}
+
+static void rb_queue_cmd(enum rb_cmd_type_t type, const char *buf, unsigned int len) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  uint32_t masked = prof_cycles();
+
+  struct rb_cmd_t *cmd = NULL;
+
+  if (type == RB_CMD_FREQUENCY) {
+    for (unsigned char i = rb_cmd_busy ? (rb_cmd_head + 1) % RB_CMD_QUEUE : rb_cmd_head ;
+        i != rb_cmd_tail ; i = (i + 1) % RB_CMD_QUEUE) {
+      if (rb_cmd_queue[i].type == RB_CMD_FREQUENCY) {
+        cmd = &rb_cmd_queue[i];
+        break;
+      }
+    }
+  }
+
+  if (!cmd) {
+    unsigned char next = (rb_cmd_tail + 1) % RB_CMD_QUEUE;
+    if (next == rb_cmd_head) {
+      rb_cmd_dropped++;
+      if (!primask)
+        prof_end(PROF_IRQ_MASKED, masked);
+      __set_PRIMASK(primask);
+      return;
+    }
+    cmd = &rb_cmd_queue[rb_cmd_tail];
+    rb_cmd_tail = next;
+  }
+
+  memcpy(cmd->buf, buf, len);
+  cmd->len = len;
+  cmd->type = type;
+  cmd->queued = micros();
+  capture_rb(buf, len);
+
+  rb_cmd_service();
+  if (!primask)
+    prof_end(PROF_IRQ_MASKED, masked);
+  __set_PRIMASK(primask);
+}
+
+static void rb_queue_str(const char *str) {
+  rb_queue_cmd(RB_CMD_OTHER, str, strlen(str));
+}
+
+/* Unsigned decimal, returns the end */
+static char *rb_format_uint(char *p, uint32_t val) {
+  char tmp[10];
+  int n = 0;
+  do {
+    tmp[n++] = '0' + val % 10;
+    val /= 10;
+  } while (val);
+  while (n)
+    *p++ = tmp[--n];
+  return p;
+}
 
 void rb_write_divisor() {
-  String buf = "o";
-  buf += String(rb_divisor, DEC);
-  buf += "\r\n";
-  Rb.print(buf);
+  char buf[RB_CMD_SIZE];
+  char *p = buf;
+  *p++ = 'o';
+  p = rb_format_uint(p, rb_divisor);
+  *p++ = '\r';
+  *p++ = '\n';
+  rb_queue_cmd(RB_CMD_OTHER, buf, p - buf);
 }
 
 static void rb_10mhz() {
@@ -26,12 +180,22 @@ static void rb_30mhz() {
 }
 
 void rb_init() {
+  /* begin() stops the PDC, so anything in flight is lost */
+  rb_cmd_head = rb_cmd_tail = 0;
+  rb_cmd_busy = 0;
+  RB_USART->US_TCR = 0;
   Rb.begin(57600);
-  Rb.print("a0\r\n"); /* Disable analog frequency control */
-  Rb.print("f0\r\n"); /* Zero frequency offset */
+  rb_queue_str("a0\r\n"); /* Disable analog frequency control */
+  rb_queue_str("f0\r\n"); /* Zero frequency offset */
   rb_30mhz();
   rb_enable();
   rb_ppt = 0;
+  rb_query = -1;
+  rb_resume = -1;
+  rb_missed = 0;
+  rb_alarm = 0;
+  rb_fresh = rb_faults = 0;
+  rb_next_poll = millis();
   pinMode(53, INPUT);
   attachInterrupt(53, rb_update_health, CHANGE);
   rb_update_health();
@@ -46,37 +210,261 @@ int32_t rb_set_frequency(int32_t ppt) {
   else if (ppt < rb_ppt - 2000)
     ppt = rb_ppt - 2000;
 
-  int32_t tens = ppt / 10;
-  int32_t tenths = ppt % 10;
-  if (tenths < 0)
-    tenths = -tenths;
+  rb_ppt = ppt;
+  rb_write_frequency();
+  return rb_ppt;
+}
+
+/* As saved before a reboot: all at once, not a step at a time */
+int32_t rb_restore_frequency(int32_t ppt) {
+  rb_ppt = ppt;
+  rb_write_frequency();
+  return rb_ppt;
+}
 
-  String buf = "f";
-  buf += String(tens, DEC);
-  if (tenths) {
-    buf += ".";
-    buf += String(tenths, DEC);
+/* The f command takes units of 10ppt, with one decimal place */
+static void rb_write_frequency() {
+  char buf[RB_CMD_SIZE];
+  char *p = buf;
+  uint32_t mag = rb_ppt < 0 ? -rb_ppt : rb_ppt;
+
+  *p++ = 'f';
+  if (rb_ppt < 0)
+    *p++ = '-';
+  p = rb_format_uint(p, mag / 10);
+  if (mag % 10) {
+    *p++ = '.';
+    *p++ = '0' + mag % 10;
   }
-  buf += "\r\n";
-  Rb.print(buf);
+  *p++ = '\r';
+  *p++ = '\n';
+  rb_queue_cmd(RB_CMD_FREQUENCY, buf, p - buf);
+}
 
-  rb_ppt = ppt;
+int32_t rb_get_frequency() {
   return rb_ppt;
 }
 
+/* micros() at which the last frequency change finished going out */
+uint32_t rb_get_frequency_time() {
+  return rb_freq_done;
+}
+
 void rb_update_health() {
   int lock = digitalRead(53);
   if (lock) { /* High = unlocked */
     health_set_rb_status(RB_UNLOCK);
+  } else if (rb_alarm) {
+    health_set_rb_status(RB_MINOR_ALARM);
   } else {
     health_set_rb_status(RB_OK);
   }
 }
 
+/* Parse the last number on the line, in tenths */
+static bool rb_parse_tenths(const char *line, int32_t *dest) {
+  const char *p = line + strlen(line);
+  while (p > line && !isdigit(p[-1]))
+    p--;
+  if (p == line)
+    return false;
+  while (p > line && (isdigit(p[-1]) || p[-1] == '.'))
+    p--;
+  bool neg = p > line && p[-1] == '-';
+
+  int32_t val = 0;
+  int frac = -1;
+  for ( ; isdigit(*p) || *p == '.' ; p++) {
+    if (*p == '.') {
+      if (frac >= 0)
+        break;
+      frac = 0;
+    } else if (frac < 1) {
+      val = val * 10 + (*p - '0');
+      if (frac == 0)
+        frac = 1;
+    }
+  }
+  if (frac < 1)
+    val *= 10;
+
+  *dest = neg ? -val : val;
+  return true;
+}
+
+/* Whether a query was answered this round, and if so, whether the reading
+ * is out of range. One that wasn't answered keeps its last verdict.
+ */
+static void rb_check_reading(enum rb_query_t query, bool bad, const char *what) {
+  if (!(rb_fresh & 1 << query))
+    return;
+  if (bad) {
+    debug("Rb: "); debug(what); debug(": "); debug(rb_telemetry[query]); debug("\r\n");
+    rb_faults |= 1 << query;
+  } else {
+    rb_faults &= ~(1 << query);
+  }
+}
+
+/* Look for early signs of trouble at the end of a round of queries, in the
+ * readings that came back in it
+ */
+static void rb_check_telemetry() {
+  rb_check_reading(RB_QUERY_LAMP, rb_telemetry[RB_QUERY_LAMP] < RB_LAMP_MIN, "lamp low");
+  rb_check_reading(RB_QUERY_HEATER, rb_telemetry[RB_QUERY_HEATER] > RB_HEATER_MAX, "heater high");
+  rb_check_reading(RB_QUERY_TEMP, rb_telemetry[RB_QUERY_TEMP] > RB_TEMP_MAX, "temperature high");
+
+  char alarm = rb_missed >= RB_MAX_MISSED || rb_faults;
+
+  /* The offset is reported in the same units as we set it (10ppt), so
+   * in tenths it's in ppt.
+   */
+  if (rb_fresh & 1 << RB_QUERY_FREQ) {
+    if (rb_telemetry[RB_QUERY_FREQ] != rb_ppt_queried) {
+      debug("Rb: frequency offset is "); debug(rb_telemetry[RB_QUERY_FREQ]);
+      debug(", expected "); debug(rb_ppt_queried); debug(", rewriting\r\n");
+      monitor_send(MONITOR_RB_FREQ_MISMATCH, rb_telemetry[RB_QUERY_FREQ] - rb_ppt_queried);
+      rb_write_frequency();
+    }
+  }
+
+  if (alarm != rb_alarm) {
+    rb_alarm = alarm;
+    rb_update_health();
+  }
+}
+
+static void rb_send_query(int query) {
+  if (query == 0)
+    rb_fresh = 0;
+  rb_query = query;
+  rb_query_sent = millis();
+  if (query == RB_QUERY_FREQ)
+    rb_ppt_queried = rb_ppt;
+  rb_queue_str(rb_queries[query].cmd);
+}
+
+static void rb_continue(int query) {
+  if (query < RB_QUERIES) {
+    rb_send_query(query);
+  } else {
+    rb_query = -1;
+    rb_check_telemetry();
+  }
+}
+
+static void rb_next_query() {
+  rb_continue(rb_query + 1);
+}
+
+/* A line that's one of our own commands coming back */
+static bool rb_is_echo(const char *line) {
+  unsigned int len = strlen(line);
+
+  for (unsigned int i = 0 ; i < RB_CMD_QUEUE ; i++) {
+    const struct rb_cmd_t *cmd = &rb_cmd_queue[i];
+    unsigned int cmd_len = cmd->len;
+    while (cmd_len && (cmd->buf[cmd_len - 1] == '\r' || cmd->buf[cmd_len - 1] == '\n'))
+      cmd_len--;
+    if (cmd_len == len && !memcmp(cmd->buf, line, len))
+      return true;
+  }
+  return false;
+}
+
+static void rb_handle_line() {
+  int32_t val;
+
+  /* Anything that isn't a reply to our query gets ignored: lines with no
+   * number in them, and echoes of what we sent, which may have one (an f
+   * command). Only the first reply after a query counts for it.
+   */
+  if (rb_query < 0 || rb_is_echo(rb_line) || !rb_parse_tenths(rb_line, &val))
+    return;
+
+  rb_telemetry[rb_query] = val;
+  rb_fresh |= 1 << rb_query;
+  monitor_send(rb_queries[rb_query].metric, val);
+  if (rb_missed >= RB_MAX_MISSED) {
+    debug("Rb: responding again\r\n");
+  }
+  rb_missed = 0;
+  rb_next_query();
+}
+
+/* Called from loop(). Reads whatever the Rb has sent without blocking,
+ * and walks through the telemetry queries one at a time.
+ */
+void rb_poll() {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  uint32_t masked = prof_cycles();
+  rb_cmd_service();
+  int32_t latency = rb_freq_latency;
+  rb_freq_latency = -1;
+  if (!primask)
+    prof_end(PROF_IRQ_MASKED, masked);
+  __set_PRIMASK(primask);
+
+  if (latency >= 0)
+    monitor_send(MONITOR_RB_FREQ_LATENCY, latency);
+  if (rb_cmd_dropped) {
+    debug("Rb: dropped "); debug(rb_cmd_dropped); debug(" commands\r\n");
+    monitor_send(MONITOR_RB_CMD_DROPPED, rb_cmd_dropped);
+    rb_cmd_dropped = 0;
+  }
+
+  while (Rb.available()) {
+    char ch = Rb.read();
+    if (ch == '\r' || ch == '\n') {
+      if (rb_line_len) {
+        rb_line[rb_line_len] = '\0';
+        rb_handle_line();
+        rb_line_len = 0;
+      }
+    } else if (rb_line_len < sizeof(rb_line) - 1) {
+      rb_line[rb_line_len++] = ch;
+    }
+  }
+
+  unsigned long now = millis();
+
+  if (rb_query >= 0 && now - rb_query_sent > RB_REPLY_TIMEOUT_MS) {
+    debug("Rb: no reply to "); debug(monitor_get_name(rb_queries[rb_query].metric)); debug("\r\n");
+    if (rb_missed < RB_MAX_MISSED && ++rb_missed == RB_MAX_MISSED) {
+      debug("Rb: not responding\r\n");
+    }
+    monitor_send(MONITOR_RB_MISSED, rb_missed);
+    if (rb_missed >= RB_MAX_MISSED) {
+      /* Don't bother with the rest of the set */
+      rb_query = -1;
+      rb_check_telemetry();
+    } else {
+      /* Give a late reply time to come and be ignored, rather than have
+       * it taken for the answer to the next query.
+       */
+      rb_resume = rb_query + 1;
+      rb_query = -1;
+      rb_query_sent = now;
+    }
+  }
+
+  if (rb_resume >= 0 && now - rb_query_sent > RB_REPLY_TIMEOUT_MS) {
+    int query = rb_resume;
+    rb_resume = -1;
+    rb_continue(query);
+  }
+
+  if (rb_query < 0 && rb_resume < 0 && (long)(now - rb_next_poll) >= 0) {
+    rb_next_poll = now + RB_QUERY_INTERVAL_MS;
+    rb_send_query(0);
+  }
+}
+
 void rb_enable() {
-  Rb.print("q0044\r\n");
+  rb_queue_str("q0044\r\n");
 }
 
 void rb_disable() {
-  Rb.print("q0054\r\n");
+  rb_queue_str("q0054\r\n");
 }
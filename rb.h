@@ -3,8 +3,12 @@
 
 extern void rb_init();
 extern int32_t rb_set_frequency(int32_t ppb);
+extern int32_t rb_restore_frequency(int32_t ppt);
+extern int32_t rb_get_frequency();
+extern uint32_t rb_get_frequency_time();
 extern void rb_enable();
 extern void rb_disable();
 extern void rb_write_divisor();
+extern void rb_poll();
 
 #endif
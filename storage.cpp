@@ -0,0 +1,138 @@
+#define LOG_SUBSYSTEM LOG_SYSTEM /* For debug.h */
+#include "config.h"
+#include "debug.h"
+#include "storage.h"
+
+/* Small records kept in the top of flash bank 1. The sketch runs out of
+ * bank 0, so we can program bank 1 without stalling ourselves, as long as
+ * the sketch stays under 256KB.
+ *
+ * Each slot owns STORAGE_PAGES_PER_SLOT pages, and every write goes to the
+ * next page in the ring, so a slot written once an hour takes decades to
+ * wear out. On read, the valid page with the highest sequence number wins.
+ * Slots are laid out downward from the top of the bank, so adding one
+ * doesn't move the ones already in use.
+ */
+
+#define STORAGE_MAGIC 0xD0E7
+#define STORAGE_PAGE_WORDS (IFLASH1_PAGE_SIZE / 4)
+#define STORAGE_SLOT_PAGE(slot) (IFLASH1_SIZE / IFLASH1_PAGE_SIZE - ((slot) + 1) * STORAGE_PAGES_PER_SLOT)
+#define EFC_FCMD_EWP 0x03 /* Erase and write page */
+
+struct storage_header_t {
+  uint16_t magic;
+  uint8_t slot;
+  uint8_t len;
+  uint32_t seq;
+  uint32_t crc;
+};
+
+#define STORAGE_MAX_LEN (IFLASH1_PAGE_SIZE - sizeof(struct storage_header_t))
+
+static char slot_scanned[STORAGE_SLOTS];
+static unsigned char slot_page[STORAGE_SLOTS];
+static uint32_t slot_seq[STORAGE_SLOTS];
+
+static uint32_t crc32(uint32_t crc, const unsigned char *data, unsigned int len) {
+  crc = ~crc;
+  while (len--) {
+    crc ^= *data++;
+    for (int i = 0 ; i < 8 ; i++)
+      crc = (crc >> 1) ^ (0xEDB88320UL & -(crc & 1));
+  }
+  return ~crc;
+}
+
+static uint32_t storage_crc(const struct storage_header_t *hdr, const void *data) {
+  uint32_t crc = crc32(0, (const unsigned char *)&hdr->seq, sizeof(hdr->seq));
+  crc = crc32(crc, &hdr->slot, 1);
+  crc = crc32(crc, &hdr->len, 1);
+  return crc32(crc, (const unsigned char *)data, hdr->len);
+}
+
+static inline const unsigned char *storage_page_addr(enum storage_slot_t slot, unsigned int page) {
+  return (const unsigned char *)(IFLASH1_ADDR + (STORAGE_SLOT_PAGE(slot) + page) * IFLASH1_PAGE_SIZE);
+}
+
+static void storage_wait_ready() {
+  while (!(EFC1->EEFC_FSR & EEFC_FSR_FRDY));
+}
+
+/* Find the newest valid record in the slot. Returns its page, or -1. */
+static int storage_scan(enum storage_slot_t slot, unsigned int len) {
+  int newest = -1;
+
+  storage_wait_ready();
+  for (unsigned int page = 0 ; page < STORAGE_PAGES_PER_SLOT ; page++) {
+    const unsigned char *addr = storage_page_addr(slot, page);
+    const struct storage_header_t *hdr = (const struct storage_header_t *)addr;
+    if (hdr->magic != STORAGE_MAGIC || hdr->slot != slot || hdr->len != len)
+      continue;
+    if (hdr->crc != storage_crc(hdr, addr + sizeof(*hdr)))
+      continue;
+    if (newest < 0 || (int32_t)(hdr->seq - slot_seq[slot]) > 0) {
+      newest = page;
+      slot_seq[slot] = hdr->seq;
+    }
+  }
+
+  if (newest >= 0) {
+    slot_page[slot] = newest;
+  } else {
+    slot_page[slot] = STORAGE_PAGES_PER_SLOT - 1;
+    slot_seq[slot] = 0;
+  }
+  slot_scanned[slot] = 1;
+  return newest;
+}
+
+bool storage_read(enum storage_slot_t slot, void *data, unsigned int len) {
+  if (len > STORAGE_MAX_LEN)
+    return false;
+
+  int page = storage_scan(slot, len);
+  if (page < 0)
+    return false;
+
+  memcpy(data, storage_page_addr(slot, page) + sizeof(struct storage_header_t), len);
+  return true;
+}
+
+/* Starts the flash write and returns without waiting for it to finish;
+ * the next storage operation waits instead.
+ */
+bool storage_write(enum storage_slot_t slot, const void *data, unsigned int len) {
+  uint32_t buf[STORAGE_PAGE_WORDS];
+  struct storage_header_t *hdr = (struct storage_header_t *)buf;
+
+  if (len > STORAGE_MAX_LEN)
+    return false;
+  if (!slot_scanned[slot])
+    storage_scan(slot, len);
+
+  memset(buf, 0xff, sizeof(buf));
+  hdr->magic = STORAGE_MAGIC;
+  hdr->slot = slot;
+  hdr->len = len;
+  hdr->seq = slot_seq[slot] + 1;
+  memcpy(hdr + 1, data, len);
+  hdr->crc = storage_crc(hdr, hdr + 1);
+
+  unsigned int page = (slot_page[slot] + 1) % STORAGE_PAGES_PER_SLOT;
+  volatile uint32_t *dst = (volatile uint32_t *)storage_page_addr(slot, page);
+  uint32_t flash_page = STORAGE_SLOT_PAGE(slot) + page;
+
+  storage_wait_ready();
+  /* Writes to the flash address space land in the page latch buffer */
+  for (unsigned int i = 0 ; i < STORAGE_PAGE_WORDS ; i++)
+    dst[i] = buf[i];
+  EFC1->EEFC_FCR = EEFC_FCR_FKEY(0x5A) | EEFC_FCR_FARG(flash_page) | EEFC_FCR_FCMD(EFC_FCMD_EWP);
+  if (EFC1->EEFC_FSR & (EEFC_FSR_FCMDE | EEFC_FSR_FLOCKE)) {
+    errorf("Flash write error on page %u\r\n", flash_page);
+    return false;
+  }
+
+  slot_page[slot] = page;
+  slot_seq[slot] = hdr->seq;
+  return true;
+}
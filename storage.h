@@ -0,0 +1,15 @@
+#ifndef __STORAGE_H
+#define __STORAGE_H
+
+enum storage_slot_t {
+  STORAGE_PLL_STATE,
+  STORAGE_GPS_PROTOCOL,
+  STORAGE_GPS_POSITION,
+  STORAGE_LOG_LEVELS,
+  STORAGE_SLOTS
+};
+
+extern bool storage_read(enum storage_slot_t slot, void *data, unsigned int len);
+extern bool storage_write(enum storage_slot_t slot, const void *data, unsigned int len);
+
+#endif
@@ -1,9 +1,29 @@
+#define LOG_SUBSYSTEM LOG_TIMER /* For debug.h */
 #include "config.h"
 #include "debug.h"
 #include "ethernet.h"
 #include "timing.h"
+#include "hist.h"
+#include "prof.h"
 
 volatile char pps_int = 0;
+volatile char second_tick = 0;
+volatile uint32_t pps_count = 0;
+volatile uint32_t pps_capture = 0;
+volatile uint64_t pps_capture_tick = 0;
+volatile uint32_t pps_capture_second = 0;
+/* Timer periods since boot, and their lengths added up. With the counter,
+ * the latter is "timer time", which only goes forwards and is what we use
+ * to put events in order. Periods are HZ give or take the DDS offset and
+ * any slew, so it's the real lengths that are added.
+ */
+static volatile uint32_t timer_seconds = 0;
+static volatile uint64_t timer_ticks = 0; /* At the top of this period */
+static uint32_t timer_period = HZ;        /* This period's, TC_RC */
+/* TC_SR clears as it's read, so what timer_now() reads is kept here for
+ * the interrupt handler.
+ */
+static volatile uint32_t timer_status = 0;
 static char pps_output_enabled = 0;
 
 static void timer1_setup() {
@@ -54,7 +74,8 @@ static void timers_start() {
   TC0->TC_BCR = TC_BCR_SYNC;
 }
 
-static void timers_sync() {
+/* Returns the count it reset the timers at */
+static int32_t timers_sync() {
   do { } while (! (TC0->TC_CHANNEL[1].TC_SR & TC_SR_CPCS));
   int32_t tgt = TC0->TC_CHANNEL[1].TC_RA + ((uint64_t)HZ * (PPS_OFFSET_NS + PPS_FUDGE_NS)) / 1000000000L - 2;
   if (tgt < 0)
@@ -67,35 +88,139 @@ static void timers_sync() {
     diff = TC0->TC_CHANNEL[1].TC_CV - tgt;
   } while (diff > 1 || diff < -1);
   TC0->TC_BCR = TC_BCR_SYNC;
+  return tgt + diff;
 }
 
+static uint32_t timer_max = HZ;
+static volatile int32_t slew_remaining = 0;
+static int32_t slew_step = 0;
+static int32_t slew_max = PLL_SLEW_MAX_NS / NSPT;
+
 void timers_set_max(uint32_t max) {
-  TC0->TC_CHANNEL[0].TC_RC = TC0->TC_CHANNEL[1].TC_RC = max;
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  uint32_t masked = prof_cycles();
+  timer_max = max;
+  timer_period = timer_max + slew_step;
+  TC0->TC_CHANNEL[0].TC_RC = TC0->TC_CHANNEL[1].TC_RC = timer_period;
+  if (!primask)
+    prof_end(PROF_IRQ_MASKED, masked);
+  __set_PRIMASK(primask);
 }
 
 static int jam_sync = 1;
 
 void timers_jam_sync() {
+  slew_remaining = 0;
   jam_sync = 1;
 }
 
+/* Shift the phase of the timers by stretching (positive) or shrinking
+ * (negative) the period by up to slew_max ticks per second, until the
+ * requested number of ticks has been taken up.
+ */
+void timers_slew(int32_t ticks) {
+  slew_remaining += ticks;
+}
+
+bool timers_slew_pending() {
+  return slew_remaining != 0;
+}
+
+int32_t timers_get_slew_remaining() {
+  return slew_remaining;
+}
+
+void timers_set_slew_max(int32_t ticks) {
+  slew_max = ticks > 0 ? ticks : 1;
+}
+
+/* Called at the top of each timer period, so the new RC only ever
+ * applies to a whole second.
+ */
+static void timers_slew_tick() {
+  int32_t step = slew_remaining;
+  if (step > slew_max)
+    step = slew_max;
+  else if (step < -slew_max)
+    step = -slew_max;
+  slew_remaining -= step;
+
+  if (step != slew_step) {
+    slew_step = step;
+    timer_period = timer_max + slew_step;
+    TC0->TC_CHANNEL[0].TC_RC = TC0->TC_CHANNEL[1].TC_RC = timer_period;
+  }
+}
+
 void TC1_Handler() {
-  uint32_t status = TC0->TC_CHANNEL[1].TC_SR;
+  uint32_t start = prof_cycles();
+  uint32_t status = timer_status | TC0->TC_CHANNEL[1].TC_SR;
+  uint32_t wrapped = 0; /* Length of the period that just ended */
+  timer_status = 0;
   if (status & TC_SR_CPCS) { // On RC compare (1Hz)
+    timer_seconds++;
+    wrapped = timer_period;
+    timer_ticks += wrapped;
+    timers_slew_tick();
     second_int();
+    second_tick = 1;
   }
   if (status & TC_SR_LDRAS) { // On rising edge of PPS
-    debug("CAPT: ");
     uint32_t tm = TC0->TC_CHANNEL[1].TC_RA;
+    uint32_t cv = TC0->TC_CHANNEL[1].TC_CV;
     TC0->TC_CHANNEL[1].TC_RB;
-    debug(tm); debug("\r\n");
+    hist_record(HIST_PPS_IRQ, cv >= tm ? cv - tm : cv + TC0->TC_CHANNEL[1].TC_RC - tm);
+    debugf("CAPT: %lu\r\n", tm);
+    /* If the counter has wrapped since the edge, and we just counted that
+     * wrap above, the edge belongs to the second before.
+     */
+    uint32_t sec = timer_seconds;
+    uint64_t ticks = timer_ticks;
+    if (cv < tm && (status & TC_SR_CPCS)) {
+      sec--;
+      ticks -= wrapped;
+    }
+    pps_capture = tm;
+    pps_capture_tick = ticks + tm;
+    pps_capture_second = tm > TC0->TC_CHANNEL[1].TC_RC / 2 ? sec + 1 : sec;
+    pps_count++;
     if (jam_sync) {
-      timers_sync();
+      /* timers_sync() eats the wrap it waits for, then cuts the new
+       * period short
+       */
+      uint32_t period = timer_period;
+      int32_t cut = timers_sync();
+      timer_seconds++;
+      timer_ticks += period + cut;
       jam_sync = 0;
     } else {
       pps_int = 1;
     }
   }
+  prof_end(PROF_TC1_HANDLER, start);
+}
+
+uint32_t timer_get_seconds() {
+  return timer_seconds;
+}
+
+uint64_t timer_now() {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  uint32_t masked = prof_cycles();
+  uint64_t ticks = timer_ticks;
+  uint32_t cv = TC0->TC_CHANNEL[1].TC_CV;
+  uint32_t status = timer_status |= TC0->TC_CHANNEL[1].TC_SR;
+  /* Wrapped, but the interrupt hasn't counted it yet. If it's only
+   * wrapped since cv was read, cv is from the end of the period.
+   */
+  if ((status & TC_SR_CPCS) && cv < timer_period / 2)
+    ticks += timer_period;
+  if (!primask)
+    prof_end(PROF_IRQ_MASKED, masked);
+  __set_PRIMASK(primask);
+  return ticks + cv;
 }
 
 void timer_init() {
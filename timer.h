@@ -2,8 +2,19 @@
 #define __TIMER_H
 
 volatile extern char pps_int;
+volatile extern char second_tick;
+
+/* PPS edges: how many we've captured, and the last one, both as TC_RA and
+ * as timer time (see timer_now()), and the timer second nearest it.
+ */
+volatile extern uint32_t pps_count;
+volatile extern uint32_t pps_capture;
+volatile extern uint64_t pps_capture_tick;
+volatile extern uint32_t pps_capture_second;
 
 extern void timer_init();
+extern uint64_t timer_now();
+extern uint32_t timer_get_seconds();
 
 static inline uint32_t timer_get_counter() {
   return TC0->TC_CHANNEL[0].TC_CV;
@@ -24,6 +35,10 @@ static inline uint32_t timer_get_capture() {
 
 extern void timers_set_max(uint32_t max);
 extern void timers_jam_sync();
+extern void timers_slew(int32_t ticks);
+extern bool timers_slew_pending();
+extern int32_t timers_get_slew_remaining();
+extern void timers_set_slew_max(int32_t ticks);
 
 extern void pps_output_enable();
 extern void pps_output_disable();
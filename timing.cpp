@@ -1,16 +1,19 @@
+#define LOG_SUBSYSTEM LOG_PLL /* For debug.h */
 #include <Arduino.h>
 #include "config.h"
 #include "debug.h"
 #include "timer.h"
+#include "timing.h"
 #include "rb.h"
 #include "health.h"
 #include "monitor.h"
 #include "ethernet.h"
 #include "gps.h"
+#include "storage.h"
+#include "hist.h"
 
 static unsigned short gps_week = 0;
 static uint32_t tow_sec_utc = 0;
-static int32_t sawtooth = 0;
 
 void time_set_date(unsigned short week, unsigned int gps_tow, short offset) {
   if ((int)gps_tow + offset < 0) {
@@ -23,7 +26,7 @@ void time_set_date(unsigned short week, unsigned int gps_tow, short offset) {
 }
 
 uint32_t make_ns(uint32_t tm, char *carry) {
-  uint32_t ns = ((uint64_t)tm * 1000000LL) / HZ + PPS_OFFSET_NS;
+  uint32_t ns = ((uint64_t)tm * 1000000000LL) / HZ + PPS_OFFSET_NS;
   if (ns >= 1000000000L) {
     ns -= 1000000000L;
     if (carry)
@@ -100,14 +103,88 @@ static int pll_min_factor = PLL_MIN_FACTOR;
 static int pll_max_factor = PLL_MAX_FACTOR;
 static int fll_min_factor = FLL_MIN_FACTOR;
 static int fll_max_factor = FLL_MAX_FACTOR;
+static int pll_slew_max = PLL_SLEW_MAX_NS;
 
 static int jump_counter = 0;
 static int uptime = 0;
 static char holdover = 0;
-static unsigned char cycle = 0;
+
+/* The latest phase, filtered phase and rate, for the history */
+static int32_t pll_phase = 0, pll_phase_filtered = 0, pll_rate = 0;
 
 static bool pll_enabled = true;
 
+/* Loop bandwidth "gears". We start out wide open for fast acquisition, and
+ * shift to the next narrower gear once the phase error has stayed within
+ * the current gear's limits for its whole dwell time. If the filtered phase
+ * exceeds the gear's fallback limit for PLL_GEAR_FALLBACK_SEC in a row, we
+ * shift back down.
+ */
+struct pll_gear_t {
+  int pll_factor;
+  int fll_factor;
+  int dwell;            /* Seconds of good phase needed to shift up */
+  uint32_t shift_mean;  /* Max mean |phase| (ns) over the dwell to shift up */
+  uint32_t shift_max;   /* Max |filtered phase| (ns) over the dwell to shift up */
+  uint32_t fallback;    /* |filtered phase| (ns) that makes us shift down */
+};
+
+static const struct pll_gear_t pll_gears[] = {
+  /*    PLL              FLL       dwell  mean   max  fallback */
+  { PLL_MIN_FACTOR, FLL_MIN_FACTOR,  300,  500, 1000, 100000 },
+  {           1200,           3600,  300,  200,  500,   5000 },
+  {           2400,           5400,  600,  100,  300,   3000 },
+  {           4800,           7200,  900,   60,  200,   2000 },
+  {           7200,           9000, 1800,   40,  150,   1500 },
+  { PLL_MAX_FACTOR, FLL_MAX_FACTOR,    0,    0,    0,   1000 },
+};
+
+#define PLL_GEARS (int)(sizeof(pll_gears) / sizeof(*pll_gears))
+
+static int pll_gear = 0;
+static int gear_count = 0;
+static uint32_t gear_sum = 0;
+static uint32_t gear_max = 0;
+static int gear_fallback_count = 0;
+
+/* Holdover predictor. While locked, we keep a ring of hourly averages of
+ * the applied frequency, and fit a line through them to estimate the Rb's
+ * aging. In holdover we keep following that line instead of freezing the
+ * last frequency, and the quality of the fit gives us an error bound to
+ * report as root dispersion. Frequencies are in milli-ppt.
+ */
+struct pll_drift_sample_t {
+  int32_t hour;
+  int32_t freq;
+};
+
+static struct pll_drift_sample_t drift_ring[PLL_DRIFT_HOURS];
+static int drift_head = 0;
+static int drift_count = 0;
+static int32_t drift_acc_hour = -1;
+static int64_t drift_acc_sum = 0;
+static int drift_acc_count = 0;
+static int32_t last_applied_rate = 0;
+
+static char predict_valid = 0;
+static int32_t predict_base;        /* Predicted freq at the middle of predict_hour */
+static int32_t predict_hour;
+static int32_t predict_drift;       /* Per hour */
+static int32_t predict_sigma;       /* RMS residual of the fit */
+static int32_t predict_sigma_drift; /* Standard error of the drift, per hour */
+
+struct pll_saved_state_t {
+  int32_t fll_rate;
+  int32_t rb_ppt;
+  int32_t timestamp;
+  int32_t pll_factor;
+  int32_t fll_factor;
+};
+
+static char state_restored = 0;
+static struct pll_saved_state_t restored_state;
+static unsigned int state_save_counter = 0;
+
 void pll_reset_state() {
   pll_accum = 0;
   prev_valid = 0;
@@ -120,6 +197,168 @@ void pll_reset_state() {
   prev_pps_filtered = 0;
 }
 
+static void pll_drift_fit() {
+  if (drift_count < PLL_DRIFT_MIN_HOURS) {
+    predict_valid = 0;
+    return;
+  }
+
+  int32_t newest = drift_ring[(drift_head + PLL_DRIFT_HOURS - 1) % PLL_DRIFT_HOURS].hour;
+  double sx = 0, sy = 0, sxx = 0, sxy = 0;
+  for (int i = 0 ; i < drift_count ; i++) {
+    const struct pll_drift_sample_t *sample = &drift_ring[(drift_head + PLL_DRIFT_HOURS - 1 - i) % PLL_DRIFT_HOURS];
+    double x = sample->hour - newest;
+    double y = sample->freq;
+    sx += x;
+    sy += y;
+    sxx += x * x;
+    sxy += x * y;
+  }
+
+  double n = drift_count;
+  double d = n * sxx - sx * sx;
+  if (d <= 0) {
+    predict_valid = 0;
+    return;
+  }
+  double b = (n * sxy - sx * sy) / d;
+  double a = (sy - b * sx) / n;
+
+  double ss = 0;
+  for (int i = 0 ; i < drift_count ; i++) {
+    const struct pll_drift_sample_t *sample = &drift_ring[(drift_head + PLL_DRIFT_HOURS - 1 - i) % PLL_DRIFT_HOURS];
+    double r = sample->freq - (a + b * (sample->hour - newest));
+    ss += r * r;
+  }
+  double sigma = sqrt(ss / (n - 2));
+
+  predict_base = lround(a);
+  predict_hour = newest;
+  predict_drift = lround(b);
+  predict_sigma = lround(sigma);
+  predict_sigma_drift = lround(sigma * sqrt(n / d));
+  predict_valid = 1;
+
+  debug("Drift: "); debug(predict_drift); debug(" +/- "); debug(predict_sigma_drift);
+  debug(" mppt/h, base "); debug(predict_base); debug(" +/- "); debug(predict_sigma);
+  debug(" mppt over "); debug(drift_count); debug("h\r\n");
+  monitor_send(MONITOR_DRIFT, predict_drift);
+  monitor_send(MONITOR_DRIFT_SIGMA, predict_sigma_drift);
+  monitor_send(MONITOR_DRIFT_RESIDUAL, predict_sigma);
+}
+
+/* Called every second we're locked, with the frequency we applied */
+static void pll_drift_sample(int32_t rate) {
+  int32_t hour = time_get_unix() / 3600;
+
+  if (hour != drift_acc_hour) {
+    /* Only keep hours we were locked for nearly all of */
+    if (drift_acc_hour >= 0 && drift_acc_count >= PLL_DRIFT_MIN_SAMPLES) {
+      drift_ring[drift_head].hour = drift_acc_hour;
+      drift_ring[drift_head].freq = (drift_acc_sum * 1000) / drift_acc_count;
+      drift_head = (drift_head + 1) % PLL_DRIFT_HOURS;
+      if (drift_count < PLL_DRIFT_HOURS)
+        drift_count++;
+      pll_drift_fit();
+    }
+    drift_acc_hour = hour;
+    drift_acc_sum = 0;
+    drift_acc_count = 0;
+  }
+
+  drift_acc_sum += rate;
+  drift_acc_count++;
+}
+
+/* Seconds since the middle of the hour the prediction is based on */
+static int32_t pll_predict_elapsed() {
+  return time_get_unix() - (predict_hour * 3600 + 1800);
+}
+
+/* Predicted frequency right now, in ppt */
+static int32_t pll_predict_rate() {
+  if (!predict_valid)
+    return fll_rate;
+  int64_t mppt = predict_base + ((int64_t)predict_drift * pll_predict_elapsed()) / 3600;
+  return (mppt + (mppt > 0 ? 500 : -500)) / 1000;
+}
+
+/* Bound on the time error (ns) accumulated over `age` seconds of holdover.
+ * Without enough history to fit, assume 1e-9, the same as we always have.
+ */
+uint32_t pll_holdover_error(uint32_t age) {
+  if (!predict_valid)
+    return age;
+
+  /* mppt * s = 1e-6 ns */
+  uint64_t model = (uint64_t)predict_sigma * age
+                 + ((uint64_t)predict_sigma_drift * age * age) / 7200;
+  return (PLL_HOLDOVER_FLOOR_PPT * (uint64_t)age) / 1000 + (3 * model) / 1000000;
+}
+
+static void pll_gear_reset_stats() {
+  gear_count = 0;
+  gear_sum = 0;
+  gear_max = 0;
+  gear_fallback_count = 0;
+}
+
+static void pll_shift_gear(int gear) {
+  int new_pll_factor = constrain(pll_gears[gear].pll_factor, pll_min_factor, pll_max_factor);
+  int new_fll_factor = constrain(pll_gears[gear].fll_factor, fll_min_factor, fll_max_factor);
+
+  debug("PLL gear "); debug(pll_gear); debug(" -> "); debug(gear); debug("\r\n");
+  monitor_send(MONITOR_GEAR_SHIFT, gear);
+
+  /* Rescale the integrator so the slew rate doesn't jump */
+  pll_accum = ((int64_t)pll_accum * new_pll_factor) / pll_factor;
+  pll_factor = new_pll_factor;
+  fll_factor = new_fll_factor;
+  pll_gear = gear;
+  pll_gear_reset_stats();
+}
+
+/* The highest gear that's no narrower than the given PLL factor */
+static int pll_gear_for_factor(int factor) {
+  int gear = 0;
+  while (gear < PLL_GEARS - 1 && pll_gears[gear + 1].pll_factor <= factor)
+    gear++;
+  return gear;
+}
+
+static void pll_gear_update(int32_t phase, int32_t filtered) {
+  const struct pll_gear_t *g = &pll_gears[pll_gear];
+  uint32_t abs_phase = phase < 0 ? -phase : phase;
+  uint32_t abs_filtered = filtered < 0 ? -filtered : filtered;
+
+  if (abs_filtered > g->fallback) {
+    if (++gear_fallback_count >= PLL_GEAR_FALLBACK_SEC && pll_gear > 0) {
+      pll_shift_gear(pll_gear - 1);
+    } else {
+      gear_count = 0;
+      gear_sum = 0;
+      gear_max = 0;
+    }
+    return;
+  }
+  gear_fallback_count = 0;
+
+  if (pll_gear == PLL_GEARS - 1)
+    return;
+
+  gear_count++;
+  gear_sum += abs_phase;
+  if (abs_filtered > gear_max)
+    gear_max = abs_filtered;
+
+  if (gear_count >= g->dwell) {
+    if (gear_sum / gear_count <= g->shift_mean && gear_max <= g->shift_max)
+      pll_shift_gear(pll_gear + 1);
+    else
+      pll_gear_reset_stats();
+  }
+}
+
 void pll_reset() {
   pll_reset_state();
   fll_rate = FLL_START_VALUE;
@@ -134,22 +373,52 @@ static int32_t pll_set_rate(int32_t rate) {
   int32_t timer_offs = (dds_rate + (dds_rate > 0 ? 500*NSPT : -500*NSPT)) / (1000*NSPT);
   dds_rate = 1000 * NSPT * timer_offs; /* Timer granularity NSPT ppb = 1000*NSPT ppt */
   timers_set_max((uint32_t) HZ - timer_offs);
+  pll_rate = rb_rate + dds_rate;
 
   debug(slew_rate); debug(" PLL + "); debug(fll_adjusted); debug(" FLL = "); debug(rate);
   debug(" [ "); debug(rb_rate); debug(" Rb + "); debug(dds_rate); debug(" digital ]\r\n");
 
-  monitor_send("fll", fll_adjusted);
-  monitor_send("freq", rate);
+  monitor_send(MONITOR_FLL, fll_adjusted);
+  monitor_send(MONITOR_FREQ, rate);
 
   return rb_rate + dds_rate;
 }
 
+/* We can't tell how old the saved state is until GPS has given us the date,
+ * which it has by the time the PLL first runs, so none of it is applied
+ * till then.
+ */
+static void pll_check_restored_state() {
+  struct pll_saved_state_t *state = &restored_state;
+  int32_t age = time_get_unix() - state->timestamp;
+  state_restored = 0;
+
+  if (age < 0 || age > PLL_STATE_MAX_AGE_SEC) {
+    debug("Saved loop state is "); debug(age); debug("s old, discarding\r\n");
+    return;
+  }
+
+  fll_set_coeff(state->fll_rate);
+  pll_shift_gear(pll_gear_for_factor(state->pll_factor));
+  uptime = 300;
+  rb_restore_frequency(state->rb_ppt);
+
+  debug("Restored loop state: FLL "); debug(fll_rate);
+  debug(" Rb "); debug(state->rb_ppt);
+  debug(" gear "); debug(pll_gear);
+  debug("\r\n");
+}
+
 void pll_run() {
   int32_t pps_ns;
-  bool ts_from_gps = gps_get_timestamp(&pps_ns);
+  enum gps_phase_t phase = gps_get_phase(&pps_ns);
+
+  if (state_restored)
+    pll_check_restored_state();
 
-  if (!ts_from_gps) {
-    pps_ns = time_get_ns(*TIMER_CAPT_PPS, NULL) + PPS_FUDGE_NS;
+  if (phase == GPS_PHASE_NONE) {
+    debug("PPS: no timestamp for this edge, skipping\r\n");
+    return;
   }
 
   if (pps_ns > 500000000)
@@ -159,10 +428,8 @@ void pll_run() {
 
   debug("PPS: ");
   debug(pps_ns);
-//  debug(" + ");
-//  debug(sawtooth);
 
-  monitor_send("phase_raw", pps_ns);
+  monitor_send(MONITOR_PHASE_RAW, pps_ns);
 
   /* Ignore a jump of 1us or more by repeating the previous measurement.
    * If it persists for 3 seconds, though, allow it through.
@@ -175,22 +442,52 @@ void pll_run() {
   } else {
     jump_counter = 0;
   }
+  pll_phase = pps_ns;
 
-  /* If we're more than 100us out of whack, or we take a phase hit (after the
-   * jump filter) of more than 10us, reset the PLL and resync instead of 
-   * trying to slew back into the zone.
+  /* If we're hopelessly out of whack, give up on the loop: resync the
+   * timers to the PPS and start over.
    */
-  if (pps_ns > 100000 || pps_ns < -100000 || 
-      (prev_valid && ((pps_ns - prev_pps_ns) >= 10000 || (pps_ns - prev_pps_ns) <= -10000))
-    ) {
+  if (pps_ns > PLL_SLEW_LIMIT_NS || pps_ns < -PLL_SLEW_LIMIT_NS) {
+    debug(" out of range, jam sync\r\n");
     monitor_flush();
+    health_set_pll_status(PLL_UNLOCK);
     timers_jam_sync();
     rb_write_divisor();
     pll_reset_state();
+    pll_shift_gear(0);
+    return;
+  }
+
+  /* If we're more than 100us out, or we take a phase hit (after the jump
+   * filter) of more than 10us, don't try to pull it in with the loop.
+   * Slew the timer phase by the whole offset instead, and freeze the loop
+   * until it's done. The loop state stays valid, since the frequency
+   * hasn't changed.
+   */
+  if (!timers_slew_pending() && (
+      pps_ns > PLL_SLEW_THRESHOLD_NS || pps_ns < -PLL_SLEW_THRESHOLD_NS ||
+      (prev_valid && ((pps_ns - prev_pps_ns) >= PLL_SLEW_STEP_NS || (pps_ns - prev_pps_ns) <= -PLL_SLEW_STEP_NS))
+    )) {
+    debug(" slewing");
+    timers_slew(pps_ns / NSPT);
+  }
+
+  if (timers_slew_pending()) {
+    debug(" slew remaining: ");
+    debug(timers_get_slew_remaining() * NSPT);
+    debug("\r\n");
+    monitor_send(MONITOR_SLEW, timers_get_slew_remaining() * NSPT);
+    /* The phase from before the slew is no reference for after it: the
+     * jump filter would put it back, and the FLL would take the step for
+     * a change in frequency. Start both over when the slew is done.
+     */
+    prev_valid = 0;
+    jump_counter = 0;
     return;
   }
 
-  monitor_send("phase", pps_ns);
+  monitor_send(MONITOR_PHASE, pps_ns);
+  hist_record(HIST_PHASE, pps_ns < 0 ? -pps_ns : pps_ns);
 
   int32_t pps_filtered;
 
@@ -210,9 +507,11 @@ void pll_run() {
   debug(" (");
   debug(pps_filtered);
   debug(")");
-  monitor_send("phase_filtered", pps_filtered);
+  monitor_send(MONITOR_PHASE_FILTERED, pps_filtered);
+  pll_phase_filtered = pps_filtered;
+  hist_record(HIST_PHASE_FILTERED, pps_filtered < 0 ? -pps_filtered : pps_filtered);
 
-  if (ts_from_gps) {
+  if (phase == GPS_PHASE_TM2) {
     debug(" GPS\r\n");
   } else {
     debug("\r\n");
@@ -227,7 +526,7 @@ void pll_run() {
     if (prev_valid) {
       if (uptime >= 180) {
         fll_accum += prev_slew_rate - 1000 * (pps_filtered - prev_pps_filtered);
-        monitor_send("fll_accum", fll_accum);
+        monitor_send(MONITOR_FLL_ACCUM, fll_accum);
 
         int32_t mod_rate = 2 * fll_accum / (fll_factor * FLL_SMOOTH);
         if (mod_rate > 0) {
@@ -264,28 +563,20 @@ void pll_run() {
       }
     }
 
-    monitor_send("pll_factor", pll_factor);
-    monitor_send("fll_factor", fll_factor);
+    monitor_send(MONITOR_PLL_FACTOR, pll_factor);
+    monitor_send(MONITOR_FLL_FACTOR, fll_factor);
 
     int32_t rate = slew_rate + fll_rate + fll_extra;
     int32_t applied_rate = pll_set_rate(rate);
+    last_applied_rate = applied_rate;
 
     pll_accum -= (applied_rate - (fll_rate + fll_extra)) * pll_factor;
 
-    if (uptime < 300) {
+    if (uptime < 300)
       uptime ++;
-    } else {
-      cycle ++;
 
-      if (pps_filtered >= -PLL_HEALTHY_THRESHOLD_NS && pps_filtered <= PLL_HEALTHY_THRESHOLD_NS) {
-        if (cycle % 2 == 0 && pll_factor < pll_max_factor) {
-          pll_factor ++;
-        }
-        if (cycle % 3 == 0 && fll_factor < fll_max_factor) {
-          fll_factor ++;
-        }
-      }
-    }
+    pll_gear_update(pps_ns, pps_filtered);
+    monitor_send(MONITOR_GEAR, pll_gear);
 
     prev_slew_rate = applied_rate - (fll_rate + fll_extra);
   }
@@ -305,29 +596,86 @@ void pll_run() {
     health_set_pll_status(PLL_OK);
     health_set_fll_status(FLL_OK);
     health_reset_fll_watchdog();
+
+    if (uptime >= 300 && pll_enabled)
+      pll_drift_sample(last_applied_rate);
+
+    if (uptime >= 300 && ++state_save_counter >= PLL_STATE_SAVE_SEC) {
+      pll_save_state();
+    }
   }
 }
 
+void pll_save_state() {
+  struct pll_saved_state_t state;
+
+  if (state_restored) {
+    debug("Saved loop state not checked yet, keeping it\r\n");
+    return;
+  }
+  state.fll_rate = fll_rate;
+  state.rb_ppt = rb_get_frequency();
+  state.timestamp = time_get_unix();
+  state.pll_factor = pll_factor;
+  state.fll_factor = fll_factor;
+
+  state_save_counter = 0;
+  if (storage_write(STORAGE_PLL_STATE, &state, sizeof(state))) {
+    debug("Saved loop state\r\n");
+  }
+}
+
+/* Warm start: pick up the frequency and loop bandwidth from before the
+ * last reboot, and skip the warm-up period, once pll_check_restored_state()
+ * has found it fresh enough.
+ */
+void pll_load_state() {
+  if (!storage_read(STORAGE_PLL_STATE, &restored_state, sizeof(restored_state))) {
+    debug("No saved loop state\r\n");
+    return;
+  }
+  state_restored = 1;
+}
+
 void pll_enter_holdover() {
   holdover = 1;
   slew_rate = 0;
-  pll_set_rate(fll_rate); /* Cancel any slew in progress but keep best known FLL value */
+  /* Cancel any slew in progress and follow the predicted frequency */
+  pll_set_rate(pll_predict_rate());
   pll_reset_state(); /* Everything except FLL rate will be invalid when we come out of holdover */
 }
 
+/* Called once a second while in holdover, to follow the aging ramp */
+void pll_holdover_run() {
+  if (!holdover || !predict_valid)
+    return;
+  pll_set_rate(pll_predict_rate());
+}
+
 void pll_leave_holdover(int32_t duration) {
   debug("Leaving holdover after "); debug_int(duration); debug("s\r\n");
-  while (duration > 600) {
+  holdover = 0;
+  if (predict_valid)
+    fll_set_coeff(pll_predict_rate());
+  int gear = pll_gear;
+  while (duration > 600 && gear > 0 && pll_gears[gear - 1].pll_factor >= pll_max_factor / 3) {
     duration -= 600;
-    if (pll_factor > pll_max_factor / 3)
-      pll_factor -= pll_factor / 4;
-    if (fll_factor > fll_max_factor / 3)
-      fll_factor -= fll_factor / 4;
+    gear--;
   }
+  if (gear != pll_gear)
+    pll_shift_gear(gear);
 }
 
-void time_set_sawtooth(int32_t s) {
-  sawtooth = s;
+int32_t pll_get_phase() {
+  return pll_phase;
+}
+
+int32_t pll_get_phase_filtered() {
+  return pll_phase_filtered;
+}
+
+int32_t pll_get_rate() {
+  return pll_rate;
 }
 
 int pll_get_factor() {
@@ -338,6 +686,14 @@ void pll_set_factor(int x) {
   pll_factor = x;
 }
 
+int pll_get_gear() {
+  return pll_gear;
+}
+
+void pll_set_gear(int x) {
+  pll_shift_gear(constrain(x, 0, PLL_GEARS - 1));
+}
+
 int pll_get_min() {
   return pll_min_factor;
 }
@@ -358,6 +714,17 @@ void pll_set_max(int x) {
     pll_factor = pll_max_factor;
 }
 
+int pll_get_slew() {
+  return pll_slew_max;
+}
+
+void pll_set_slew(int x) {
+  if (x < NSPT)
+    x = NSPT;
+  pll_slew_max = x;
+  timers_set_slew_max(pll_slew_max / NSPT);
+}
+
 void pll_set_enabled(bool en) {
   if (!en) {
     pll_set_rate(fll_rate);
@@ -13,15 +13,25 @@ extern void pll_reset();
 extern void pll_reset_state();
 extern void pll_enter_holdover();
 extern void pll_leave_holdover(int32_t duration);
-extern void time_set_sawtooth(int32_t s);
+extern void pll_holdover_run();
+extern uint32_t pll_holdover_error(uint32_t age);
+extern void pll_load_state();
+extern void pll_save_state();
+extern int32_t pll_get_phase();
+extern int32_t pll_get_phase_filtered();
+extern int32_t pll_get_rate();
 
 
 extern int pll_get_factor();
 extern void pll_set_factor(int);
+extern int pll_get_gear();
+extern void pll_set_gear(int);
 extern int pll_get_min();
 extern void pll_set_min(int);
 extern int pll_get_max();
 extern void pll_set_max(int);
+extern int pll_get_slew();
+extern void pll_set_slew(int);
 extern void pll_set_enabled(bool);
 
 extern int fll_get_factor();